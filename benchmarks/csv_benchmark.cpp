@@ -49,6 +49,117 @@ struct do_nothing {
 	}
 };
 
+// Identical to do_nothing, but returns saxy::command so that every callback
+// result has to be checked at runtime.
+struct do_nothing_command {
+	saxy::command start_row() {
+		return saxy::keep_going;
+	}
+
+	saxy::command end_row() const {
+		return saxy::keep_going;
+	}
+
+	saxy::command field(saxy::string_cview) {
+		return saxy::keep_going;
+	}
+
+	saxy::always_abort error(saxy::csv::error_code) {
+		return saxy::abort;
+	}
+};
+
+// Generate a document of addresses and free text, where most fields are
+// full of spaces and punctuation and some need quoting.
+std::string natural_language_csv(std::size_t rows) {
+	static char const* const words[] = {
+		"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "and",
+		"a", "delivery", "was", "left", "at", "reception", "(see", "note)",
+		"flat", "#4", "&", "co.", "ltd.", "please", "call", "ahead!", "it's",
+		"fragile;", "handle", "with", "care", "-", "thanks", "very", "much,"
+	};
+	std::size_t const word_count = sizeof(words) / sizeof(words[0]);
+
+	unsigned long long state = 1;
+	auto next = [&state](std::size_t n) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		return static_cast<std::size_t>(state >> 33) % n;
+	};
+
+	std::string csv;
+	saxy::csv::generator gen(3);
+	auto out = std::back_inserter(csv);
+	for(std::size_t row = 0; row < rows; ++row) {
+		std::string name = words[next(word_count)];
+		name += ' ';
+		name += words[next(word_count)];
+		out = gen.add_field(out, name);
+
+		std::string address = std::to_string(1 + next(200)) + " Main St., Springfield";
+		out = gen.add_field(out, address);
+
+		std::string text;
+		for(std::size_t i = 0, n = 5 + next(30); i < n; ++i) {
+			text += words[next(word_count)];
+			text += ' ';
+		}
+
+		out = gen.add_field(out, text);
+		out = gen.finish_row(out);
+	}
+
+	return csv;
+}
+
+long long strlen_benchmark(std::string const& csv, std::size_t& length) {
+	auto begin = std::chrono::high_resolution_clock::now();
+	auto tick_start = __rdtsc();
+	length = std::strlen(csv.data());
+	auto tick_end = __rdtsc();
+
+	auto end = std::chrono::high_resolution_clock::now();
+	auto dur = end - begin;
+	auto tick_count = tick_end - tick_start;
+	long long strlen_time = std::chrono::duration_cast<std::chrono::microseconds>(dur).count();
+	strlen_time = std::max<long long>(strlen_time, 1);
+	std::cout << length / 1024 << " Kb\n";
+	std::cout << "std::strlen time: " << strlen_time << "us\n";
+	std::cout << "MB/sec parsed: " << (1024.0 * 1024.0 * length) / (1000.0 * 1000.0 * strlen_time) << '\n';
+	std::cout << "std::strlen ticks/char: " << static_cast<double>(tick_count) / length << "\n\n";
+	return strlen_time;
+}
+
+template <typename Callback>
+void in_place_benchmark(char const* name, std::string csv, std::size_t length, long long strlen_time, saxy::csv::engine e = saxy::csv::state_machine_engine) {
+	double us = 0.0;
+	double ticks = 0;
+	const int how = 100;
+	for (int i = 0; i < how; ++i) {
+		Callback cb;
+
+		auto begin = std::chrono::high_resolution_clock::now();
+		auto tick_start = __rdtsc();
+		saxy::csv::parse(cb, e, &csv[0], csv.size());
+		auto tick_end = __rdtsc();
+		auto end = std::chrono::high_resolution_clock::now();
+
+		auto dur = end - begin;
+		ticks += tick_end - tick_start;
+		us += std::chrono::duration_cast<std::chrono::microseconds>(dur).count();
+	}
+
+	us /= how;
+	ticks /= how;
+	std::ios_base::fmtflags const flags = std::cout.flags();
+	std::streamsize const precision = std::cout.precision();
+	std::cout << "In-place parse time (" << name << "): " << us << "us\n";
+	std::cout << "MB/sec parsed: " << (1024.0 * 1024.0 * length) / (1000.0 * 1000.0 * us) << '\n';
+	std::cout << "ticks/char: " << static_cast<double>(ticks / 10) / length << "\n";
+	std::cout << "strlen ratio: " << std::fixed << std::setprecision(2) << static_cast<double>(us) / strlen_time << "x\n\n";
+	std::cout.flags(flags);
+	std::cout.precision(precision);
+}
+
 int main() {
 	std::size_t const rows = 10000;
 	std::size_t const columns = 10;
@@ -76,23 +187,7 @@ int main() {
 	}
 
 	std::size_t length;
-	long long strlen_time;
-	{
-		auto begin = std::chrono::high_resolution_clock::now();
-		auto tick_start = __rdtsc();
-		length = std::strlen(csv.data());
-		auto tick_end = __rdtsc();
-
-		auto end = std::chrono::high_resolution_clock::now();
-		auto dur = end - begin;
-		auto tick_count = tick_end - tick_start;
-		strlen_time = std::chrono::duration_cast<std::chrono::microseconds>(dur).count();
-		strlen_time = std::max<long long>(strlen_time, 1);
-		std::cout << length / 1024 << " Kb\n";
-		std::cout << "std::strlen time: " << strlen_time << "us\n";
-		std::cout << "MB/sec parsed: " << (1024.0 * 1024.0 * length) / (1000.0 * 1000.0 * strlen_time) << '\n';
-		std::cout << "std::strlen ticks/char: " << static_cast<double>(tick_count) / length << "\n\n";
-	}
+	long long const strlen_time = strlen_benchmark(csv, length);
 
 #if 0
 	{
@@ -119,27 +214,32 @@ int main() {
 	}
 #endif
 
-	double us = 0.0;
-	double ticks = 0;
-	const int how = 100;
-	for (int i = 0; i < how; ++i) {
-		do_nothing cb;
+	in_place_benchmark<do_nothing>("always_keep_going", csv, length, strlen_time);
+	in_place_benchmark<do_nothing_command>("command", csv, length, strlen_time);
+	in_place_benchmark<do_nothing>("always_keep_going, DFA engine", csv, length, strlen_time, saxy::csv::dfa_engine);
 
-		auto begin = std::chrono::high_resolution_clock::now();
-		auto tick_start = __rdtsc();
-		saxy::csv::parse(cb, &csv[0], csv.size());
-		auto tick_end = __rdtsc();
-		auto end = std::chrono::high_resolution_clock::now();
+	{
+		double us = 0.0;
+		const int how = 100;
+		std::size_t rows = 0;
+		for (int i = 0; i < how; ++i) {
+			auto begin = std::chrono::high_resolution_clock::now();
+			rows += saxy::csv::validate(csv.data(), csv.size()).rows;
+			auto end = std::chrono::high_resolution_clock::now();
+			us += std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+		}
 
-		auto dur = end - begin;
-		ticks += tick_end - tick_start;
-		us += std::chrono::duration_cast<std::chrono::microseconds>(dur).count();
+		us /= how;
+		std::cout << "Validate time: " << us << "us (" << rows / how << " rows)\n";
+		std::cout << "MB/sec validated: " << (1024.0 * 1024.0 * length) / (1000.0 * 1000.0 * us) << '\n';
+		std::cout << "strlen ratio: " << std::fixed << std::setprecision(2) << us / strlen_time << "x\n\n";
 	}
 
-	us /= how;
-	ticks /= how;
-	std::cout << "In-place parse time: " << us << "us\n";
-	std::cout << "MB/sec parsed: " << (1024.0 * 1024.0 * length) / (1000.0 * 1000.0 * us) << '\n';
-	std::cout << "ticks/char: " << static_cast<double>(ticks / 10) / length << "\n";
-	std::cout << "strlen ratio: " << std::fixed << std::setprecision(2) << static_cast<double>(us) / strlen_time << "x\n\n";
+	{
+		std::string const text = natural_language_csv(20000);
+		std::size_t text_length;
+		long long const text_strlen_time = strlen_benchmark(text, text_length);
+		in_place_benchmark<do_nothing>("natural language", text, text_length, text_strlen_time);
+		in_place_benchmark<do_nothing>("natural language, DFA engine", text, text_length, text_strlen_time, saxy::csv::dfa_engine);
+	}
 }
@@ -66,6 +66,8 @@ char const* error_code_to_string(saxy::csv::error_code ec) {
 			return "Text found after closing quote";
 		case saxy::csv::unfinished_crlf:
 			return "Line feed (\\n) expected here";
+		case saxy::csv::wrong_field_count:
+			return "Row has a different number of fields to the first row";
 		default:
 			return "Unknown error";
 	}
@@ -76,35 +78,35 @@ int main() {
 
 	csv_to_vector callback;
 	saxy::csv::parser<> parser;
+	parser.set_field_count(saxy::csv::field_count::consistent());
 
 	// Read each line and parse the result
 	std::string line;
 	std::string const end_line = "\r\n";
 	while(std::getline(std::cin, line) && !line.empty()) {
 		std::string::const_iterator finish_it;
+		std::size_t error_index;
 		if(!parser.parse(callback, line.cbegin(), line.cend(), &finish_it)) {
-			std::cerr << "Parse error!\n";
-			std::cerr << line << std::endl;
-			const std::size_t error_index = finish_it - line.cbegin() - 1;
-			std::fill_n(std::ostream_iterator<char>(std::cerr), error_index, ' ');
-			std::cerr << "^----- " << error_code_to_string(callback.error_code) << std::endl;
-			return 1;
+			error_index = finish_it - line.cbegin() - 1;
+		} else if(!parser.parse(callback, end_line.cbegin(), end_line.cend())) {
+			error_index = line.size();
+		} else {
+			continue;
 		}
 
-		parser.parse(callback, end_line.cbegin(), end_line.cend());
+		std::cerr << "Parse error!\n";
+		std::cerr << line << std::endl;
+		std::fill_n(std::ostream_iterator<char>(std::cerr), error_index, ' ');
+		std::cerr << "^----- " << error_code_to_string(callback.error_code) << std::endl;
+		return 1;
 	}
 
 	const std::vector<std::vector<std::string> >& table = callback.table;
 
-	// Find the maximum size of each field in a column
-	std::vector<std::size_t> column_width;
+	// Find the maximum size of each field in a column, the parser has already
+	// checked that every row has the same number of fields
+	std::vector<std::size_t> column_width(parser.expected_fields(), 0);
 	for(std::size_t row = 0; row < table.size(); ++row) {
-		// Extend column_width if necessary
-		if(table[row].size() > column_width.size()) {
-			const std::size_t excess_columns = table[row].size() - column_width.size();
-			column_width.insert(column_width.end(), excess_columns, 0);
-		}
-
 		for(std::size_t col = 0; col < table[row].size(); ++col) {
 			column_width[col] = std::max(column_width[col], table[row][col].size());
 		}
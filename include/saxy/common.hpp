@@ -34,6 +34,11 @@
 #include "string_view.hpp"
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #if __cplusplus >= 201103L || _MSC_VER >= 1800
@@ -48,18 +53,55 @@
 #define UNREACHABLE (void*)0
 #endif
 
+// A state machine using these has a statistics policy 'stats' in scope,
+// which counts every move to a different state.
 #define SAXY_CHANGE_STATE(X) m_state = X; goto X
 #define SAXY_RESTART_STATE(X) goto X
 #define SAXY_CHANGE_STATE_AFTER(X, Y) m_state = X; do {Y;} while(false); goto X
 #define SAXY_STATE_JUMP_TABLE(X) case X: goto X
+#define SAXY_ADVANCE(X) do { if(!enc.byte(X)) { goto invalid_encoding; } ++it; } while(false)
 #define SAXY_RUN_CALLBACK(X) \
 { \
-	command c = X; \
-	if(c != keep_going) { \
+	auto const c = X; \
+	if(detail::stop_parsing(c)) { \
 		return detail::to_return_value(c); \
 	} \
 }
 
+// Statically-defined tracing probes for perf, bpftrace and SystemTap under
+// the provider "saxy". Defining SAXY_USDT before including any SAXY header
+// requires <sys/sdt.h>, which is header-only, and each probe costs a single
+// nop until a tracer attaches to it. Otherwise the probes compile to nothing.
+#if defined SAXY_USDT
+#include <sys/sdt.h>
+#define SAXY_PROBE0(NAME) DTRACE_PROBE(saxy, NAME)
+#define SAXY_PROBE1(NAME, A) DTRACE_PROBE1(saxy, NAME, A)
+#define SAXY_PROBE2(NAME, A, B) DTRACE_PROBE2(saxy, NAME, A, B)
+#define SAXY_PROBE3(NAME, A, B, C) DTRACE_PROBE3(saxy, NAME, A, B, C)
+#else
+#define SAXY_PROBE0(NAME) ((void)0)
+#define SAXY_PROBE1(NAME, A) ((void)0)
+#define SAXY_PROBE2(NAME, A, B) ((void)0)
+#define SAXY_PROBE3(NAME, A, B, C) ((void)0)
+#endif
+
+// The SSE2 code paths are compiled on x86 targets that have SSE2, unless
+// SAXY_NO_SIMD is defined. Otherwise the portable code paths read a 64-bit
+// word at a time or use lookup tables.
+#if !defined SAXY_NO_SIMD && (defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2))
+#define SAXY_SSE2 1
+#endif
+
+// AddressSanitizer reports the aligned reads past the end of NUL-terminated
+// input, so those are replaced by the scalar code when it is enabled.
+#if defined __SANITIZE_ADDRESS__
+#define SAXY_ASAN 1
+#elif defined __has_feature
+#if __has_feature(address_sanitizer)
+#define SAXY_ASAN 1
+#endif
+#endif
+
 namespace saxy {
 
 template <char State>
@@ -129,36 +171,75 @@ public:
 
 namespace detail {
 
+/// 16 bytes at a time with SSE2, or a 64-bit word at a time without it, for
+/// bytes that are contiguous in memory.
 struct simd {};
 struct no_simd {};
 
-template <typename It, typename EndIt>
-struct use_simd {
-	typedef no_simd type;
+/// 8 bytes at a time in a 64-bit word, for forward iterators whose bytes
+/// are not contiguous in memory.
+struct swar {};
+
+/// SIMD for NUL-terminated input, which only reads aligned blocks so that a
+/// read past the terminator can never cross into an unmapped page.
+struct cstr_simd {};
+
+/// is_contiguous<It>::value is true if and only if 'It' is known to point to
+/// chars that are contiguous in memory.
+template <typename It>
+struct is_contiguous {
+	static bool const value = std::is_same<It, char*>::value
+	                       || std::is_same<It, char const*>::value
+	                       || std::is_same<It, std::string::iterator>::value
+	                       || std::is_same<It, std::string::const_iterator>::value
+	                       || std::is_same<It, std::vector<char>::iterator>::value
+	                       || std::is_same<It, std::vector<char>::const_iterator>::value;
 };
 
-template <>
-struct use_simd<char*, char*> {
-	typedef simd type;
+/// is_forward_char_iterator<It>::value is true if and only if 'It' is a
+/// forward iterator over chars.
+template <typename It>
+struct is_forward_char_iterator {
+	static bool const value = std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<It>::iterator_category>::value
+	                       && std::is_same<typename std::remove_cv<typename std::iterator_traits<It>::value_type>::type, char>::value;
 };
 
-template <>
-struct use_simd<char const*, char*> {
-	typedef simd type;
+/// Select how many bytes the field scanners look at in one go for input in
+/// [It, EndIt).
+template <typename It, typename EndIt>
+struct use_simd {
+	typedef typename std::conditional<
+		is_contiguous<It>::value && is_contiguous<EndIt>::value
+		    && (std::is_same<It, EndIt>::value || (std::is_pointer<It>::value && std::is_pointer<EndIt>::value)),
+		simd,
+		typename std::conditional<std::is_same<It, EndIt>::value && is_forward_char_iterator<It>::value, swar, no_simd>::type
+	>::type type;
 };
 
-template <>
-struct use_simd<char*, char const*> {
-	typedef simd type;
+struct cstr_end_iterator {
+
 };
 
+// The cstr_simd scanners load whole aligned blocks, so they read up to 15
+// bytes before the first byte of the input and after its NUL. This cannot
+// fault, since an aligned block never crosses a page, but it reads memory
+// outside the string, which AddressSanitizer rejects.
 template <>
-struct use_simd<char const*, char const*> {
-	typedef simd type;
+struct use_simd<char*, cstr_end_iterator> {
+#if defined SAXY_SSE2 && !defined SAXY_ASAN
+	typedef cstr_simd type;
+#else
+	typedef no_simd type;
+#endif
 };
 
-struct cstr_end_iterator {
-
+template <>
+struct use_simd<char const*, cstr_end_iterator> {
+#if defined SAXY_SSE2 && !defined SAXY_ASAN
+	typedef cstr_simd type;
+#else
+	typedef no_simd type;
+#endif
 };
 
 inline
@@ -195,6 +276,27 @@ public:
 	}
 };
 
+/// Return the iterator \a n places after \a it, or \a end if that comes
+/// first.
+template <typename ForwardIt>
+ForwardIt advance_at_most(ForwardIt it, ForwardIt end, std::size_t n, std::random_access_iterator_tag) {
+	return static_cast<std::size_t>(end - it) > n ? it + n : end;
+}
+
+template <typename ForwardIt>
+ForwardIt advance_at_most(ForwardIt it, ForwardIt end, std::size_t n, std::forward_iterator_tag) {
+	for(; n != 0 && it != end; --n) {
+		++it;
+	}
+
+	return it;
+}
+
+template <typename ForwardIt>
+ForwardIt advance_at_most(ForwardIt it, ForwardIt end, std::size_t n) {
+	return advance_at_most(it, end, n, typename std::iterator_traits<ForwardIt>::iterator_category());
+}
+
 template <typename T>
 class scope_assign {
 	const T& m_from;
@@ -213,12 +315,73 @@ public:
 	}
 };
 
+/// Add the distance from \a first to wherever \a last points to \a count,
+/// if it is not null, when leaving the scope, even by an exception.
+template <typename ForwardIt>
+class scope_distance {
+	ForwardIt m_first;
+	ForwardIt const* m_last;
+	std::size_t* m_count;
+
+public:
+	scope_distance(ForwardIt first, ForwardIt const* last, std::size_t* count)
+	: m_first(first)
+	, m_last(last)
+	, m_count(count) {
+	}
+
+	~scope_distance() {
+		if(m_count) {
+			*m_count += std::distance(m_first, *m_last);
+		}
+	}
+};
+
+/// Return whether the callback result \a c ends the current parse. The
+/// overloads for the tag types are constant so that callbacks returning them
+/// need no branch on their result.
+inline
+bool stop_parsing(command c) {
+	return c != keep_going;
+}
+
+inline
+bool stop_parsing(always_keep_going) {
+	return false;
+}
+
+inline
+bool stop_parsing(always_stop) {
+	return true;
+}
+
+inline
+bool stop_parsing(always_abort) {
+	return true;
+}
+
 inline
 bool to_return_value(command c) {
 	assert(c != keep_going);
 	return c == stop;
 }
 
+inline
+bool to_return_value(always_keep_going) {
+	assert(false);
+	return true;
+}
+
+inline
+bool to_return_value(always_stop) {
+	return true;
+}
+
+inline
+bool to_return_value(always_abort) {
+	return false;
+}
+
 template <typename Vector>
 class append_to_vector {
 	Vector* m_container;
@@ -229,7 +392,9 @@ public:
 	}
 
 	void start(char const*) const {
-		m_container->push_back('\0');
+		// A quoted field is started again after its opening quote, which
+		// must not add a second terminator
+		m_container->assign(1, '\0');
 	}
 
 	void append(char ch) {
@@ -306,6 +471,17 @@ public:
 		}
 	}
 
+	/// Until a field has needed unescaping the bytes are already in place
+	/// and nothing is written, after that they are moved back in one go.
+	void append(char* begin, char* end) {
+		std::size_t const length = end - begin;
+		if(m_current != begin) {
+			std::memmove(m_current, begin, length);
+		}
+
+		m_current += length;
+	}
+
 	void append_same(char) {
 		m_current++;
 	}
@@ -315,7 +491,8 @@ public:
 		m_current += (end - begin);
 	}
 
-	void clear() const {
+	void clear() {
+		m_current = m_start;
 	}
 
 	string_view view_string() const {
@@ -323,6 +500,133 @@ public:
 	}
 };
 
+/// An encoding check that accepts every byte.
+class no_encoding_check {
+public:
+	bool byte(char) const {
+		return true;
+	}
+
+	template <typename It>
+	bool bytes(It, It, unsigned) const {
+		return true;
+	}
+
+	bool complete() const {
+		return true;
+	}
+};
+
+/// A streaming UTF-8 validator. Bytes can be passed in any number of pieces
+/// and a code point may be split between pieces.
+class utf8_validator {
+	unsigned char m_lower;
+	unsigned char m_upper;
+	unsigned char m_needed;
+
+public:
+	utf8_validator()
+	: m_lower(0x80)
+	, m_upper(0xBF)
+	, m_needed(0) {
+	}
+
+	/// Return false if \a ch cannot follow the bytes already seen.
+	bool byte(char ch) {
+		unsigned char const b = static_cast<unsigned char>(ch);
+		if(m_needed == 0) {
+			if(b < 0x80) {
+				return true;
+			} else if(b < 0xC2) {
+				return false;
+			} else if(b < 0xE0) {
+				m_needed = 1;
+			} else if(b < 0xF0) {
+				m_needed = 2;
+				m_lower = b == 0xE0 ? 0xA0 : 0x80; // overlong
+				m_upper = b == 0xED ? 0x9F : 0xBF; // surrogates
+			} else if(b < 0xF5) {
+				m_needed = 3;
+				m_lower = b == 0xF0 ? 0x90 : 0x80; // overlong
+				m_upper = b == 0xF4 ? 0x8F : 0xBF; // > U+10FFFF
+			} else {
+				return false;
+			}
+
+			return true;
+		}
+
+		if(b < m_lower || b > m_upper) {
+			return false;
+		}
+
+		--m_needed;
+		m_lower = 0x80;
+		m_upper = 0xBF;
+		return true;
+	}
+
+	/// Check the bytes in [begin, end), where bit i of \a high_bits is the
+	/// top bit of the i'th byte. Nothing is consumed if false is returned, so
+	/// the bytes can be passed to \a byte to find the invalid one.
+	template <typename It>
+	bool bytes(It begin, It end, unsigned high_bits) {
+		unsigned const length = static_cast<unsigned>(end - begin);
+		if(m_needed == 0 && (high_bits & ((1u << length) - 1)) == 0) {
+			return true;
+		}
+
+		utf8_validator const copy(*this);
+		for(; begin != end; ++begin) {
+			if(!byte(*begin)) {
+				*this = copy;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/// Return true if the bytes seen so far do not end part way through a
+	/// code point.
+	bool complete() const {
+		return m_needed == 0;
+	}
+
+	friend bool operator==(utf8_validator const& lhs, utf8_validator const& rhs) {
+		return lhs.m_needed == rhs.m_needed && lhs.m_lower == rhs.m_lower && lhs.m_upper == rhs.m_upper;
+	}
+};
+
+/// An appender that ignores everything, for parses that only need to know
+/// where the fields are and not what they contain.
+class discard {
+public:
+	void start(char const*) const {
+	}
+
+	void append(char) const {
+	}
+
+	template <typename It>
+	void append(It, It) const {
+	}
+
+	void append_same(char) const {
+	}
+
+	template <typename It>
+	void append_same(It, It) const {
+	}
+
+	void clear() const {
+	}
+
+	string_cview view_string() const {
+		return string_cview();
+	}
+};
+
 /** Returns the number of leading 0 bits in \a data. */
 __forceinline int count_leading_zeros(unsigned data) {
 #ifdef _MSC_VER
@@ -341,6 +645,129 @@ __forceinline int count_leading_zeros(unsigned data) {
 #endif
 }
 
+/** Returns the index of the first byte of \a data with its top bit set, or
+ * 8 if there are none. */
+__forceinline int first_marked_byte(std::uint64_t data) {
+#ifdef _MSC_VER
+	unsigned long index;
+	if(_BitScanForward64(&index, data)) {
+		return index / 8;
+	} else {
+		return 8;
+	}
+#else
+	if(data != 0) {
+		return __builtin_ctzll(data) / 8;
+	} else {
+		return 8;
+	}
+#endif
+}
+
+/** Returns a word with the top bit set of every byte of \a word equal to
+ * \a ch, and all other bits clear. */
+__forceinline std::uint64_t match_bytes(std::uint64_t word, char ch) {
+	std::uint64_t const low_bits = 0x7F7F7F7F7F7F7F7FULL;
+	std::uint64_t const x = word ^ (0x0101010101010101ULL * static_cast<unsigned char>(ch));
+	return ~(((x & low_bits) + low_bits) | x | low_bits);
+}
+
+/** Returns a word with the top bit set of the first byte of \a word equal to
+ * \a ch. Bits for any later bytes may be wrong. */
+__forceinline std::uint64_t match_byte(std::uint64_t word, char ch) {
+	std::uint64_t const ones = 0x0101010101010101ULL;
+	std::uint64_t const x = word ^ (ones * static_cast<unsigned char>(ch));
+	return (x - ones) & ~x & (ones << 7);
+}
+
+/** Returns the 8 bytes starting at \a bytes as a word with the first byte
+ * in the lowest bits. */
+__forceinline std::uint64_t load_word(char const* bytes) {
+	std::uint64_t word = 0;
+#if defined _MSC_VER || (defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	std::memcpy(&word, bytes, 8);
+#else
+	for(int i = 0; i < 8; ++i) {
+		word |= static_cast<std::uint64_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+	}
+#endif
+
+	return word;
+}
+
+/** Returns a mask where bit i is the top bit of byte i of \a word. */
+__forceinline unsigned top_bits(std::uint64_t word) {
+	return static_cast<unsigned>(((word & 0x8080808080808080ULL) * 0x0002040810204081ULL) >> 56);
+}
+
+/** Returns the number of 1 bits in \a data. */
+__forceinline int count_bits(unsigned data) {
+#if defined _MSC_VER && defined SAXY_SSE2
+	return __popcnt(data);
+#elif defined _MSC_VER
+	data = data - ((data >> 1) & 0x55555555u);
+	data = (data & 0x33333333u) + ((data >> 2) & 0x33333333u);
+	return static_cast<int>((((data + (data >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#else
+	return __builtin_popcount(data);
+#endif
+}
+
+/** Returns the index of the lowest 1 bit in \a data, which must not be 0. */
+__forceinline int lowest_set_bit(std::uint64_t data) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, data);
+	return index;
+#else
+	return __builtin_ctzll(data);
+#endif
+}
+
+/** Returns the index of the highest 1 bit in \a data, which must not be 0. */
+__forceinline int highest_set_bit(std::uint64_t data) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, data);
+	return index;
+#else
+	return 63 - __builtin_clzll(data);
+#endif
+}
+
+/** Returns a mask where bit i is the XOR of bits 0 to i of \a data, which
+ * turns a mask of quotes into a mask of the bytes between them. */
+__forceinline std::uint64_t prefix_xor(std::uint64_t data) {
+	data ^= data << 1;
+	data ^= data << 2;
+	data ^= data << 4;
+	data ^= data << 8;
+	data ^= data << 16;
+	data ^= data << 32;
+	return data;
+}
+
+/** Parse every buffer returned by \a reader's 'next' method with \a parser,
+ * which keeps its state from one buffer to the next, and then finish. This
+ * returns false if the parsing was aborted or \a reader reported an error,
+ * and true as soon as a callback method stops the parsing. */
+template <typename Parser, typename Callback, typename Reader>
+bool parse_buffers(Parser& parser, Callback& cb, Reader& reader) {
+	for(string_cview buffer = reader.next(); !buffer.empty(); buffer = reader.next()) {
+		SAXY_PROBE2(buffer, buffer.data(), buffer.size());
+		char const* out = buffer.end();
+		if(!parser.parse(cb, buffer.begin(), buffer.end(), &out)) {
+			return false;
+		}
+
+		if(out != buffer.end()) {
+			return true;
+		}
+	}
+
+	return reader.error().empty() && parser.finish(cb);
+}
+
 }
 
 }
@@ -31,23 +31,52 @@
 #define INCLUDE_GUARD_EFC18FC4_94A7_4E93_93A6_1D798FF911E9
 
 #include "common.hpp"
+#include "padded_buffer.hpp"
 #include "string_view.hpp"
+#include "transcoder.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #ifdef SAXY_CPP11
   #include <functional>
 #endif
+#include <istream>
 #include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#ifdef SAXY_SSE2
 #include <mmintrin.h>
 #include <xmmintrin.h>
 #include <emmintrin.h>
+#endif
+
+// The CSV state machine also counts each change of state in its statistics
+// policy, which must be in scope as 'stats'
+#define SAXY_CSV_CHANGE_STATE(X) stats.state_change(); SAXY_CHANGE_STATE(X)
+#define SAXY_CSV_CHANGE_STATE_AFTER(X, Y) stats.state_change(); SAXY_CHANGE_STATE_AFTER(X, Y)
 
 namespace saxy {
 
-class csv {
+namespace detail {
+
+/// Holds csv::name. A static data member of a class template, unlike one of
+/// a plain class, can be defined in a header that many files include.
+template <typename T>
+struct csv_name {
+	static char const* name;
+};
+
+template <typename T>
+char const* csv_name<T>::name = "CSV";
+
+}
+
+class csv : public detail::csv_name<void> {
 	enum state {
 		begin,
 		start_of_row,
@@ -59,6 +88,9 @@ class csv {
 		in_quote,
 		in_new_line,
 		require_line_feed,
+		skip_record,
+		skip_quoted_record,
+		skip_record_cr,
 		end_of_field,
 		end_of_last_field,
 		end_of_row,
@@ -66,7 +98,7 @@ class csv {
 	};
 
 public:
-	static char const* name; ///< "CSV"
+	using detail::csv_name<void>::name; ///< "CSV"
 
 	/// An enum representing the different types of CSV parsing errors
 	///
@@ -76,7 +108,32 @@ public:
 		text_after_closing_quotes, ///< Text found after closing quotes
 		unfinished_crlf,           ///< \r found after closing quotes, but the next character is not \n
 		unclosed_quote,            ///< Quoted field is unfinished (only occurs with finish())
-		no_fields_in_record        ///< A blank line was encountered
+		no_fields_in_record,       ///< A blank line was encountered
+		wrong_field_count,         ///< A record has a different number of fields than required
+		invalid_utf8               ///< Input is not valid UTF-8 (only checked if requested)
+	};
+
+	/// An enum representing which byte sequences are accepted.
+	enum encoding {
+		any_bytes, ///< Any bytes are accepted
+		utf8       ///< An 'invalid_utf8' error is generated for malformed UTF-8
+	};
+
+	/// An enum representing the different ways to parse a whole buffer.
+	enum engine {
+		state_machine_engine, ///< A state machine run byte by byte, skipping through fields 16 bytes at a time
+		dfa_engine            ///< Field boundaries found as bitmasks 64 bytes at a time, then checked field by field
+	};
+
+	/// Where an error was found, passed to a callback method
+	/// 'error(error_code, error_position const&)'. The rows and fields are
+	/// counted while parsing, and the offset of the start of a record is
+	/// noted when the one before it ends.
+	struct error_position {
+		std::size_t row;    ///< Number of records before the one with the error
+		std::size_t field;  ///< Number of fields before the error in its record
+		std::size_t column; ///< Offset of the error from the start of its record
+		std::size_t offset; ///< Offset of the error from the start of the input
 	};
 
 	/// An enum representing all of the different events.
@@ -87,6 +144,89 @@ public:
 		error_event      ///<
 	};
 
+	//=========================================================================
+	// field_count
+	//=========================================================================
+	/// A class describing how many fields each record must have. A parser
+	/// with a field_count other than 'any()' generates a 'wrong_field_count'
+	/// error as soon as a record is found to have too many or too few fields.
+	class field_count {
+		std::size_t m_expected;
+		std::size_t m_current;
+		bool m_learn;
+
+		field_count(std::size_t expected, bool learn)
+		: m_expected(expected)
+		, m_current(0)
+		, m_learn(learn) {
+		}
+
+	public:
+		/// Records may have any number of fields.
+		static field_count any() {
+			return field_count(static_cast<std::size_t>(-1), false);
+		}
+
+		/// Every record must have as many fields as the first record.
+		static field_count consistent() {
+			return field_count(static_cast<std::size_t>(-1), true);
+		}
+
+		/// Every record must have exactly \a n fields.
+		///
+		/// @pre: n > 0
+		static field_count exactly(std::size_t n) {
+			assert(n > 0);
+			return field_count(n, false);
+		}
+
+		/// Return the number of fields every record must have, or 0 if this
+		/// is not known yet or any number is allowed.
+		std::size_t expected() const {
+			return m_expected == static_cast<std::size_t>(-1) ? 0 : m_expected;
+		}
+
+		/// Count a field that is followed by another field in the same record
+		/// and return whether the record can still be valid.
+		bool next_field() {
+			return ++m_current < m_expected;
+		}
+
+		/// Forget the fields counted in a record that is being skipped.
+		void skip_row() {
+			m_current = 0;
+		}
+
+		/// Count the last field in a record and return whether the record had
+		/// the right number of fields.
+		bool end_row() {
+			std::size_t const n = m_current + 1;
+			m_current = 0;
+			if(n == m_expected) {
+				return true;
+			} else if(m_expected != static_cast<std::size_t>(-1)) {
+				return false;
+			}
+
+			if(m_learn) {
+				m_expected = n;
+				m_learn = false;
+			}
+
+			return true;
+		}
+
+		friend bool operator==(field_count const& lhs, field_count const& rhs) {
+			return lhs.m_expected == rhs.m_expected
+			    && lhs.m_learn == rhs.m_learn
+			    && (lhs.m_current == rhs.m_current || (lhs.m_expected == static_cast<std::size_t>(-1) && !lhs.m_learn));
+		}
+
+		friend bool operator!=(field_count const& lhs, field_count const& rhs) {
+			return !(lhs == rhs);
+		}
+	};
+
 	//=========================================================================
 	// value
 	//=========================================================================
@@ -142,16 +282,270 @@ public:
 		}
 	};
 
+	//=========================================================================
+	// header
+	//=========================================================================
+	/// A class holding the column names of a CSV document with a perfect hash
+	/// from each name to its column index, so that finding a column costs one
+	/// hash and one string comparison.
+	class header {
+		std::vector<std::string> m_names;
+		std::vector<std::size_t> m_table;
+		std::size_t m_seed;
+
+		static std::size_t hash(string_cview str, std::size_t seed);
+		void build();
+
+	public:
+		enum : std::size_t {
+			npos = static_cast<std::size_t>(-1) ///< Returned by \a find for unknown names
+		};
+
+		/// Create a header with no columns.
+		header();
+
+		/// Create a header with the column names in the range [first, last).
+		template <typename InputIt>
+		header(InputIt first, InputIt last);
+
+		std::size_t size() const;
+
+		bool empty() const;
+
+		std::string const& operator[](std::size_t column) const;
+
+		/// Return the index of the first column called \a name, or npos if
+		/// there is no such column.
+		std::size_t find(string_cview name) const;
+	};
+
+	//=========================================================================
+	// header_callback
+	//=========================================================================
+	/// A class that captures the first record as a header and passes each
+	/// field of the following records to 'field(std::size_t column, str)' so
+	/// that callbacks can switch on the column instead of comparing names.
+	///
+	/// If a list of column names is given then only those columns are passed
+	/// on, and 'column' is the position of the name in that list regardless
+	/// of where the column appears in the document. The mapping is worked
+	/// out once when the header is read.
+	template <typename Callback, typename Return = command>
+	class header_callback {
+		Callback* m_cb;
+		header m_header;
+		std::vector<std::string> m_names;
+		std::vector<std::string> m_wanted;
+		std::vector<std::size_t> m_projection;
+		std::size_t m_column;
+		bool m_in_header;
+		bool m_project;
+
+	public:
+		explicit header_callback(Callback& cb)
+		: m_cb(&cb)
+		, m_column(0)
+		, m_in_header(true)
+		, m_project(false) {
+		}
+
+		template <typename InputIt>
+		header_callback(Callback& cb, InputIt first, InputIt last)
+		: m_cb(&cb)
+		, m_column(0)
+		, m_in_header(true)
+		, m_project(true) {
+			for(; first != last; ++first) {
+				string_cview const name(*first);
+				m_wanted.push_back(std::string(name.data(), name.size()));
+			}
+		}
+
+		/// Return the header, which is empty until the first record has been
+		/// parsed.
+		csv::header const& get_header() const {
+			return m_header;
+		}
+
+		Return start_row() {
+			m_column = 0;
+			if(m_in_header) {
+				return keep_going;
+			}
+
+			return m_cb->start_row();
+		}
+
+		template <typename StringView>
+		Return field(StringView str) {
+			if(m_in_header) {
+				m_names.push_back(std::string(str.data(), str.size()));
+				return keep_going;
+			}
+
+			std::size_t const column = m_column++;
+			if(!m_project) {
+				return m_cb->field(column, str);
+			}
+
+			std::size_t const index = column < m_projection.size() ? m_projection[column] : header::npos;
+			if(index == header::npos) {
+				return keep_going;
+			}
+
+			return m_cb->field(index, str);
+		}
+
+		Return end_row() {
+			if(!m_in_header) {
+				return m_cb->end_row();
+			}
+
+			m_in_header = false;
+			m_header = header(m_names.begin(), m_names.end());
+			m_names.clear();
+			if(m_project) {
+				m_projection.assign(m_header.size(), header::npos);
+				for(std::size_t i = 0; i < m_wanted.size(); ++i) {
+					std::size_t const column = m_header.find(m_wanted[i]);
+					if(column != header::npos) {
+						m_projection[column] = i;
+					}
+				}
+			}
+
+			return keep_going;
+		}
+
+		always_abort error(error_code code) {
+			return m_cb->error(code);
+		}
+	};
+
+	//=========================================================================
+	// statistics
+	//=========================================================================
+	/// An enum representing what a byte was consumed as, passed to the
+	/// 'bytes' method of a statistics policy.
+	enum byte_kind {
+		unquoted_byte,  ///< Content of an unquoted field
+		quoted_byte,    ///< Content of a quoted field
+		structural_byte ///< Commas, double quotes and line breaks
+	};
+
+	/// A statistics policy that does nothing. Parsing with this policy, as
+	/// every parse without an explicit policy does, compiles to the same code
+	/// as having no instrumentation at all.
+	struct no_statistics {
+		void bytes(byte_kind, std::size_t) {
+		}
+
+		void simd_block(std::size_t, bool) {
+		}
+
+		void simd_fallback() {
+		}
+
+		void state_change() {
+		}
+
+		void quoted_field() {
+		}
+
+		void field() {
+		}
+
+		void row() {
+		}
+
+		void stop() {
+		}
+	};
+
+	/// A statistics policy counting what happens on the hot path of a parse.
+	/// The counters accumulate over every parse the object is passed to.
+	///
+	/// Any class with the same methods can be used as a policy instead.
+	struct statistics {
+		unsigned long long unquoted_bytes;   ///< Bytes of unquoted field content
+		unsigned long long quoted_bytes;     ///< Bytes of quoted field content
+		unsigned long long structural_bytes; ///< Commas, double quotes and line breaks
+		unsigned long long simd_bytes;       ///< Bytes consumed by the SIMD loops
+		unsigned long long simd_blocks;      ///< Whole blocks or words without a special character
+		unsigned long long simd_fallbacks;   ///< Fields that the scalar loop went on with after the SIMD loop
+		unsigned long long state_changes;    ///< Moves of the state machine to a different state
+		unsigned long long quoted_fields;    ///< Fields starting with a double quote
+		unsigned long long fields;           ///< Fields passed to the callback
+		unsigned long long rows;             ///< Records passed to the callback
+		unsigned long long stops;            ///< Callbacks that returned 'stop'
+
+		statistics();
+
+		/// Return the total number of bytes consumed.
+		unsigned long long total_bytes() const;
+
+		void bytes(byte_kind kind, std::size_t n);
+
+		/// Record that a block of 16 bytes, or a word of 8 without SSE2 or
+		/// for iterators that aren't contiguous, was loaded and the first
+		/// \a n bytes of it were consumed, which were all of it if \a whole.
+		void simd_block(std::size_t n, bool whole);
+
+		void simd_fallback() {
+			++simd_fallbacks;
+		}
+
+		void state_change() {
+			++state_changes;
+		}
+
+		void quoted_field() {
+			++quoted_fields;
+		}
+
+		void field() {
+			++fields;
+		}
+
+		void row() {
+			++rows;
+		}
+
+		void stop() {
+			++stops;
+		}
+	};
+
+private:
+	/// How far a parser has got through its input, kept from one call to
+	/// the next so that offsets and error positions count from its start.
+	struct stream_position {
+		std::size_t offset;       ///< Bytes parsed before the current call
+		std::size_t record_start; ///< Offset of the start of the current record
+		std::size_t rows;         ///< Records ended or skipped
+		std::size_t fields;       ///< Fields in the current record
+	};
+
+public:
 	//=========================================================================
 	// in_place_parser
 	//=========================================================================
 	/// A class representing an event-based CSV parser that performs a
 	/// destructive, or in-place, parse.
+	class transcoding_parser;
+
 	class in_place_parser {
 		detail::in_place m_appender;
 		char* m_end;
 		state m_state;
 		char* m_pos;
+		std::vector<string_view> m_row;
+		field_count m_field_count;
+		encoding m_encoding;
+		detail::utf8_validator m_utf8;
+		stream_position m_position;
+
+		friend class transcoding_parser;
 
 	public:
 		/// Create an in_place_parser that will never generate any events.
@@ -166,6 +560,11 @@ public:
 		///           be modified.
 		in_place_parser(char* start, std::size_t length);
 
+		/// Create an in_place_parser as above that requires every record to
+		/// have the number of fields described by \a count and the input to
+		/// be in the encoding \a enc.
+		in_place_parser(char* start, std::size_t length, field_count const& count, encoding enc = any_bytes);
+
 		/// 
 		char const* position() const;
 
@@ -182,8 +581,30 @@ public:
 		/// generated. The return value of the callback method determines
 		/// whether the parsing continues. This method returns true unless
 		/// a method returns saxy::abort.
+		///
+		/// If 'cb' has a method 'row(string_view const*, std::size_t)' then
+		/// it is called once per record with all of its fields instead of
+		/// 'start_row', 'field' and 'end_row'. Records with errors are
+		/// skipped if 'cb' has a method 'bad_record' as described for the
+		/// static 'parse', and errors are given their position if 'cb' has
+		/// a method 'error(error_code, error_position const&)', with offsets
+		/// from the start of the string however many calls it is parsed over.
 		template <typename Callback>
 		bool parse(Callback& cb, std::size_t max_parse = -1);
+
+		/// Parse as above, recording what happens in \a stats, e.g. a
+		/// 'statistics' object.
+		template <typename Callback, typename Stats>
+		bool parse(Callback& cb, Stats& stats, std::size_t max_parse = -1);
+
+		/// Generate the events for the end of the input once everything has
+		/// been parsed, such as the last record when it has no line break.
+		template <typename Callback>
+		bool finish(Callback& cb);
+
+		/// Finish as above, recording what happens in \a stats.
+		template <typename Callback, typename Stats>
+		bool finish(Callback& cb, Stats& stats);
 	};
 
 	//=========================================================================
@@ -191,14 +612,62 @@ public:
 	//=========================================================================
 	/// A class representing an event-based CSV parser that performs a
 	/// non-destructive, but slower than \a in_place_parser, parse.
+	///
+	/// A field is copied into a buffer owned by the parser before it is
+	/// passed on. If \a cb has a method 'field_chunk(string_cview, bool)'
+	/// and a chunk size has been set, long fields are passed to 'field_chunk'
+	/// in pieces of the chunk size with 'false', and then their last piece,
+	/// which may be empty, with 'true' in place of a call to 'field'.
+	///
+	/// The offsets passed to 'bad_record' and 'error(error_code,
+	/// error_position const&)' count from the first byte given to the
+	/// parser, so they do not depend on how the input is split between
+	/// calls to 'parse'.
 	template <template <typename> class Allocator = std::allocator>
 	class parser {
 		std::vector<char, Allocator<char> > m_field;
 		state m_state;
+		field_count m_field_count;
+		encoding m_encoding;
+		detail::utf8_validator m_utf8;
+		std::size_t m_chunk_size;
+		std::size_t m_max_capacity;
+		bool m_chunked;
+		stream_position m_position;
 
 		template <template <typename> class OtherAlloc>
 		friend class parser;
 
+		template <typename Callback, typename Stats, typename ForwardIt>
+		bool parse_range(Callback& cb, Stats& stats, ForwardIt it, ForwardIt end, ForwardIt* out, std::false_type);
+
+		template <typename Callback, typename Stats, typename ForwardIt>
+		bool parse_range(Callback& cb, Stats& stats, ForwardIt it, ForwardIt end, ForwardIt* out, std::true_type);
+
+		/// Pass as many whole chunks of the current field as there are to
+		/// 'field_chunk' and keep the rest.
+		template <typename Callback>
+		command flush_chunks(Callback& cb);
+
+		/// Free the field buffer if more than the maximum capacity is
+		/// reserved and the current field fits in less.
+		void release_memory();
+
+		/// Return where to keep count of the bytes parsed, which is only
+		/// done for callbacks that are given offsets.
+		template <typename Callback>
+		std::size_t* offset_count() {
+			return has_bad_record<Callback>::value || has_error_position<Callback>::value ? &m_position.offset : 0;
+		}
+
+		/// Pass on any error that \a scb held back, which leaves no field
+		/// chunked, as described for stream_callback.
+		template <typename Stream, typename Callback, typename ForwardIt>
+		bool report(Callback& cb, typename Stream::type& scb, ForwardIt first, ForwardIt stop, bool result);
+
+		template <typename Stream, typename Callback>
+		bool report_finish(Callback& cb, typename Stream::type& scb, bool result);
+
 	public:
 		parser();
 
@@ -206,6 +675,30 @@ public:
 
 		parser(std::size_t initial_capacity, const Allocator<char>& alloc);
 
+		/// Require every record parsed from now on to have the number of
+		/// fields described by \a count.
+		void set_field_count(field_count const& count);
+
+		/// Return the number of fields every record must have, or 0 if this
+		/// is not known or any number is allowed.
+		std::size_t expected_fields() const;
+
+		/// Require the input parsed from now on to be in the encoding \a enc.
+		void set_encoding(encoding enc);
+
+		/// Parse the input \a size bytes at a time and pass any field that has
+		/// \a size bytes or more at the end of one of those steps to
+		/// 'field_chunk' in pieces of \a size bytes as described above, so
+		/// that less than twice \a size bytes of a field are ever held. A
+		/// \a size of 0 turns this off.
+		void set_chunk_size(std::size_t size);
+
+		/// Free the memory held for fields whenever a call to 'parse' or
+		/// 'finish' returns with more than \a capacity bytes reserved, so a
+		/// single huge field does not keep its memory for the lifetime of the
+		/// parser. By default the memory is never freed.
+		void set_max_capacity(std::size_t capacity);
+
 		std::size_t hash() const;
 
 		template <typename Callback>
@@ -217,6 +710,17 @@ public:
 		template <typename Callback, typename ForwardIt>
 		bool parse(Callback& cb, ForwardIt it, ForwardIt end, ForwardIt* out = 0);
 
+		/// Finish or parse as above, recording what happens in \a stats,
+		/// e.g. a 'statistics' object.
+		template <typename Callback, typename Stats>
+		bool finish(Callback& cb, Stats& stats);
+
+		template <typename Callback, typename Stats>
+		typename std::enable_if<!std::is_pointer<Stats>::value, bool>::type parse(Callback& cb, Stats& stats, char const* str, char const** out = 0);
+
+		template <typename Callback, typename Stats, typename ForwardIt>
+		bool parse(Callback& cb, Stats& stats, ForwardIt it, ForwardIt end, ForwardIt* out = 0);
+
 		template <template <typename> class RAllocator>
 		bool operator==(parser<RAllocator> const& rhs);
 
@@ -224,121 +728,1362 @@ public:
 		bool operator!=(parser<RAllocator> const& rhs);
 	};
 
+	/// Parse the \a length characters starting at \a start in place. If
+	/// \a cb has a method 'row(string_view const*, std::size_t)' then it is
+	/// called once per record with all of its fields instead of 'start_row',
+	/// 'field' and 'end_row'.
+	///
+	/// If \a cb has a method 'bad_record(error_code, std::size_t)' then a
+	/// 'misplaced_double_quotes', 'text_after_closing_quotes' or
+	/// 'unfinished_crlf' error is passed to it, with the offset of the
+	/// offending byte from the start of the input given to this call,
+	/// instead of ending the parse. The rest of the record is skipped
+	/// without an 'end_row', and parsing carries on after the next CRLF
+	/// outside double quotes, counting quotes from just after the offending
+	/// byte. The return value of 'bad_record' is treated like that of any
+	/// other method. Every parser supports this except the 'dfa_engine',
+	/// which leaves such callbacks to the state machine.
+	///
+	/// If \a cb has a method 'error(error_code, error_position const&)' then
+	/// it is called instead of 'error(error_code)' with where the error was
+	/// found. The offset is that of the offending byte, or the length of the
+	/// input for an error found at its end. Every parser supports this, and
+	/// the 'dfa_engine' again leaves such callbacks to the state machine.
 	template <typename Callback>
 	static bool parse(Callback& cb, char* start, std::size_t length, char** out = 0) {
-		state s = begin;
-		detail::in_place ap(start);
-		return parse_impl(ap, cb, s, start, start + length, out)
-		    && finish_impl(ap, cb, s);
+		any_field_count fc;
+		detail::no_encoding_check enc;
+		no_statistics stats;
+		SAXY_PROBE2(csv_parse_begin, start, length);
+		bool const result = parse_in_place(cb, fc, enc, stats, start, start + length, out, typename has_error_position<Callback>::type());
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
+	}
+
+	/// Parse as above, but generate a 'wrong_field_count' error if a record
+	/// does not have the number of fields described by \a count and an
+	/// 'invalid_utf8' error if \a enc is 'utf8' and the input is not UTF-8.
+	template <typename Callback>
+	static bool parse(Callback& cb, char* start, std::size_t length, field_count count, char** out = 0, encoding enc = any_bytes) {
+		typename has_error_position<Callback>::type located;
+		no_statistics stats;
+		SAXY_PROBE2(csv_parse_begin, start, length);
+		bool result;
+		if(enc == utf8) {
+			detail::utf8_validator validator;
+			result = parse_in_place(cb, count, validator, stats, start, start + length, out, located);
+		} else {
+			detail::no_encoding_check none;
+			result = parse_in_place(cb, count, none, stats, start, start + length, out, located);
+		}
+
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
 	}
 
 	template <typename Callback>
 	static bool parse(Callback& cb, char* start, char** out = 0) {
-		state s = begin;
-		detail::in_place ap(start);
-		return parse_impl(ap, cb, s, start, detail::cstr_end_iterator(), out)
-		    && finish_impl(ap, cb, s);
+		any_field_count fc;
+		detail::no_encoding_check enc;
+		no_statistics stats;
+		SAXY_PROBE2(csv_parse_begin, start, 0);
+		bool const result = parse_in_place(cb, fc, enc, stats, start, detail::cstr_end_iterator(), out, typename has_error_position<Callback>::type());
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
 	}
 
-private:
-	template <typename Appender, typename Callback>
-	static bool finish_impl(Appender& ap, Callback& cb, state& m_state) {
-		switch(m_state) {
-			case begin:
-				require_abort(cb.error(error_code::no_fields_in_record));
-				return false;
-			case fail_on_line_feed:
-			case in_new_line:
-				ap.append('\r');
-			case start_of_field:
-			case in_unquoted_field:
-			case in_quote:
-				m_state = end_of_row; // untested line
-				SAXY_RUN_CALLBACK(cb.field(ap.view_string()));
-			case end_of_row:
-				SAXY_RUN_CALLBACK(cb.end_row());
-				return true;
-			case in_quoted_field:
-				require_abort(cb.error(error_code::unclosed_quote));
-				return false;
-			case require_line_feed:
-				require_abort(cb.error(error_code::text_after_closing_quotes));
-				return false;
-			case error:
-				return false;
-			default:
-				return true;
-		}
+	/// Parse the string in \a buffer in place as above. The padding after
+	/// the string lets every field be scanned 16 bytes at a time, however
+	/// short it is.
+	template <typename Callback>
+	static bool parse(Callback& cb, padded_buffer& buffer, char** out = 0) {
+		char* const start = buffer.data();
+		any_field_count fc;
+		detail::no_encoding_check enc;
+		no_statistics stats;
+		SAXY_PROBE2(csv_parse_begin, start, buffer.size());
+		bool const result = parse_in_place(cb, fc, enc, stats, start, detail::padded_end(start + buffer.size()), out, typename has_error_position<Callback>::type());
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
 	}
 
-	template <typename Appender, typename Callback, typename ForwardIt, typename EndIt>
-	static bool parse_impl(Appender& ap, Callback& cb, state& s, ForwardIt it, EndIt end, ForwardIt* out = 0) {
-		typedef detail::scope_clear<Appender> scope_clear;
+	/// Parse the \a length characters starting at \a start in place as
+	/// above using \a e, so that the engines can be compared on the same
+	/// input. Both call the same methods of \a cb and report the same
+	/// errors, but the 'dfa_engine' returns as soon as \a cb asks to stop.
+	template <typename Callback>
+	static bool parse(Callback& cb, engine e, char* start, std::size_t length, char** out = 0) {
+		if(e == state_machine_engine || has_bad_record<Callback>::value) {
+			return parse(cb, start, length, out);
+		}
 
-		state m_state = s;
-		detail::scope_assign<ForwardIt> assign_guard(it, out);
-		detail::scope_assign<state> assign_guard2(m_state, &s);
+		return parse_dfa_in_place(cb, start, length, out, typename has_error_position<Callback>::type());
+	}
 
-		switch(m_state) {
-			SAXY_STATE_JUMP_TABLE(begin);
-			SAXY_STATE_JUMP_TABLE(start_of_row);
-			SAXY_STATE_JUMP_TABLE(first_field_of_record);
-			SAXY_STATE_JUMP_TABLE(fail_on_line_feed);
-			SAXY_STATE_JUMP_TABLE(start_of_field);
-			SAXY_STATE_JUMP_TABLE(in_quoted_field);
-			SAXY_STATE_JUMP_TABLE(in_unquoted_field);
-			SAXY_STATE_JUMP_TABLE(in_quote);
-			SAXY_STATE_JUMP_TABLE(in_new_line);
-			SAXY_STATE_JUMP_TABLE(require_line_feed);
-			SAXY_STATE_JUMP_TABLE(end_of_field);
-			SAXY_STATE_JUMP_TABLE(end_of_last_field);
-			SAXY_STATE_JUMP_TABLE(end_of_row);
-			SAXY_STATE_JUMP_TABLE(error);
+	/// Parse the \a length characters starting at \a start in place as
+	/// above, recording what happens along the way in \a stats, e.g. a
+	/// 'statistics' object.
+	template <typename Callback, typename Stats>
+	static bool parse(Callback& cb, Stats& stats, char* start, std::size_t length, char** out = 0) {
+		any_field_count fc;
+		detail::no_encoding_check enc;
+		SAXY_PROBE2(csv_parse_begin, start, length);
+		bool const result = parse_in_place(cb, fc, enc, stats, start, start + length, out, typename has_error_position<Callback>::type());
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
+	}
 
-			default:
-				UNREACHABLE;
-		}
+	/// Parse the NUL-terminated string starting at \a start in place,
+	/// recording what happens in \a stats as above.
+	template <typename Callback, typename Stats>
+	static bool parse(Callback& cb, Stats& stats, char* start, char** out = 0) {
+		any_field_count fc;
+		detail::no_encoding_check enc;
+		SAXY_PROBE2(csv_parse_begin, start, 0);
+		bool const result = parse_in_place(cb, fc, enc, stats, start, detail::cstr_end_iterator(), out, typename has_error_position<Callback>::type());
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
+	}
 
-		begin: {
-			if(it != end) {
-				SAXY_CHANGE_STATE_AFTER(first_field_of_record, SAXY_RUN_CALLBACK(cb.start_row()));
-			} else {
-				return true;
-			}
-		}
+	/// Parse the string in \a buffer in place, recording what happens in
+	/// \a stats as above.
+	template <typename Callback, typename Stats>
+	static bool parse(Callback& cb, Stats& stats, padded_buffer& buffer, char** out = 0) {
+		char* const start = buffer.data();
+		any_field_count fc;
+		detail::no_encoding_check enc;
+		SAXY_PROBE2(csv_parse_begin, start, buffer.size());
+		bool const result = parse_in_place(cb, fc, enc, stats, start, detail::padded_end(start + buffer.size()), out, typename has_error_position<Callback>::type());
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
+	}
 
-		start_of_row: {
-			if(it != end) {
-				SAXY_CHANGE_STATE_AFTER(first_field_of_record, SAXY_RUN_CALLBACK(cb.start_row()));
-			} else {
-				return true;
-			}
-		}
+	//=========================================================================
+	// transcoding_parser
+	//=========================================================================
+	/// A class that parses CSV in any encoding supported by \a transcoder a
+	/// chunk at a time. Each chunk is converted to UTF-8 in a buffer that is
+	/// reused between chunks and the complete records in it are parsed in
+	/// place by an \a in_place_parser. A record cut off at the end of a chunk
+	/// is held back until the rest of it arrives.
+	class transcoding_parser {
+		transcoder m_transcoder;
+		std::vector<char> m_records;
+		std::vector<char> m_pending;
+		in_place_parser m_parser;
+		std::size_t m_scanned;
+		std::size_t m_boundary;
+		bool m_in_quotes;
+		bool m_finishing;
 
-		first_field_of_record: {
-			if(it == end) {
-				return true;
-			}
+	public:
+		/// Create a transcoding_parser for input in the encoding \a enc.
+		explicit transcoding_parser(transcoder::encoding enc = transcoder::detect);
 
-			ap.start(&*it);
+		/// Return the encoding of the input, see \a transcoder.
+		transcoder::encoding source_encoding() const;
 
-			const char ch = *it;
-			switch(ch) {
+		/// Convert the \a length bytes starting at \a data and parse every
+		/// record that has been completed. If a callback method stops the
+		/// parsing, the rest of the records are parsed on the next call to
+		/// \a parse or \a finish. Quotes that are not closed hold back the
+		/// rest of the input, so the error for them comes from \a finish.
+		template <typename Callback>
+		bool parse(Callback& cb, char const* data, std::size_t length);
+
+		/// Parse everything that is left, including a last record without a
+		/// trailing line break.
+		template <typename Callback>
+		bool finish(Callback& cb);
+
+	private:
+		bool has_unparsed() const;
+
+		void find_boundary();
+	};
+
+	//=========================================================================
+	// validation
+	//=========================================================================
+	/// The result of \a validate.
+	struct validation {
+		error_code error;         ///< The first error found, or none
+		std::size_t error_offset; ///< Offset of the byte where \a error was found
+		std::size_t rows;         ///< Number of records before any error
+		std::size_t fields;       ///< Number of fields in those records
+		std::size_t min_fields;   ///< Fewest fields in a record, 0 if no records
+		std::size_t max_fields;   ///< Most fields in a record
+
+		validation()
+		: error(none)
+		, error_offset(0)
+		, rows(0)
+		, fields(0)
+		, min_fields(0)
+		, max_fields(0) {
+		}
+	};
+
+	/// Check whether the \a length characters starting at \a data are
+	/// well-formed CSV, and UTF-8 if \a enc is 'utf8', without modifying them
+	/// or generating any events. This runs the same state machine as \a parse,
+	/// but nothing is written and only the field and row counts are kept.
+	static validation validate(char const* data, std::size_t length, encoding enc = any_bytes);
+
+	//=========================================================================
+	// record splitting
+	//=========================================================================
+	/// Split the \a length characters starting at \a data into at most
+	/// \a parts parts of about the same size that only hold whole records,
+	/// and return the offset at which each part starts. A line break inside
+	/// quotes does not end a record, so the quotes are counted from the start.
+	static std::vector<std::size_t> split_records(char const* data, std::size_t length, std::size_t parts);
+
+	/// Return the length of the longest prefix of the \a length characters
+	/// starting at \a data that only holds whole records, which is 0 if there
+	/// is no CRLF outside quotes.
+	static std::size_t complete_records(char const* data, std::size_t length);
+
+	//=========================================================================
+	// schema inference
+	//=========================================================================
+	/// The type of the values found in a column by \a infer_schema.
+	enum column_type {
+		unknown_type, ///< Every sampled value was empty
+		integer_type, ///< e.g. -123
+		decimal_type, ///< e.g. 12.50
+		float_type,   ///< e.g. 1.5e-3
+		date_type,    ///< e.g. 2015-01-31, 31/01/2015 or 2015-01-31T09:30:00
+		string_type   ///< Anything else
+	};
+
+	/// A summary of the values sampled from one column.
+	struct column_schema {
+		std::string name;         ///< Header text, empty if there is no header
+		column_type type;         ///< Narrowest type that fits every value
+		std::size_t max_width;    ///< Length in bytes of the longest value
+		std::size_t null_count;   ///< Number of empty values
+		std::size_t sample_count; ///< Number of values sampled
+
+		column_schema()
+		: type(unknown_type)
+		, max_width(0)
+		, null_count(0)
+		, sample_count(0) {
+		}
+
+		double null_rate() const {
+			return sample_count ? static_cast<double>(null_count) / sample_count : 0.0;
+		}
+	};
+
+	/// Options controlling which parts of the input \a infer_schema samples.
+	struct schema_options {
+		bool has_header;         ///< Whether the first record holds column names
+		std::size_t head_bytes;  ///< Bytes sampled from the start of the input
+		std::size_t seeks;       ///< Number of further samples at random offsets
+		std::size_t seek_bytes;  ///< Bytes sampled at each random offset
+		unsigned long long seed; ///< Seed used to choose the random offsets
+
+		schema_options()
+		: has_header(true)
+		, head_bytes(1 << 20)
+		, seeks(16)
+		, seek_bytes(64 * 1024)
+		, seed(1) {
+		}
+	};
+
+	/// Guess the type, maximum width and null rate of each column of the
+	/// \a length bytes of CSV starting at \a data. The first \a head_bytes
+	/// and \a seeks windows at random offsets are copied and parsed in place.
+	/// A window at a random offset starts after its first CRLF. If that CRLF
+	/// was inside a quoted field the window usually fails to parse, and then
+	/// none of its records are counted.
+	static std::vector<column_schema> infer_schema(char const* data, std::size_t length, schema_options const& options = schema_options());
+
+	/// Guess the schema of the CSV read from the current position of \a in to
+	/// its end. Random offsets are only sampled if \a in is seekable.
+	static std::vector<column_schema> infer_schema(std::istream& in, schema_options const& options = schema_options());
+
+private:
+	/// Advance \a i past the next CRLF outside quotes in the \a size
+	/// characters starting at \a data and return true, or return false if
+	/// there is none and leave \a i where the search should carry on once
+	/// more characters have been added. \a in_quotes tracks whether \a i is
+	/// inside quotes.
+	static bool next_record(char const* data, std::size_t size, std::size_t& i, bool& in_quotes);
+
+	/// A field counter for parses that accept any number of fields.
+	struct any_field_count {
+		bool next_field() const {
+			return true;
+		}
+
+		bool end_row() const {
+			return true;
+		}
+
+		void skip_row() const {
+		}
+
+		std::size_t expected() const {
+			return 0;
+		}
+	};
+
+	/// has_row<Callback>::value is true if and only if 'Callback' has a method
+	/// callable as 'row(string_view const*, std::size_t)'.
+	template <typename Callback>
+	class has_row {
+		template <typename T>
+		static std::true_type test(decltype(std::declval<T&>().row(static_cast<string_view const*>(0), std::size_t()))*);
+
+		template <typename T>
+		static std::false_type test(...);
+
+	public:
+		typedef decltype(test<Callback>(0)) type;
+		static bool const value = type::value;
+	};
+
+	/// has_bad_record<Callback>::value is true if and only if 'Callback' has
+	/// a method callable as 'bad_record(error_code, std::size_t)'.
+	template <typename Callback>
+	class has_bad_record {
+		template <typename T>
+		static std::true_type test(decltype(std::declval<T&>().bad_record(error_code(), std::size_t()))*);
+
+		template <typename T>
+		static std::false_type test(...);
+
+	public:
+		typedef decltype(test<Callback>(0)) type;
+		static bool const value = type::value;
+	};
+
+	/// has_error_position<Callback>::value is true if and only if 'Callback'
+	/// has a method callable as 'error(error_code, error_position const&)'.
+	template <typename Callback>
+	class has_error_position {
+		template <typename T>
+		static std::true_type test(decltype(std::declval<T&>().error(error_code(), std::declval<error_position const&>()))*);
+
+		template <typename T>
+		static std::false_type test(...);
+
+	public:
+		typedef decltype(test<Callback>(0)) type;
+		static bool const value = type::value;
+	};
+
+	/// has_field_chunk<Callback>::value is true if and only if 'Callback' has
+	/// a method callable as 'field_chunk(string_cview, bool)'.
+	template <typename Callback>
+	class has_field_chunk {
+		template <typename T>
+		static std::true_type test(decltype(std::declval<T&>().field_chunk(string_cview(), bool()))*);
+
+		template <typename T>
+		static std::false_type test(...);
+
+	public:
+		typedef decltype(test<Callback>(0)) type;
+		static bool const value = type::value;
+	};
+
+	/// has_record_end<Callback>::value is true if and only if 'Callback' has
+	/// a method callable as 'record_end(std::size_t)', which only the
+	/// position_callback has.
+	template <typename Callback>
+	class has_record_end {
+		template <typename T>
+		static std::true_type test(decltype(std::declval<T&>().record_end(std::size_t()))*);
+
+		template <typename T>
+		static std::false_type test(...);
+
+	public:
+		typedef decltype(test<Callback>(0)) type;
+		static bool const value = type::value;
+	};
+
+	//=========================================================================
+	// row_callback
+	//=========================================================================
+	/// A class to convert the standard CSV callback methods into a single
+	/// call to 'row' per record. Field views are collected into 'fields',
+	/// which keeps its capacity between records so that after the widest
+	/// row has been seen no more allocations are made.
+	///
+	/// Only in-place parsing uses this, as the views must remain valid until
+	/// the end of the record.
+	template <typename Callback>
+	class row_callback {
+		Callback* m_cb;
+		std::vector<string_view>* m_fields;
+
+	public:
+		row_callback(Callback& cb, std::vector<string_view>& fields)
+		: m_cb(&cb)
+		, m_fields(&fields) {
+		}
+
+		always_keep_going start_row() {
+			m_fields->clear();
+			return keep_going;
+		}
+
+		always_keep_going field(string_view str) {
+			m_fields->push_back(str);
+			return keep_going;
+		}
+
+		decltype(std::declval<Callback&>().row(static_cast<string_view const*>(0), std::size_t())) end_row() {
+			return m_cb->row(m_fields->data(), m_fields->size());
+		}
+
+		template <typename C = Callback>
+		decltype(std::declval<C&>().bad_record(error_code(), std::size_t())) bad_record(error_code code, std::size_t offset) {
+			return m_cb->bad_record(code, offset);
+		}
+
+		always_abort error(error_code code) {
+			return m_cb->error(code);
+		}
+	};
+
+	//=========================================================================
+	// stats_callback
+	//=========================================================================
+	/// A class forwarding to 'Callback' that counts the fields, rows and
+	/// stops in a statistics policy.
+	template <typename Callback, typename Stats>
+	class stats_callback {
+		Callback* m_cb;
+		Stats* m_stats;
+
+		template <typename Command>
+		Command count_stop(Command c) {
+			if(detail::stop_parsing(c) && detail::to_return_value(c)) {
+				m_stats->stop();
+			}
+
+			return c;
+		}
+
+	public:
+		stats_callback(Callback& cb, Stats& stats)
+		: m_cb(&cb)
+		, m_stats(&stats) {
+		}
+
+		decltype(std::declval<Callback&>().start_row()) start_row() {
+			return count_stop(m_cb->start_row());
+		}
+
+		template <typename StringView>
+		decltype(std::declval<Callback&>().field(std::declval<StringView>())) field(StringView str) {
+			m_stats->field();
+			return count_stop(m_cb->field(str));
+		}
+
+		decltype(std::declval<Callback&>().end_row()) end_row() {
+			m_stats->row();
+			return count_stop(m_cb->end_row());
+		}
+
+		template <typename C = Callback>
+		decltype(std::declval<C&>().bad_record(error_code(), std::size_t())) bad_record(error_code code, std::size_t offset) {
+			return count_stop(m_cb->bad_record(code, offset));
+		}
+
+		always_abort error(error_code code) {
+			return m_cb->error(code);
+		}
+	};
+
+	//=========================================================================
+	// offset_callback
+	//=========================================================================
+	/// A class forwarding to 'Callback' that adds the number of bytes a
+	/// parser has been given before the current step to the offsets passed
+	/// to 'bad_record', so they count from the start of the whole input.
+	template <typename Callback>
+	class offset_callback {
+		Callback* m_cb;
+		std::size_t m_base;
+
+	public:
+		offset_callback(Callback& cb, std::size_t base)
+		: m_cb(&cb)
+		, m_base(base) {
+		}
+
+		decltype(std::declval<Callback&>().start_row()) start_row() {
+			return m_cb->start_row();
+		}
+
+		template <typename StringView>
+		decltype(std::declval<Callback&>().field(std::declval<StringView>())) field(StringView str) {
+			return m_cb->field(str);
+		}
+
+		decltype(std::declval<Callback&>().end_row()) end_row() {
+			return m_cb->end_row();
+		}
+
+		template <typename C = Callback>
+		decltype(std::declval<C&>().bad_record(error_code(), std::size_t())) bad_record(error_code code, std::size_t offset) {
+			return m_cb->bad_record(code, m_base + offset);
+		}
+
+		always_abort error(error_code code) {
+			return m_cb->error(code);
+		}
+	};
+
+	//=========================================================================
+	// position_callback
+	//=========================================================================
+	/// A class forwarding to 'Callback' that counts the records and the
+	/// fields of the current record in a stream_position, and holds back
+	/// any error so that its position can be passed on once parsing has
+	/// stopped. The parser calls 'record_end' with the offset from the start
+	/// of the current call once a record has ended, so the start of the
+	/// next one costs a single subtraction per record.
+	template <typename Callback>
+	class position_callback {
+		Callback* m_cb;
+		stream_position* m_position;
+		error_code m_error;
+
+	public:
+		position_callback(Callback& cb, stream_position& position)
+		: m_cb(&cb)
+		, m_position(&position)
+		, m_error(none) {
+		}
+
+		decltype(std::declval<Callback&>().start_row()) start_row() {
+			m_position->fields = 0;
+			return m_cb->start_row();
+		}
+
+		template <typename StringView>
+		decltype(std::declval<Callback&>().field(std::declval<StringView>())) field(StringView str) {
+			++m_position->fields;
+			return m_cb->field(str);
+		}
+
+		decltype(std::declval<Callback&>().end_row()) end_row() {
+			++m_position->rows;
+			return m_cb->end_row();
+		}
+
+		template <typename C = Callback>
+		decltype(std::declval<C&>().bad_record(error_code(), std::size_t())) bad_record(error_code code, std::size_t offset) {
+			++m_position->rows;
+			return m_cb->bad_record(code, m_position->offset + offset);
+		}
+
+		always_abort error(error_code code) {
+			m_error = code;
+			return abort;
+		}
+
+		void record_end(std::size_t offset) {
+			m_position->record_start = m_position->offset + offset;
+		}
+
+		/// Return the error held back, or 'none'.
+		error_code held_error() const {
+			return m_error;
+		}
+
+		/// Return the position of the error at \a offset from the start of
+		/// the current call.
+		error_position position(std::size_t offset) const {
+			std::size_t const absolute = m_position->offset + offset;
+			error_position const p = {m_position->rows, m_position->fields, absolute - m_position->record_start, absolute};
+			return p;
+		}
+	};
+
+	/// Select between calling 'Callback', which forwards to 'User', directly
+	/// when 'User' is never given an offset, through an offset_callback, or
+	/// through a position_callback. 'report' and 'report_finish' pass on any
+	/// error that was held back, found in the byte before \a stop or at the
+	/// end of the input.
+	template <typename User, typename Callback, bool Located = has_error_position<User>::value, bool Offsets = has_bad_record<User>::value>
+	struct stream_callback {
+		typedef Callback& type;
+
+		static type make(Callback& cb, stream_position&) {
+			return cb;
+		}
+
+		static bool holds_error(type) {
+			return false;
+		}
+
+		template <typename ForwardIt>
+		static bool report(User&, type, ForwardIt, ForwardIt, bool result) {
+			return result;
+		}
+
+		static bool report_finish(User&, type, bool result) {
+			return result;
+		}
+	};
+
+	template <typename User, typename Callback>
+	struct stream_callback<User, Callback, false, true> {
+		typedef offset_callback<Callback> type;
+
+		static type make(Callback& cb, stream_position& position) {
+			return type(cb, position.offset);
+		}
+
+		static bool holds_error(type&) {
+			return false;
+		}
+
+		template <typename ForwardIt>
+		static bool report(User&, type&, ForwardIt, ForwardIt, bool result) {
+			return result;
+		}
+
+		static bool report_finish(User&, type&, bool result) {
+			return result;
+		}
+	};
+
+	template <typename User, typename Callback, bool Offsets>
+	struct stream_callback<User, Callback, true, Offsets> {
+		typedef position_callback<Callback> type;
+
+		static type make(Callback& cb, stream_position& position) {
+			return type(cb, position);
+		}
+
+		static bool holds_error(type& pcb) {
+			return pcb.held_error() != none;
+		}
+
+		template <typename ForwardIt>
+		static bool report(User& cb, type& pcb, ForwardIt first, ForwardIt stop, bool result) {
+			if(pcb.held_error() == none) {
+				return result;
+			}
+
+			require_abort(cb.error(pcb.held_error(), pcb.position(std::distance(first, stop) - 1)));
+			return false;
+		}
+
+		static bool report_finish(User& cb, type& pcb, bool result) {
+			if(pcb.held_error() == none) {
+				return result;
+			}
+
+			require_abort(cb.error(pcb.held_error(), pcb.position(0)));
+			return false;
+		}
+	};
+
+	//=========================================================================
+	// field_chunk_callback
+	//=========================================================================
+	/// A class forwarding to 'Callback' that passes the end of a field to
+	/// 'field_chunk' once its start has been passed there, and notes whether
+	/// a method asked to stop. 'field' returns what both methods return if
+	/// that is the same type, so that tags such as 'always_keep_going' are
+	/// kept, and a 'command' otherwise.
+	template <typename Callback>
+	class field_chunk_callback {
+		typedef decltype(std::declval<Callback&>().field(std::declval<string_cview>())) field_return;
+		typedef decltype(std::declval<Callback&>().field_chunk(std::declval<string_cview>(), true)) chunk_return;
+		typedef typename std::conditional<std::is_same<field_return, chunk_return>::value, field_return, command>::type field_command;
+
+		Callback* m_cb;
+		bool* m_chunked;
+		bool m_stopped;
+
+		template <typename Command>
+		Command count_stop(Command c) {
+			if(detail::stop_parsing(c)) {
+				m_stopped = true;
+			}
+
+			return c;
+		}
+
+	public:
+		field_chunk_callback(Callback& cb, bool& chunked)
+		: m_cb(&cb)
+		, m_chunked(&chunked)
+		, m_stopped(false) {
+		}
+
+		decltype(std::declval<Callback&>().start_row()) start_row() {
+			return count_stop(m_cb->start_row());
+		}
+
+		field_command field(string_cview str) {
+			if(*m_chunked) {
+				*m_chunked = false;
+				return count_stop(field_command(m_cb->field_chunk(str, true)));
+			}
+
+			return count_stop(field_command(m_cb->field(str)));
+		}
+
+		decltype(std::declval<Callback&>().end_row()) end_row() {
+			return count_stop(m_cb->end_row());
+		}
+
+		template <typename C = Callback>
+		decltype(std::declval<C&>().bad_record(error_code(), std::size_t())) bad_record(error_code code, std::size_t offset) {
+			*m_chunked = false;
+			return count_stop(m_cb->bad_record(code, offset));
+		}
+
+		always_abort error(error_code code) {
+			*m_chunked = false;
+			return m_cb->error(code);
+		}
+
+		bool stopped() const {
+			return m_stopped;
+		}
+	};
+
+	/// Select between calling 'Callback' directly or through a
+	/// field_chunk_callback.
+	template <typename Callback, bool Chunk = has_field_chunk<Callback>::value>
+	struct chunk_callback {
+		typedef Callback& type;
+
+		static type make(Callback& cb, bool&) {
+			return cb;
+		}
+	};
+
+	template <typename Callback>
+	struct chunk_callback<Callback, true> {
+		typedef field_chunk_callback<Callback> type;
+
+		static type make(Callback& cb, bool& chunked) {
+			return type(cb, chunked);
+		}
+	};
+
+	/// Select between calling 'Callback' directly or through a row_callback.
+	template <typename Callback, bool Row = has_row<Callback>::value>
+	struct in_place_callback {
+		typedef Callback& type;
+
+		static type make(Callback& cb, std::vector<string_view>&) {
+			return cb;
+		}
+	};
+
+	template <typename Callback>
+	struct in_place_callback<Callback, true> {
+		typedef row_callback<Callback> type;
+
+		static type make(Callback& cb, std::vector<string_view>& fields) {
+			return type(cb, fields);
+		}
+	};
+
+	/// Select between calling 'Callback' directly, when nothing is counted,
+	/// or through a stats_callback.
+	template <typename Callback, typename Stats>
+	struct counted_callback {
+		typedef stats_callback<Callback, Stats> type;
+
+		static type make(Callback& cb, Stats& stats) {
+			return type(cb, stats);
+		}
+	};
+
+	template <typename Callback>
+	struct counted_callback<Callback, no_statistics> {
+		typedef Callback& type;
+
+		static type make(Callback& cb, no_statistics&) {
+			return cb;
+		}
+	};
+
+	//=========================================================================
+	// validate_callback
+	//=========================================================================
+	/// A callback that counts rows and fields for \a validate.
+	class validate_callback {
+		validation* m_result;
+		std::size_t m_fields;
+
+	public:
+		explicit validate_callback(validation& result)
+		: m_result(&result)
+		, m_fields(0) {
+		}
+
+		always_keep_going start_row() {
+			m_fields = 0;
+			return keep_going;
+		}
+
+		always_keep_going field(string_cview) {
+			++m_fields;
+			return keep_going;
+		}
+
+		always_keep_going end_row() {
+			if(m_result->rows++ == 0 || m_fields < m_result->min_fields) {
+				m_result->min_fields = m_fields;
+			}
+
+			m_result->max_fields = std::max(m_result->max_fields, m_fields);
+			m_result->fields += m_fields;
+			return keep_going;
+		}
+
+		always_abort error(error_code code) {
+			m_result->error = code;
+			return abort;
+		}
+	};
+
+	/// The number of bytes that \a classify may read past the end of a value.
+	static std::size_t const classify_padding = 16;
+
+	/// A 256-entry table with one bit set for each byte that 'classify'
+	/// accepts (digits, '.', '+', '-', exponents, '/', ':' and then 'T' or
+	/// ' ' from the lowest bit up) and 0 for every other byte.
+	static unsigned char const* value_classes();
+
+	/// Return the number of digits at the start of the \a length characters
+	/// starting at \a str.
+	static std::size_t leading_digits(char const* str, std::size_t length) {
+		std::size_t i = 0;
+		while(i < length && str[i] >= '0' && str[i] <= '9') {
+			++i;
+		}
+
+		return i;
+	}
+
+	/// Return the type of the number that is the \a length characters
+	/// starting at \a str: an optional sign, digits with at most one '.'
+	/// among them, and then optionally an exponent, its own optional sign
+	/// and at least one digit. Return 'string_type' for anything else.
+	static column_type number_type(char const* str, std::size_t length) {
+		std::size_t i = (str[0] == '+' || str[0] == '-') ? 1 : 0;
+		std::size_t digits = leading_digits(str + i, length - i);
+		i += digits;
+		bool const dot = i < length && str[i] == '.';
+		if(dot) {
+			++i;
+			std::size_t const fraction = leading_digits(str + i, length - i);
+			digits += fraction;
+			i += fraction;
+		}
+
+		if(digits == 0) {
+			return string_type;
+		} else if(i == length) {
+			return dot ? decimal_type : integer_type;
+		} else if(str[i] != 'e' && str[i] != 'E') {
+			return string_type;
+		}
+
+		++i;
+		if(i < length && (str[i] == '+' || str[i] == '-')) {
+			++i;
+		}
+
+		std::size_t const exponent = leading_digits(str + i, length - i);
+		return exponent != 0 && i + exponent == length ? float_type : string_type;
+	}
+
+	/// Return whether the \a length characters starting at \a str are a
+	/// date: 4, 1-2 and 1-2 digits separated by '-' or '/', or 1-2, 1-2 and
+	/// 4 digits separated by '/'. A time may follow after 'T' or ' ' as
+	/// two-digit hours and minutes, then optionally seconds and a fraction.
+	static bool is_date(char const* str, std::size_t length) {
+		std::size_t const first = leading_digits(str, length);
+		if(first == length || (str[first] != '-' && str[first] != '/')) {
+			return false;
+		}
+
+		char const separator = str[first];
+		std::size_t i = first + 1;
+		std::size_t const second = leading_digits(str + i, length - i);
+		i += second;
+		if(i == length || str[i] != separator) {
+			return false;
+		}
+
+		++i;
+		std::size_t const third = leading_digits(str + i, length - i);
+		i += third;
+		bool const year_first = first == 4 && second - 1 < 2 && third - 1 < 2;
+		bool const year_last = separator == '/' && first - 1 < 2 && second - 1 < 2 && third == 4;
+		if(!year_first && !year_last) {
+			return false;
+		} else if(i == length) {
+			return true;
+		} else if(str[i] != 'T' && str[i] != ' ') {
+			return false;
+		}
+
+		++i;
+		if(length - i < 5 || leading_digits(str + i, 2) != 2 || str[i + 2] != ':' || leading_digits(str + i + 3, 2) != 2) {
+			return false;
+		}
+
+		i += 5;
+		if(i != length && str[i] == ':') {
+			if(length - i < 3 || leading_digits(str + i + 1, 2) != 2) {
+				return false;
+			}
+
+			i += 3;
+			if(i != length && str[i] == '.') {
+				++i;
+				std::size_t const fraction = leading_digits(str + i, length - i);
+				if(fraction == 0) {
+					return false;
+				}
+
+				i += fraction;
+			}
+		}
+
+		return i == length;
+	}
+
+	/// Classify the \a length characters starting at \a str, which must be
+	/// followed by at least \a classify_padding readable bytes. Values with
+	/// a byte that no number or date has are rejected 16 bytes at a time, or
+	/// with 'value_classes' without SSE2, and then the positions of the
+	/// signs, exponent and separators of the rest are checked.
+	static column_type classify(char const* str, std::size_t length) {
+		bool digits = false;
+
+#ifdef SAXY_SSE2
+		__m128i const zero = _mm_set1_epi8('0' - 1);
+		__m128i const nine = _mm_set1_epi8('9' + 1);
+		for(std::size_t i = 0; i < length; i += 16) {
+			__m128i const v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+			unsigned const valid = length - i >= 16 ? 0xFFFF : (1u << (length - i)) - 1;
+			__m128i const digit = _mm_and_si128(_mm_cmpgt_epi8(v, zero), _mm_cmplt_epi8(v, nine));
+			__m128i const sign = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')), _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+			__m128i const exponent = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('e')), _mm_cmpeq_epi8(v, _mm_set1_epi8('E')));
+			__m128i const separator = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))),
+			                                       _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+			__m128i const time = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('T')), _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+			__m128i const other = _mm_or_si128(_mm_or_si128(sign, exponent), _mm_or_si128(separator, time));
+			unsigned const d = _mm_movemask_epi8(digit) & valid;
+			if(valid & ~(d | _mm_movemask_epi8(other))) {
+				return string_type;
+			}
+
+			digits = digits || d != 0;
+		}
+#else
+		unsigned char const* const classes = value_classes();
+		for(std::size_t i = 0; i < length; ++i) {
+			unsigned const c = classes[static_cast<unsigned char>(str[i])];
+			if(c == 0) {
+				return string_type;
+			}
+
+			digits = digits || (c & 1) != 0;
+		}
+#endif
+
+		if(!digits) {
+			return string_type;
+		}
+
+		column_type const number = number_type(str, length);
+		if(number != string_type) {
+			return number;
+		}
+
+		return is_date(str, length) ? date_type : string_type;
+	}
+
+	/// Return the narrowest type that can hold values of type \a a and \a b.
+	static column_type merge_types(column_type a, column_type b) {
+		if(a == unknown_type || a == b) {
+			return b;
+		} else if(b == unknown_type) {
+			return a;
+		} else if(a <= float_type && b <= float_type) {
+			return std::max(a, b);
+		} else {
+			return string_type;
+		}
+	}
+
+	//=========================================================================
+	// schema_sampler
+	//=========================================================================
+	/// A row callback that accumulates the statistics of each column.
+	class schema_sampler {
+		std::vector<column_schema>* m_columns;
+		bool m_header;
+
+	public:
+		schema_sampler(std::vector<column_schema>& columns, bool header)
+		: m_columns(&columns)
+		, m_header(header) {
+		}
+
+		always_keep_going row(string_view const* fields, std::size_t n) {
+			if(m_columns->size() < n) {
+				m_columns->resize(n);
+			}
+
+			if(m_header) {
+				for(std::size_t i = 0; i < n; ++i) {
+					(*m_columns)[i].name.assign(fields[i].data(), fields[i].size());
+				}
+
+				m_header = false;
+				return keep_going;
+			}
+
+			for(std::size_t i = 0; i < n; ++i) {
+				column_schema& column = (*m_columns)[i];
+				std::size_t const size = fields[i].size();
+				++column.sample_count;
+				if(size == 0) {
+					++column.null_count;
+				} else {
+					column.max_width = std::max(column.max_width, size);
+					if(column.type != string_type) {
+						column.type = merge_types(column.type, classify(fields[i].data(), size));
+					}
+				}
+			}
+
+			return keep_going;
+		}
+
+		always_abort error(error_code) {
+			return abort;
+		}
+	};
+
+	/// Parse a private copy of the \a length bytes at \a data and add their
+	/// statistics to \a columns. Unless \a at_record_start is true, the bytes
+	/// up to and including the first CRLF are skipped, and nothing is added
+	/// if the rest does not parse. Unless \a complete is true, a trailing
+	/// partial record is ignored.
+	static void sample_schema(std::vector<column_schema>& columns, bool header, char const* data, std::size_t length, bool at_record_start, bool complete) {
+		if(!at_record_start) {
+			char const* const end = data + length;
+			char const* it = data;
+			while(it + 1 < end && !(it[0] == '\r' && it[1] == '\n')) {
+				++it;
+			}
+
+			if(it + 1 >= end) {
+				return;
+			}
+
+			length = end - (it + 2);
+			data = it + 2;
+		}
+
+		std::vector<char> copy(length + classify_padding, '\0');
+		std::copy(data, data + length, copy.begin());
+
+		// A window that starts inside a quoted field is misaligned, so its
+		// records are counted apart and kept only if it parses
+		std::vector<column_schema> window;
+		if(!at_record_start) {
+			window = columns;
+		}
+
+		std::vector<column_schema>& sampled = at_record_start ? columns : window;
+		schema_sampler sampler(sampled, header);
+		bool parsed;
+		if(complete) {
+			parsed = parse(sampler, copy.data(), length);
+		} else {
+			in_place_parser parser(copy.data(), length);
+			parsed = parser.parse(sampler);
+		}
+
+		if(parsed && !at_record_start) {
+			columns.swap(window);
+		}
+	}
+
+	static unsigned long long next_random(unsigned long long& state) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	/// Call \a parse_impl, checking the encoding with \a validator if \a enc
+	/// is 'utf8'.
+	template <typename Appender, typename Callback, typename FieldCount, typename ForwardIt, typename EndIt>
+	static bool parse_encoded(encoding enc, detail::utf8_validator& validator, Appender& ap, Callback& cb, FieldCount& fc, state& s, ForwardIt it, EndIt end, ForwardIt* out) {
+		no_statistics stats;
+		return parse_encoded(enc, validator, ap, cb, fc, stats, s, it, end, out);
+	}
+
+	template <typename Appender, typename Callback, typename FieldCount, typename Stats, typename ForwardIt, typename EndIt>
+	static bool parse_encoded(encoding enc, detail::utf8_validator& validator, Appender& ap, Callback& cb, FieldCount& fc, Stats& stats, state& s, ForwardIt it, EndIt end, ForwardIt* out) {
+		if(enc == utf8) {
+			return parse_impl(ap, cb, fc, validator, stats, s, it, end, out);
+		}
+
+		detail::no_encoding_check none;
+		return parse_impl(ap, cb, fc, none, stats, s, it, end, out);
+	}
+
+	template <typename Appender, typename Callback, typename FieldCount>
+	static bool finish_encoded(encoding enc, detail::utf8_validator& validator, Appender& ap, Callback& cb, FieldCount& fc, state& s) {
+		if(enc == utf8) {
+			return finish_impl(ap, cb, fc, validator, s);
+		}
+
+		detail::no_encoding_check none;
+		return finish_impl(ap, cb, fc, none, s);
+	}
+
+	/// Parse the characters from \a start up to \a end in place, recording
+	/// what happens in \a stats and passing any error to
+	/// 'error(error_code)'.
+	template <typename Callback, typename FieldCount, typename Encoding, typename Stats, typename EndIt>
+	static bool parse_in_place(Callback& cb, FieldCount& fc, Encoding& enc, Stats& stats, char* start, EndIt end, char** out, std::false_type) {
+		typedef typename std::remove_reference<typename in_place_callback<Callback>::type>::type row_type;
+		state s = begin;
+		detail::in_place ap(start);
+		std::vector<string_view> row;
+		row.reserve(fc.expected());
+		typename in_place_callback<Callback>::type rcb = in_place_callback<Callback>::make(cb, row);
+		typename counted_callback<row_type, Stats>::type scb = counted_callback<row_type, Stats>::make(rcb, stats);
+		return parse_impl(ap, scb, fc, enc, stats, s, start, end, out)
+		    && finish_impl(ap, scb, fc, enc, s);
+	}
+
+	/// Parse as above, passing any error and its position to
+	/// 'error(error_code, error_position const&)'.
+	template <typename Callback, typename FieldCount, typename Encoding, typename Stats, typename EndIt>
+	static bool parse_in_place(Callback& cb, FieldCount& fc, Encoding& enc, Stats& stats, char* start, EndIt end, char** out, std::true_type) {
+		typedef typename std::remove_reference<typename in_place_callback<Callback>::type>::type row_type;
+		typedef typename std::remove_reference<typename counted_callback<row_type, Stats>::type>::type counted_type;
+		state s = begin;
+		detail::in_place ap(start);
+		std::vector<string_view> row;
+		row.reserve(fc.expected());
+		typename in_place_callback<Callback>::type rcb = in_place_callback<Callback>::make(cb, row);
+		typename counted_callback<row_type, Stats>::type scb = counted_callback<row_type, Stats>::make(rcb, stats);
+		stream_position position = {};
+		position_callback<counted_type> pcb(scb, position);
+		char* stop = start;
+		bool const parsed = parse_impl(ap, pcb, fc, enc, stats, s, start, end, &stop);
+		bool const result = parsed && finish_impl(ap, pcb, fc, enc, s);
+		if(out) {
+			*out = stop;
+		}
+
+		if(pcb.held_error() == none) {
+			return result;
+		}
+
+		// An error found by finish_impl is at the end of the input
+		std::size_t const offset = parsed ? stop - start : stop - start - 1;
+		require_abort(cb.error(pcb.held_error(), pcb.position(offset)));
+		return false;
+	}
+
+	/// Parse the \a length characters starting at \a start in place with
+	/// the 'dfa_engine', or with the state machine if \a cb is given the
+	/// positions of errors, which the 'dfa_engine' does not keep track of.
+	template <typename Callback>
+	static bool parse_dfa_in_place(Callback& cb, char* start, std::size_t length, char** out, std::false_type) {
+		std::vector<string_view> row;
+		typename in_place_callback<Callback>::type rcb = in_place_callback<Callback>::make(cb, row);
+		SAXY_PROBE2(csv_parse_begin, start, length);
+		bool const result = parse_dfa(rcb, start, length, out);
+		SAXY_PROBE2(csv_parse_end, start, result);
+		return result;
+	}
+
+	template <typename Callback>
+	static bool parse_dfa_in_place(Callback& cb, char* start, std::size_t length, char** out, std::true_type) {
+		return parse(cb, start, length, out);
+	}
+
+	/// Pass \a code to the 'error' method of \a cb.
+	template <typename Callback>
+	static always_abort signal_error(Callback& cb, error_code code) {
+		SAXY_PROBE1(csv_error, static_cast<int>(code));
+		return cb.error(code);
+	}
+
+	/// Pass \a code and \a offset to the 'bad_record' method of \a cb. This
+	/// is only called if \a cb has one.
+	template <typename Callback>
+	static decltype(std::declval<Callback&>().bad_record(error_code(), std::size_t())) signal_bad_record(Callback& cb, error_code code, std::size_t offset, std::true_type) {
+		SAXY_PROBE1(csv_error, static_cast<int>(code));
+		return cb.bad_record(code, offset);
+	}
+
+	template <typename Callback>
+	static always_keep_going signal_bad_record(Callback&, error_code, std::size_t, std::false_type) {
+		return keep_going;
+	}
+
+	/// Tell \a cb that a record has ended just before \a it, if \a cb keeps
+	/// track of where records start.
+	template <typename Callback, typename ForwardIt>
+	static void signal_record_end(Callback& cb, ForwardIt first, ForwardIt it, std::true_type) {
+		cb.record_end(std::distance(first, it));
+	}
+
+	template <typename Callback, typename ForwardIt>
+	static void signal_record_end(Callback&, ForwardIt, ForwardIt, std::false_type) {
+	}
+
+	template <typename Appender, typename Callback, typename FieldCount, typename Encoding>
+	static bool finish_impl(Appender& ap, Callback& cb, FieldCount& fc, Encoding& enc, state& m_state) {
+		if(m_state != error && !enc.complete()) {
+			m_state = error;
+			require_abort(signal_error(cb, error_code::invalid_utf8));
+			return false;
+		}
+
+		switch(m_state) {
+			case begin:
+				require_abort(signal_error(cb, error_code::no_fields_in_record));
+				return false;
+			case fail_on_line_feed:
+			case in_new_line:
+				ap.append('\r');
+			case start_of_field:
+			case in_unquoted_field:
+			case in_quote:
+				if(!fc.end_row()) {
+					m_state = error;
+					require_abort(signal_error(cb, error_code::wrong_field_count));
+					return false;
+				}
+				m_state = end_of_row; // untested line
+				SAXY_RUN_CALLBACK(cb.field(ap.view_string()));
+			case end_of_row:
+				SAXY_RUN_CALLBACK(cb.end_row());
+				return true;
+			case in_quoted_field:
+				require_abort(signal_error(cb, error_code::unclosed_quote));
+				return false;
+			case require_line_feed:
+				require_abort(signal_error(cb, error_code::text_after_closing_quotes));
+				return false;
+			case error:
+				return false;
+			default:
+				return true;
+		}
+	}
+
+	template <typename Appender, typename Callback, typename FieldCount, typename Encoding, typename ForwardIt, typename EndIt>
+	static bool parse_impl(Appender& ap, Callback& cb, FieldCount& fc, Encoding& enc, state& s, ForwardIt it, EndIt end, ForwardIt* out = 0) {
+		no_statistics stats;
+		return parse_impl(ap, cb, fc, enc, stats, s, it, end, out);
+	}
+
+	template <typename Appender, typename Callback, typename FieldCount, typename Encoding, typename Stats, typename ForwardIt, typename EndIt>
+	static bool parse_impl(Appender& ap, Callback& cb, FieldCount& fc, Encoding& enc, Stats& stats, state& s, ForwardIt it, EndIt end, ForwardIt* out = 0) {
+		typedef detail::scope_clear<Appender> scope_clear;
+		typedef typename has_bad_record<Callback>::type recover;
+		typedef typename has_record_end<Callback>::type locate;
+
+		ForwardIt const first = it;
+		state m_state = s;
+		detail::scope_assign<ForwardIt> assign_guard(it, out);
+		detail::scope_assign<state> assign_guard2(m_state, &s);
+
+		switch(m_state) {
+			SAXY_STATE_JUMP_TABLE(begin);
+			SAXY_STATE_JUMP_TABLE(start_of_row);
+			SAXY_STATE_JUMP_TABLE(first_field_of_record);
+			SAXY_STATE_JUMP_TABLE(fail_on_line_feed);
+			SAXY_STATE_JUMP_TABLE(start_of_field);
+			SAXY_STATE_JUMP_TABLE(in_quoted_field);
+			SAXY_STATE_JUMP_TABLE(in_unquoted_field);
+			SAXY_STATE_JUMP_TABLE(in_quote);
+			SAXY_STATE_JUMP_TABLE(in_new_line);
+			SAXY_STATE_JUMP_TABLE(require_line_feed);
+			SAXY_STATE_JUMP_TABLE(skip_record);
+			SAXY_STATE_JUMP_TABLE(skip_quoted_record);
+			SAXY_STATE_JUMP_TABLE(skip_record_cr);
+			SAXY_STATE_JUMP_TABLE(end_of_field);
+			SAXY_STATE_JUMP_TABLE(end_of_last_field);
+			SAXY_STATE_JUMP_TABLE(end_of_row);
+			SAXY_STATE_JUMP_TABLE(error);
+
+			default:
+				UNREACHABLE;
+		}
+
+		begin: {
+			if(it != end) {
+				SAXY_CSV_CHANGE_STATE_AFTER(first_field_of_record, SAXY_RUN_CALLBACK(cb.start_row()));
+			} else {
+				return true;
+			}
+		}
+
+		start_of_row: {
+			if(it != end) {
+				SAXY_CSV_CHANGE_STATE_AFTER(first_field_of_record, SAXY_RUN_CALLBACK(cb.start_row()));
+			} else {
+				return true;
+			}
+		}
+
+		first_field_of_record: {
+			if(it == end) {
+				return true;
+			}
+
+			ap.start(&*it);
+
+			const char ch = *it;
+			switch(ch) {
 				case ',':
-					++it;
-					SAXY_CHANGE_STATE(end_of_field);
+					stats.bytes(structural_byte, 1);
+					SAXY_ADVANCE(ch);
+					SAXY_CSV_CHANGE_STATE(end_of_field);
 				case '"':
-					++it;
+					stats.bytes(structural_byte, 1);
+					stats.quoted_field();
+					SAXY_ADVANCE(ch);
 					ap.start(&*it);
-					SAXY_CHANGE_STATE(in_quoted_field);
+					SAXY_CSV_CHANGE_STATE(in_quoted_field);
 				case '\r':
-					++it;
-					SAXY_CHANGE_STATE(fail_on_line_feed);
+					stats.bytes(structural_byte, 1);
+					SAXY_ADVANCE(ch);
+					SAXY_CSV_CHANGE_STATE(fail_on_line_feed);
 			}
 
+			stats.bytes(unquoted_byte, 1);
 			ap.append_same(ch);
-			++it;
-			SAXY_CHANGE_STATE(in_unquoted_field);
+			SAXY_ADVANCE(ch);
+			SAXY_CSV_CHANGE_STATE(in_unquoted_field);
 		}
 
 		fail_on_line_feed: {
@@ -349,16 +2094,17 @@ private:
 			const char ch = *it;
 			if(ch == '\n') {
 				++it;
-				SAXY_CHANGE_STATE_AFTER(error, require_abort(cb.error(error_code::no_fields_in_record)));
-			} else if(ch == '\r') {
-				ap.append('\r');
-				++it;
-				SAXY_CHANGE_STATE(in_new_line);
+				SAXY_CSV_CHANGE_STATE_AFTER(error, require_abort(signal_error(cb, error_code::no_fields_in_record)));
+			}
+
+			stats.bytes(structural_byte, 1);
+			ap.append('\r');
+			if(ch == '\r') {
+				SAXY_ADVANCE(ch);
+				SAXY_CSV_CHANGE_STATE(in_new_line);
 			} else {
-				const char temp[2] = {'\r', ch };
-				ap.append(temp, temp + 2);
-				++it;
-				SAXY_CHANGE_STATE(in_unquoted_field);
+				// The field goes on, and 'ch' may end it
+				SAXY_CSV_CHANGE_STATE(in_unquoted_field);
 			}
 		}
 
@@ -371,43 +2117,72 @@ private:
 
 			const char ch = *it;
 			if(ch == ',') {
-				++it;
-				SAXY_CHANGE_STATE(end_of_field);
+				stats.bytes(structural_byte, 1);
+				SAXY_ADVANCE(ch);
+				SAXY_CSV_CHANGE_STATE(end_of_field);
 			} else if(ch == '"') {
-				++it;
+				stats.bytes(structural_byte, 1);
+				stats.quoted_field();
+				SAXY_ADVANCE(ch);
 				ap.start(&*it);
-				SAXY_CHANGE_STATE(in_quoted_field);
+				SAXY_CSV_CHANGE_STATE(in_quoted_field);
 			} else if(ch != '\r') {
+				stats.bytes(unquoted_byte, 1);
 				ap.append_same(ch);
-				++it;
-				SAXY_CHANGE_STATE(in_unquoted_field);
+				SAXY_ADVANCE(ch);
+				SAXY_CSV_CHANGE_STATE(in_unquoted_field);
 			} else {
-				++it;
-				SAXY_CHANGE_STATE(in_new_line);
+				stats.bytes(structural_byte, 1);
+				SAXY_ADVANCE(ch);
+				SAXY_CSV_CHANGE_STATE(in_new_line);
 			}
 		}
 
 		in_unquoted_field: {
-			it = no_quote_simd(ap, it, end);
+			no_quote_simd(ap, enc, stats, it, end);
 
+			// Counted once the scalar loop has taken a byte of the field
+			bool fallback = false;
 			while(it != end) {
 				const char ch = *it;
 				if(ch > ',') {
+					if(!fallback) {
+						fallback = true;
+						stats.simd_fallback();
+					}
+
+					stats.bytes(unquoted_byte, 1);
 					ap.append_same(ch);
-					++it;
+					SAXY_ADVANCE(ch);
 				} else {
 					if(ch == ',') {
-						++it;
-						SAXY_CHANGE_STATE(end_of_field);
+						stats.bytes(structural_byte, 1);
+						SAXY_ADVANCE(ch);
+						SAXY_CSV_CHANGE_STATE(end_of_field);
 					} else if(ch == '"') {
+						if(recover::value) {
+							std::size_t const offset = std::distance(first, it);
+							++it;
+							ap.clear();
+							fc.skip_row();
+							SAXY_CSV_CHANGE_STATE_AFTER(skip_record, SAXY_RUN_CALLBACK(signal_bad_record(cb, error_code::misplaced_double_quotes, offset, recover())));
+						}
+
 						++it;
-						SAXY_CHANGE_STATE_AFTER(error, require_abort(cb.error(error_code::misplaced_double_quotes)));
+						SAXY_CSV_CHANGE_STATE_AFTER(error, require_abort(signal_error(cb, error_code::misplaced_double_quotes)));
 					} else if(ch == '\r') {
-						++it;
-						SAXY_CHANGE_STATE(in_new_line);
+						stats.bytes(structural_byte, 1);
+						SAXY_ADVANCE(ch);
+						SAXY_CSV_CHANGE_STATE(in_new_line);
 					} else {
+						if(!fallback) {
+							fallback = true;
+							stats.simd_fallback();
+						}
+
+						stats.bytes(unquoted_byte, 1);
 						ap.append_same(ch);
-						++it;
+						SAXY_ADVANCE(ch);
 					}
 				}
 			}
@@ -416,16 +2191,24 @@ private:
 		}
 
 		in_quoted_field: {
-			it = in_quote_simd(ap, it, end);
+			in_quote_simd(ap, enc, stats, it, end);
 
+			bool fallback = false;
 			while(it != end) {
 				const char ch = *it;
 				if(ch != '"') {
+					if(!fallback) {
+						fallback = true;
+						stats.simd_fallback();
+					}
+
+					stats.bytes(quoted_byte, 1);
 					ap.append(ch);
-					++it;
+					SAXY_ADVANCE(ch);
 				} else {
-					++it;
-					SAXY_CHANGE_STATE(in_quote);
+					stats.bytes(structural_byte, 1);
+					SAXY_ADVANCE(ch);
+					SAXY_CSV_CHANGE_STATE(in_quote);
 				}
 
 			}
@@ -441,19 +2224,28 @@ private:
 			const char ch = *it;
 			switch(ch) {
 				case '"':
+					stats.bytes(quoted_byte, 1);
 					ap.append(ch);
-					++it;
-					SAXY_CHANGE_STATE(in_quoted_field);
+					SAXY_ADVANCE(ch);
+					SAXY_CSV_CHANGE_STATE(in_quoted_field);
 				case ',':
-					++it;
-					SAXY_CHANGE_STATE(end_of_field);
+					stats.bytes(structural_byte, 1);
+					SAXY_ADVANCE(ch);
+					SAXY_CSV_CHANGE_STATE(end_of_field);
 				case '\r':
-					++it;
-					SAXY_CHANGE_STATE(require_line_feed);
+					stats.bytes(structural_byte, 1);
+					SAXY_ADVANCE(ch);
+					SAXY_CSV_CHANGE_STATE(require_line_feed);
+			}
+
+			if(recover::value) {
+				ap.clear();
+				fc.skip_row();
+				SAXY_CSV_CHANGE_STATE_AFTER(skip_record, SAXY_RUN_CALLBACK(signal_bad_record(cb, error_code::text_after_closing_quotes, std::distance(first, it), recover())));
 			}
 
 			++it;
-			SAXY_CHANGE_STATE_AFTER(error, require_abort(cb.error(error_code::text_after_closing_quotes)));
+			SAXY_CSV_CHANGE_STATE_AFTER(error, require_abort(signal_error(cb, error_code::text_after_closing_quotes)));
 		}
 
 		in_new_line: {
@@ -463,17 +2255,17 @@ private:
 
 			const char ch = *it;
 			if(ch == '\n') {
-				++it;
-				SAXY_CHANGE_STATE(end_of_last_field);
+				stats.bytes(structural_byte, 1);
+				SAXY_ADVANCE(ch);
+				SAXY_CSV_CHANGE_STATE(end_of_last_field);
 			} else if(ch == '\r') {
+				stats.bytes(structural_byte, 1);
 				ap.append('\r');
-				++it;
+				SAXY_ADVANCE(ch);
 				SAXY_RESTART_STATE(in_new_line);
 			} else {
-				const char temp[2] = {'\r', ch };
-				ap.append(temp, temp + 2);
-				++it;
-				SAXY_CHANGE_STATE(in_unquoted_field);
+				ap.append('\r');
+				SAXY_CSV_CHANGE_STATE(in_unquoted_field);
 			}
 		}
 
@@ -484,30 +2276,99 @@ private:
 
 			const char ch = *it;
 			if(ch == '\n') {
-				++it;
-				SAXY_CHANGE_STATE(end_of_last_field);
+				stats.bytes(structural_byte, 1);
+				SAXY_ADVANCE(ch);
+				SAXY_CSV_CHANGE_STATE(end_of_last_field);
+			} else if(recover::value) {
+				// A double quote after the CR is not counted when looking for
+				// the end of the record, but any other byte is looked at again
+				std::size_t const offset = std::distance(first, it);
+				if(ch == '"') {
+					++it;
+				}
+
+				ap.clear();
+				fc.skip_row();
+				SAXY_CSV_CHANGE_STATE_AFTER(skip_record, SAXY_RUN_CALLBACK(signal_bad_record(cb, error_code::unfinished_crlf, offset, recover())));
 			} else {
 				++it;
-				SAXY_CHANGE_STATE_AFTER(error, require_abort(cb.error(error_code::unfinished_crlf)));
+				SAXY_CSV_CHANGE_STATE_AFTER(error, require_abort(signal_error(cb, error_code::unfinished_crlf)));
+			}
+		}
+
+		// The rest of a record with an error is skipped up to the next CRLF
+		// outside double quotes, which can be split between buffers
+		skip_record: {
+			while(it != end) {
+				const char ch = *it;
+				SAXY_ADVANCE(ch);
+				if(ch == '"') {
+					SAXY_CSV_CHANGE_STATE(skip_quoted_record);
+				} else if(ch == '\r') {
+					SAXY_CSV_CHANGE_STATE(skip_record_cr);
+				}
+			}
+
+			return true;
+		}
+
+		skip_quoted_record: {
+			while(it != end) {
+				const char ch = *it;
+				SAXY_ADVANCE(ch);
+				if(ch == '"') {
+					SAXY_CSV_CHANGE_STATE(skip_record);
+				}
+			}
+
+			return true;
+		}
+
+		skip_record_cr: {
+			if(it == end) {
+				return true;
+			}
+
+			const char ch = *it;
+			if(ch == '\n') {
+				SAXY_ADVANCE(ch);
+				signal_record_end(cb, first, it, locate());
+				SAXY_CSV_CHANGE_STATE(start_of_row);
 			}
+
+			SAXY_CSV_CHANGE_STATE(skip_record);
 		}
 
 		end_of_field: {
+			if(!fc.next_field()) {
+				SAXY_CSV_CHANGE_STATE_AFTER(error, require_abort(signal_error(cb, error_code::wrong_field_count)));
+			}
+
 			scope_clear s(ap);
-			SAXY_CHANGE_STATE_AFTER(start_of_field,
+			SAXY_CSV_CHANGE_STATE_AFTER(start_of_field,
 				SAXY_RUN_CALLBACK(cb.field(ap.view_string()));
 			);
 		}
 
 		end_of_last_field: {
+			if(!fc.end_row()) {
+				SAXY_CSV_CHANGE_STATE_AFTER(error, require_abort(signal_error(cb, error_code::wrong_field_count)));
+			}
+
 			scope_clear s(ap);
-			SAXY_CHANGE_STATE_AFTER(end_of_row,
+			SAXY_CSV_CHANGE_STATE_AFTER(end_of_row,
 				SAXY_RUN_CALLBACK(cb.field(ap.view_string()));
 			);
 		}
 
 		end_of_row: {
-			SAXY_CHANGE_STATE_AFTER(start_of_row, SAXY_RUN_CALLBACK(cb.end_row()));
+			signal_record_end(cb, first, it, locate());
+			SAXY_CSV_CHANGE_STATE_AFTER(start_of_row, SAXY_RUN_CALLBACK(cb.end_row()));
+		}
+
+		invalid_encoding: {
+			++it;
+			SAXY_CSV_CHANGE_STATE_AFTER(error, require_abort(signal_error(cb, error_code::invalid_utf8)));
 		}
 
 		error: {
@@ -516,58 +2377,594 @@ private:
 		}
 	}
 
-	template <typename Appender, typename Iterator, typename EndIt>
-	__forceinline static Iterator no_quote_simd(Appender& ap, Iterator it, EndIt end) {
-		return no_quote_simd(typename detail::use_simd<Iterator, EndIt>::type(), ap, it, end);
-	}
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void no_quote_simd(Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		no_quote_simd(typename detail::use_simd<Iterator, EndIt>::type(), ap, enc, stats, it, end);
+	}
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void no_quote_simd(detail::no_simd, Appender&, Encoding&, Stats&, Iterator&, EndIt) {
+	}
+
+#ifdef SAXY_SSE2
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void no_quote_simd(detail::simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		// Only the exact structural characters end the loop, so spaces,
+		// punctuation and non-ASCII bytes stay on the fast path
+		__m128i const comma = _mm_set1_epi8(',');
+		__m128i const quote = _mm_set1_epi8('"');
+		__m128i const cr = _mm_set1_epi8('\r');
+		while(end - it >= 16) {
+			__m128i const csv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&*it));
+			__m128i const special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(csv, comma), _mm_cmpeq_epi8(csv, quote)), _mm_cmpeq_epi8(csv, cr));
+			int const special_chars = _mm_movemask_epi8(special);
+			int const first_special_char = detail::count_leading_zeros(special_chars);
+			if(!enc.bytes(it, it + first_special_char, _mm_movemask_epi8(csv))) {
+				break;
+			}
+
+			ap.append_same(it, it + first_special_char);
+			stats.bytes(unquoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 16);
+			it += first_special_char;
+			if(first_special_char != 16) {
+				break;
+			}
+		}
+	}
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void no_quote_simd(detail::cstr_simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt) {
+		// Blocks are loaded from 16-byte boundaries, which may start before
+		// 'it' and end after the NUL, but never cross a page
+		__m128i const comma = _mm_set1_epi8(',');
+		__m128i const quote = _mm_set1_epi8('"');
+		__m128i const cr = _mm_set1_epi8('\r');
+		__m128i const nul = _mm_setzero_si128();
+		for(;;) {
+			unsigned const offset = reinterpret_cast<std::uintptr_t>(&*it) & 15;
+			__m128i const csv = _mm_load_si128(reinterpret_cast<const __m128i*>(&*it - offset));
+			__m128i const special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(csv, comma), _mm_cmpeq_epi8(csv, quote)),
+			                                     _mm_or_si128(_mm_cmpeq_epi8(csv, cr), _mm_cmpeq_epi8(csv, nul)));
+			unsigned const special_chars = static_cast<unsigned>(_mm_movemask_epi8(special)) >> offset;
+			int const first_special_char = special_chars ? detail::count_leading_zeros(special_chars) : 16 - offset;
+			if(!enc.bytes(it, it + first_special_char, static_cast<unsigned>(_mm_movemask_epi8(csv)) >> offset)) {
+				break;
+			}
+
+			ap.append_same(it, it + first_special_char);
+			stats.bytes(unquoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 16);
+			it += first_special_char;
+			if(special_chars) {
+				break;
+			}
+		}
+	}
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void no_quote_simd(detail::padded_simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		// Full blocks are always loaded, and the bytes past the end are
+		// treated like structural characters
+		__m128i const comma = _mm_set1_epi8(',');
+		__m128i const quote = _mm_set1_epi8('"');
+		__m128i const cr = _mm_set1_epi8('\r');
+		for(;;) {
+			__m128i const csv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&*it));
+			__m128i const special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(csv, comma), _mm_cmpeq_epi8(csv, quote)), _mm_cmpeq_epi8(csv, cr));
+			std::ptrdiff_t const remaining = end - it;
+			unsigned const past_end = remaining < 16 ? 0xFFFFu << remaining : 0u;
+			int const first_special_char = detail::count_leading_zeros(_mm_movemask_epi8(special) | past_end);
+			if(!enc.bytes(it, it + first_special_char, _mm_movemask_epi8(csv))) {
+				break;
+			}
+
+			ap.append_same(it, it + first_special_char);
+			stats.bytes(unquoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 16);
+			it += first_special_char;
+			if(first_special_char != 16) {
+				break;
+			}
+		}
+	}
+
+#else
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void no_quote_simd(detail::simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		// Without SSE2 the bytes are read straight from memory a word at a
+		// time, and the first structural character ends the loop
+		while(end - it >= 8) {
+			std::uint64_t const word = detail::load_word(&*it);
+			std::uint64_t const special = detail::match_byte(word, ',') | detail::match_byte(word, '"') | detail::match_byte(word, '\r');
+			int const first_special_char = detail::first_marked_byte(special);
+			if(!enc.bytes(it, it + first_special_char, detail::top_bits(word))) {
+				break;
+			}
+
+			ap.append_same(it, it + first_special_char);
+			stats.bytes(unquoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 8);
+			it += first_special_char;
+			if(first_special_char != 8) {
+				break;
+			}
+		}
+	}
+
+#endif
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	static void no_quote_simd(detail::swar, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		// Keep the position of every byte copied into the block, so that each
+		// byte is only read and stepped over once
+		char block[8];
+		Iterator at[9];
+		for(;;) {
+			int length = 0;
+			at[0] = it;
+			for(; length < 8 && at[length] != end; ++length) {
+				block[length] = *at[length];
+				at[length + 1] = at[length];
+				++at[length + 1];
+			}
+
+			if(!length) {
+				break;
+			}
+
+			// A short block at the end of the input is padded with a byte
+			// that ends the scan there
+			std::fill(block + length, block + 8, '\r');
+			std::uint64_t const word = detail::load_word(block);
+			std::uint64_t const special = detail::match_byte(word, ',') | detail::match_byte(word, '"') | detail::match_byte(word, '\r');
+			int const first_special_char = detail::first_marked_byte(special);
+			if(!enc.bytes(block, block + first_special_char, detail::top_bits(word))) {
+				break;
+			}
+
+			ap.append(block, block + first_special_char);
+			stats.bytes(unquoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 8);
+			it = at[first_special_char];
+			if(first_special_char != 8) {
+				break;
+			}
+		}
+	}
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void in_quote_simd(Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		in_quote_simd(typename detail::use_simd<Iterator, EndIt>::type(), ap, enc, stats, it, end);
+	}
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void in_quote_simd(detail::no_simd, Appender&, Encoding&, Stats&, Iterator&, EndIt) {
+	}
+
+#ifdef SAXY_SSE2
+	/// Return the number of bytes of a block with double quotes at the bits
+	/// of \a quotes, of which only the first \a limit can be used, before
+	/// its first double quote that is not escaped by the next byte. Set a
+	/// bit of \a escapes for the second double quote of each pair before it.
+	/// A double quote at the last usable byte ends the bytes returned, as the
+	/// byte that tells whether it is escaped is not in the block.
+	static int pair_quotes(unsigned quotes, int limit, unsigned& escapes) {
+		escapes = 0;
+		unsigned rest = quotes & (0xFFFFu >> (16 - limit));
+		while(rest) {
+			int const first = detail::count_leading_zeros(rest);
+			if(first + 1 == limit || !(rest & (2u << first))) {
+				return first;
+			}
+
+			escapes |= 2u << first;
+			rest &= ~(3u << first);
+		}
+
+		return limit;
+	}
+
+	/// Return a mask with the first \a length bytes set.
+	static __m128i prefix_mask(int length) {
+		static signed char const masks[32] = {
+			-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+		};
+
+		return _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks + 16 - length));
+	}
+
+	/// Remove the bytes of \a block at the bits of \a escapes and move the
+	/// bytes after each of them down.
+	static __m128i remove_bytes(__m128i block, unsigned escapes) {
+		for(int removed = 0; escapes; escapes &= escapes - 1, ++removed) {
+			__m128i const keep = prefix_mask(detail::count_leading_zeros(escapes) - removed);
+			block = _mm_or_si128(_mm_and_si128(keep, block), _mm_andnot_si128(keep, _mm_srli_si128(block, 1)));
+		}
+
+		return block;
+	}
+
+	/// Append the first \a length bytes of \a block to \a ap.
+	template <typename Appender>
+	static void append_block(Appender& ap, __m128i block, int length) {
+		char bytes[16];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), block);
+		ap.append(bytes + 0, bytes + length);
+	}
+
+	/// The bytes are written back in place with one wide store. The ones
+	/// past \a length are stored unchanged, and as the field is never ahead
+	/// of the input they lie in the block that was read.
+	static void append_block(detail::in_place& ap, __m128i block, int length) {
+		char* const out = ap.current_pos();
+		__m128i const keep = prefix_mask(length);
+		__m128i const old = _mm_loadu_si128(reinterpret_cast<const __m128i*>(out));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_or_si128(_mm_and_si128(keep, block), _mm_andnot_si128(keep, old)));
+		ap.append_same(out, out + length);
+	}
+
+	/// Consume the \a limit usable bytes of the block \a csv at \a it up
+	/// to the closing double quote, unescaping the pairs of double quotes in
+	/// it all at once. Return false if the loop over blocks must stop.
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator>
+	__forceinline static bool quoted_block(Appender& ap, Encoding& enc, Stats& stats, Iterator& it, __m128i csv, int limit) {
+		unsigned escapes;
+		int const length = pair_quotes(_mm_movemask_epi8(_mm_cmpeq_epi8(csv, _mm_set1_epi8('"'))), limit, escapes);
+		if(!enc.bytes(it, it + length, _mm_movemask_epi8(csv))) {
+			return false;
+		}
+
+		// Each pair is a structural double quote and the quoted one it keeps
+		int const pairs = detail::count_bits(escapes);
+		stats.bytes(quoted_byte, length - pairs);
+		stats.bytes(structural_byte, pairs);
+		stats.simd_block(length, length == 16);
+		if(escapes) {
+			append_block(ap, remove_bytes(csv, escapes), length - pairs);
+		} else {
+			ap.append(it, it + length);
+		}
+
+		it += length;
+
+		// A double quote at the end of a block is looked at again with the
+		// byte after it at the start of the next one
+		return length != 0 && length + 1 >= limit;
+	}
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void in_quote_simd(detail::simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		// Inside quotes only a double quote is special. Escaped double quotes
+		// are unescaped here, so only the closing quote ends the loop.
+		while(end - it >= 16) {
+			__m128i const csv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&*it));
+			if(!quoted_block(ap, enc, stats, it, csv, 16)) {
+				break;
+			}
+		}
+	}
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void in_quote_simd(detail::padded_simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		for(;;) {
+			__m128i const csv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&*it));
+			std::ptrdiff_t const remaining = end - it;
+			if(!quoted_block(ap, enc, stats, it, csv, remaining < 16 ? static_cast<int>(remaining) : 16)) {
+				break;
+			}
+		}
+	}
+
+#else
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void in_quote_simd(detail::simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		while(end - it >= 8) {
+			std::uint64_t const word = detail::load_word(&*it);
+			int const first_special_char = detail::first_marked_byte(detail::match_byte(word, '"'));
+			if(!enc.bytes(it, it + first_special_char, detail::top_bits(word))) {
+				break;
+			}
+
+			stats.bytes(quoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 8);
+			if(first_special_char == 8) {
+				ap.append(it, it + 8);
+				it += 8;
+				continue;
+			}
+
+			Iterator const escape = it + first_special_char;
+			if(end - escape < 2 || escape[1] != '"' || !enc.byte('"') || !enc.byte('"')) {
+				ap.append(it, escape);
+				it = escape;
+				break;
+			}
+
+			// Keep the first of the two double quotes
+			ap.append(it, escape + 1);
+			stats.bytes(structural_byte, 1);
+			stats.bytes(quoted_byte, 1);
+			it = escape + 2;
+		}
+	}
+
+#endif
+
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	static void in_quote_simd(detail::swar, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt end) {
+		// Keep the position of every byte copied into the block, so that each
+		// byte is only read and stepped over once
+		char block[8];
+		Iterator at[9];
+		for(;;) {
+			int length = 0;
+			at[0] = it;
+			for(; length < 8 && at[length] != end; ++length) {
+				block[length] = *at[length];
+				at[length + 1] = at[length];
+				++at[length + 1];
+			}
+
+			if(!length) {
+				break;
+			}
+
+			// A short block at the end of the input is padded with a byte
+			// that ends the scan there
+			std::fill(block + length, block + 8, '"');
+			std::uint64_t const word = detail::load_word(block);
+			int const first_special_char = detail::first_marked_byte(detail::match_byte(word, '"'));
+			if(!enc.bytes(block, block + first_special_char, detail::top_bits(word))) {
+				break;
+			}
+
+			ap.append(block, block + first_special_char);
+			stats.bytes(quoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 8);
+			it = at[first_special_char];
+			if(first_special_char != 8) {
+				break;
+			}
+		}
+	}
+
+#ifdef SAXY_SSE2
+	template <typename Appender, typename Encoding, typename Stats, typename Iterator, typename EndIt>
+	__forceinline static void in_quote_simd(detail::cstr_simd, Appender& ap, Encoding& enc, Stats& stats, Iterator& it, EndIt) {
+		__m128i const quote = _mm_set1_epi8('"');
+		__m128i const nul = _mm_setzero_si128();
+		for(;;) {
+			unsigned const offset = reinterpret_cast<std::uintptr_t>(&*it) & 15;
+			__m128i const csv = _mm_load_si128(reinterpret_cast<const __m128i*>(&*it - offset));
+			__m128i const special = _mm_or_si128(_mm_cmpeq_epi8(csv, quote), _mm_cmpeq_epi8(csv, nul));
+			unsigned const special_chars = static_cast<unsigned>(_mm_movemask_epi8(special)) >> offset;
+			int const first_special_char = special_chars ? detail::count_leading_zeros(special_chars) : 16 - offset;
+			if(!enc.bytes(it, it + first_special_char, static_cast<unsigned>(_mm_movemask_epi8(csv)) >> offset)) {
+				break;
+			}
+
+			stats.bytes(quoted_byte, first_special_char);
+			stats.simd_block(first_special_char, first_special_char == 16);
+			if(!special_chars) {
+				ap.append(it, it + first_special_char);
+				it += first_special_char;
+				continue;
+			}
+
+			// The byte after a double quote can be read as the string goes on
+			// until at least the NUL
+			Iterator const escape = it + first_special_char;
+			if(*escape != '"' || escape[1] != '"' || !enc.byte('"') || !enc.byte('"')) {
+				ap.append(it, escape);
+				it = escape;
+				break;
+			}
+
+			ap.append(it, escape + 1);
+			stats.bytes(structural_byte, 1);
+			stats.bytes(quoted_byte, 1);
+			it = escape + 2;
+		}
+	}
+#endif
+
+	//=========================================================================
+	// dfa engine
+	//=========================================================================
+	// The only DFA state that changes what a byte means is whether it is
+	// between double quotes, so rather than stepping through the bytes one at
+	// a time, every state of a 64-byte block is found at once: a prefix XOR of
+	// the quote mask gives the bytes inside quotes, and the commas and CRLFs
+	// outside them are the field boundaries. Each field is then checked
+	// against the rest of the grammar, which for most fields is a quote count.
+
+	/// Bit i of each mask is set if byte i of a 64-byte block is that byte.
+	struct block_masks {
+		std::uint64_t quote;
+		std::uint64_t comma;
+		std::uint64_t cr;
+		std::uint64_t lf;
+	};
+
+	__forceinline static block_masks classify_block(char const* block) {
+#ifdef SAXY_SSE2
+		__m128i const quote = _mm_set1_epi8('"');
+		__m128i const comma = _mm_set1_epi8(',');
+		__m128i const cr = _mm_set1_epi8('\r');
+		__m128i const lf = _mm_set1_epi8('\n');
+		block_masks m = {0, 0, 0, 0};
+		for(int i = 0; i != 4; ++i) {
+			__m128i const csv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i));
+			m.quote |= static_cast<std::uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(csv, quote)))) << (16 * i);
+			m.comma |= static_cast<std::uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(csv, comma)))) << (16 * i);
+			m.cr |= static_cast<std::uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(csv, cr)))) << (16 * i);
+			m.lf |= static_cast<std::uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(csv, lf)))) << (16 * i);
+		}
+#else
+		block_masks m = {0, 0, 0, 0};
+		for(int i = 0; i != 8; ++i) {
+			std::uint64_t const word = detail::load_word(block + 8 * i);
+			m.quote |= static_cast<std::uint64_t>(detail::top_bits(detail::match_bytes(word, '"'))) << (8 * i);
+			m.comma |= static_cast<std::uint64_t>(detail::top_bits(detail::match_bytes(word, ','))) << (8 * i);
+			m.cr |= static_cast<std::uint64_t>(detail::top_bits(detail::match_bytes(word, '\r'))) << (8 * i);
+			m.lf |= static_cast<std::uint64_t>(detail::top_bits(detail::match_bytes(word, '\n'))) << (8 * i);
+		}
+#endif
+
+		return m;
+	}
+
+	/// Set \a field to the field of \a data between \a first and \a last,
+	/// unescaping it in place if \a quotes is true. Otherwise return the
+	/// error the state machine would find and set \a error_at to the offset
+	/// it would stop at. \a length is the length of \a data.
+	static error_code check_field(char* data, std::size_t first, std::size_t last, bool quotes, std::size_t length, string_view& field, std::size_t& error_at) {
+		char* const begin = data + first;
+		if(!quotes) {
+			field = string_view(begin, last - first);
+			return none;
+		}
+
+		if(*begin != '"') {
+			error_at = static_cast<char*>(std::memchr(begin, '"', last - first)) - data + 1;
+			return misplaced_double_quotes;
+		}
+
+		if(last - first >= 2 && data[last - 1] == '"' && !std::memchr(begin + 1, '"', last - first - 2)) {
+			field = string_view(begin + 1, last - first - 2);
+			return none;
+		}
+
+		char* const content = begin + 1;
+		char* write = content;
+		for(std::size_t i = first + 1; i != last; ++i) {
+			if(data[i] != '"') {
+				*write++ = data[i];
+			} else if(i + 1 != last && data[i + 1] == '"') {
+				*write++ = '"';
+				++i;
+			} else if(i + 1 == last) {
+				field = string_view(content, write - content);
+				return none;
+			} else if(data[i + 1] != '\r') {
+				error_at = i + 2;
+				return text_after_closing_quotes;
+			} else if(i + 2 == length) {
+				error_at = length;
+				return text_after_closing_quotes;
+			} else {
+				error_at = i + 3;
+				return unfinished_crlf;
+			}
+		}
+
+		// Only the last field can be missing its closing quote
+		error_at = length;
+		return unclosed_quote;
+	}
+
+	template <typename Callback>
+	static bool parse_dfa(Callback& cb, char* data, std::size_t length, char** out) {
+		char* ignored;
+		char*& pos = out ? *out : ignored;
+		pos = data + length;
+
+		// Fields are between 'first' and the next boundary, and the last
+		// quote seen so far ends at 'quote_end'
+		std::size_t first = 0;
+		std::size_t quote_end = 0;
+		bool in_row = false;
+		bool empty_row = true;
+		std::uint64_t in_quotes_carry = 0;
+		std::uint64_t cr_carry = 0;
+		string_view field;
+		std::size_t error_at;
+		char tail[64];
+		for(std::size_t offset = 0; offset < length; offset += 64) {
+			char const* block = data + offset;
+			if(length - offset < 64) {
+				std::memcpy(tail, block, length - offset);
+				std::memset(tail + (length - offset), 0, 64 - (length - offset));
+				block = tail;
+			}
+
+			block_masks const m = classify_block(block);
+			std::uint64_t const in_quotes = detail::prefix_xor(m.quote) ^ in_quotes_carry;
+			std::uint64_t const crlf = m.lf & ((m.cr << 1) | cr_carry) & ~in_quotes;
+			in_quotes_carry = 0 - (in_quotes >> 63);
+			cr_carry = m.cr >> 63;
+			for(std::uint64_t boundaries = (m.comma & ~in_quotes) | crlf; boundaries != 0; boundaries &= boundaries - 1) {
+				int const bit = detail::lowest_set_bit(boundaries);
+				std::size_t const at = offset + bit;
+				std::uint64_t const quotes_before = m.quote & ((std::uint64_t(1) << bit) - 1);
+				std::size_t const last_quote_end = quotes_before ? offset + detail::highest_set_bit(quotes_before) + 1 : quote_end;
+				bool const end_of_record = ((crlf >> bit) & 1) != 0;
+				std::size_t const last = end_of_record ? at - 1 : at;
+				if(!in_row) {
+					in_row = true;
+					empty_row = true;
+					pos = data + first;
+					SAXY_RUN_CALLBACK(cb.start_row());
+				}
+
+				if(end_of_record && empty_row && first == last) {
+					pos = data + at + 1;
+					require_abort(signal_error(cb, error_code::no_fields_in_record));
+					return false;
+				}
+
+				error_code const code = check_field(data, first, last, last_quote_end > first, length, field, error_at);
+				if(code != none) {
+					pos = data + error_at;
+					require_abort(signal_error(cb, code));
+					return false;
+				}
 
-	template <typename Appender, typename Iterator, typename EndIt>
-	__forceinline static Iterator no_quote_simd(detail::no_simd, Appender&, Iterator it, EndIt) {
-		return it;
-	}
+				pos = data + at + 1;
+				empty_row = false;
+				SAXY_RUN_CALLBACK(cb.field(field));
+				if(end_of_record) {
+					in_row = false;
+					SAXY_RUN_CALLBACK(cb.end_row());
+				}
 
-	template <typename Appender, typename Iterator, typename EndIt>
-	__forceinline static Iterator no_quote_simd(detail::simd, Appender& ap, Iterator it, EndIt end) {
-		while(end - it >= 16) {
-			__m128i const comma = _mm_set1_epi8(',' + 1);
-			__m128i const csv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&*it));
-			int const special_chars = _mm_movemask_epi8(_mm_cmplt_epi8(csv, comma));
-			int const first_special_char = detail::count_leading_zeros(special_chars);
-			ap.append_same(it, it + first_special_char);
-			it += first_special_char;
-			if(first_special_char != 16) {
-				break;
+				first = at + 1;
+			}
+
+			if(m.quote) {
+				quote_end = offset + detail::highest_set_bit(m.quote) + 1;
 			}
 		}
 
-		return it;
-	}
+		// The last record doesn't need to end with a CRLF
+		if(!in_row) {
+			if(length == 0) {
+				require_abort(signal_error(cb, error_code::no_fields_in_record));
+				return false;
+			}
 
-	template <typename Appender, typename Iterator, typename EndIt>
-	__forceinline static Iterator in_quote_simd(Appender& ap, Iterator it, EndIt end) {
-		return in_quote_simd(typename detail::use_simd<Iterator, EndIt>::type(), ap, it, end);
-	}
+			if(first == length) {
+				return true;
+			}
 
-	template <typename Appender, typename Iterator, typename EndIt>
-	__forceinline static Iterator in_quote_simd(detail::no_simd, Appender&, Iterator it, EndIt) {
-		return it;
-	}
+			pos = data + first;
+			SAXY_RUN_CALLBACK(cb.start_row());
+		}
 
-	template <typename Appender, typename Iterator, typename EndIt>
-	__forceinline static Iterator in_quote_simd(detail::simd, Appender& ap, Iterator it, EndIt end) {
-		while(end - it >= 16) {
-			__m128i const comma = _mm_set1_epi8(',' - 1);
-			__m128i const csv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&*it));
-			unsigned const special_chars = _mm_movemask_epi8(_mm_cmplt_epi8(csv, comma));
-			int const first_special_char = detail::count_leading_zeros(special_chars);
-			ap.append(it, it + first_special_char); // TODO, special case when we haven't have quotes
-			it += first_special_char;
-			if(first_special_char != 16) {
-				break;
-			}
+		pos = data + length;
+
+		error_code const code = check_field(data, first, length, quote_end > first, length, field, error_at);
+		if(code != none) {
+			pos = data + error_at;
+			require_abort(signal_error(cb, code));
+			return false;
 		}
 
-		return it;
+		SAXY_RUN_CALLBACK(cb.field(field));
+		SAXY_RUN_CALLBACK(cb.end_row());
+		return true;
 	}
 
 public:
@@ -639,8 +3036,6 @@ public:
 	};
 };
 
-char const* csv::name = "CSV";
-
 //-----------------------------------------------------------------------------
 // value
 //-----------------------------------------------------------------------------
@@ -675,33 +3070,507 @@ csv::error_code csv::value<StringView>::error() const {
 	return m_error;
 }
 
+//-----------------------------------------------------------------------------
+// header
+//-----------------------------------------------------------------------------
+inline
+csv::header::header()
+: m_seed(0) {
+}
+
+template <typename InputIt>
+csv::header::header(InputIt first, InputIt last)
+: m_seed(0) {
+	for(; first != last; ++first) {
+		string_cview const name(*first);
+		m_names.push_back(std::string(name.data(), name.size()));
+	}
+
+	build();
+}
+
+inline
+std::size_t csv::header::hash(string_cview str, std::size_t seed) {
+	// FNV-1a
+	std::size_t h = seed ^ 2166136261u;
+	for(string_cview::const_iterator it = str.begin(); it != str.end(); ++it) {
+		h = (h ^ static_cast<unsigned char>(*it)) * 16777619u;
+	}
+
+	return h ^ (h >> 15);
+}
+
+inline
+void csv::header::build() {
+	// Look for a seed that puts every distinct name in its own slot, doubling
+	// the table if that takes too long. Duplicate names are left out so that
+	// 'find' returns the first column with that name.
+	std::size_t size = 1;
+	while(size < 2 * m_names.size()) {
+		size *= 2;
+	}
+
+	for(;;) {
+		for(std::size_t seed = 0; seed < 32; ++seed) {
+			m_table.assign(size, 0);
+			bool perfect = true;
+			for(std::size_t i = 0; i < m_names.size() && perfect; ++i) {
+				std::size_t& slot = m_table[hash(m_names[i], seed) & (size - 1)];
+				if(slot == 0) {
+					slot = i + 1;
+				} else {
+					perfect = m_names[slot - 1] == m_names[i];
+				}
+			}
+
+			if(perfect) {
+				m_seed = seed;
+				return;
+			}
+		}
+
+		size *= 2;
+	}
+}
+
+inline
+std::size_t csv::header::size() const {
+	return m_names.size();
+}
+
+inline
+bool csv::header::empty() const {
+	return m_names.empty();
+}
+
+inline
+std::string const& csv::header::operator[](std::size_t column) const {
+	assert(column < m_names.size());
+	return m_names[column];
+}
+
+inline
+std::size_t csv::header::find(string_cview name) const {
+	if(m_table.empty()) {
+		return npos;
+	}
+
+	std::size_t const slot = m_table[hash(name, m_seed) & (m_table.size() - 1)];
+	if(slot != 0 && m_names[slot - 1] == name) {
+		return slot - 1;
+	}
+
+	return npos;
+}
+
+//-----------------------------------------------------------------------------
+// statistics
+//-----------------------------------------------------------------------------
+inline
+csv::statistics::statistics()
+: unquoted_bytes(0)
+, quoted_bytes(0)
+, structural_bytes(0)
+, simd_bytes(0)
+, simd_blocks(0)
+, simd_fallbacks(0)
+, state_changes(0)
+, quoted_fields(0)
+, fields(0)
+, rows(0)
+, stops(0) {
+}
+
+inline
+unsigned long long csv::statistics::total_bytes() const {
+	return unquoted_bytes + quoted_bytes + structural_bytes;
+}
+
+inline
+void csv::statistics::bytes(byte_kind kind, std::size_t n) {
+	switch(kind) {
+		case unquoted_byte:
+			unquoted_bytes += n;
+			break;
+		case quoted_byte:
+			quoted_bytes += n;
+			break;
+		case structural_byte:
+			structural_bytes += n;
+			break;
+	}
+}
+
+inline
+void csv::statistics::simd_block(std::size_t n, bool whole) {
+	simd_bytes += n;
+	if(whole) {
+		++simd_blocks;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// validation
+//-----------------------------------------------------------------------------
+inline
+csv::validation csv::validate(char const* data, std::size_t length, encoding enc) {
+	validation result;
+	validate_callback cb(result);
+	detail::discard ap;
+	any_field_count fc;
+	detail::utf8_validator validator;
+	state s = begin;
+	char const* out = data;
+	if(!parse_encoded(enc, validator, ap, cb, fc, s, data, data + length, &out)) {
+		result.error_offset = out - data - 1;
+	} else if(!finish_encoded(enc, validator, ap, cb, fc, s)) {
+		result.error_offset = length;
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// record splitting
+//-----------------------------------------------------------------------------
+inline
+std::vector<std::size_t> csv::split_records(char const* data, std::size_t length, std::size_t parts) {
+	std::vector<std::size_t> offsets(1, 0);
+	std::size_t i = 0;
+	bool in_quotes = false;
+	for(std::size_t part = 1; part < parts; ++part) {
+		// Skip to the target size and then on to the end of that record,
+		// still counting the quotes in between
+		std::size_t const target = length / parts * part;
+		while(i < target && next_record(data, length, i, in_quotes)) {
+		}
+
+		if(i < target || i == length) {
+			break;
+		}
+
+		if(i != offsets.back()) {
+			offsets.push_back(i);
+		}
+	}
+
+	return offsets;
+}
+
+inline
+std::size_t csv::complete_records(char const* data, std::size_t length) {
+	std::size_t i = 0;
+	std::size_t end = 0;
+	bool in_quotes = false;
+	while(next_record(data, length, i, in_quotes)) {
+		end = i;
+	}
+
+	return end;
+}
+
+inline
+bool csv::next_record(char const* data, std::size_t size, std::size_t& i, bool& in_quotes) {
+	// A line break ends a record unless it is inside quotes, and as doubled
+	// quotes cancel out only the number of quotes before it matters
+#ifdef SAXY_SSE2
+	std::size_t const width = 16;
+	__m128i const quote = _mm_set1_epi8('"');
+	__m128i const cr = _mm_set1_epi8('\r');
+#else
+	std::size_t const width = 8;
+#endif
+	while(i + 1 < size) {
+		if(size - i > width) {
+#ifdef SAXY_SSE2
+			__m128i const block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+			bool const special = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, cr))) != 0;
+#else
+			std::uint64_t const word = detail::load_word(data + i);
+			bool const special = (detail::match_byte(word, '"') | detail::match_byte(word, '\r')) != 0;
+#endif
+			if(!special) {
+				i += width;
+				continue;
+			}
+		}
+
+		for(std::size_t const block_end = std::min(i + width, size - 1); i != block_end; ++i) {
+			if(data[i] == '"') {
+				in_quotes = !in_quotes;
+			} else if(data[i] == '\r' && data[i + 1] == '\n' && !in_quotes) {
+				i += 2;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// schema inference
+//-----------------------------------------------------------------------------
+inline
+unsigned char const* csv::value_classes() {
+	struct table {
+		unsigned char classes[256];
+
+		table()
+		: classes() {
+			for(char c = '0'; c <= '9'; ++c) {
+				classes[static_cast<unsigned char>(c)] = 1;
+			}
+
+			classes['.'] = 2;
+			classes['+'] = 4;
+			classes['-'] = 8;
+			classes['e'] = classes['E'] = 16;
+			classes['/'] = 32;
+			classes[':'] = 64;
+			classes['T'] = classes[' '] = 128;
+		}
+	};
+
+	static table const t;
+	return t.classes;
+}
+
+inline
+std::vector<csv::column_schema> csv::infer_schema(char const* data, std::size_t length, schema_options const& options) {
+	std::vector<column_schema> columns;
+	std::size_t const head = std::min(options.head_bytes, length);
+	sample_schema(columns, options.has_header, data, head, true, head == length);
+
+	if(head < length && options.seek_bytes != 0) {
+		unsigned long long random = options.seed | 1;
+		std::size_t const range = length - head;
+		for(std::size_t i = 0; i < options.seeks; ++i) {
+			std::size_t const offset = head + static_cast<std::size_t>(next_random(random) % range);
+			std::size_t const size = std::min(options.seek_bytes, length - offset);
+			sample_schema(columns, false, data + offset, size, false, offset + size == length);
+		}
+	}
+
+	return columns;
+}
+
+inline
+std::vector<csv::column_schema> csv::infer_schema(std::istream& in, schema_options const& options) {
+	std::vector<column_schema> columns;
+	std::streamoff const start = in.tellg();
+	std::vector<char> buffer(options.head_bytes);
+	in.read(buffer.data(), buffer.size());
+	std::size_t const head = static_cast<std::size_t>(in.gcount());
+	bool const complete = head < buffer.size();
+	sample_schema(columns, options.has_header, buffer.data(), head, true, complete);
+
+	if(complete || options.seek_bytes == 0 || start < 0) {
+		return columns;
+	}
+
+	in.clear();
+	std::streamoff const end = in.seekg(0, std::ios_base::end).tellg();
+	std::streamoff const length = end - start;
+	if(end < 0 || static_cast<std::size_t>(length) <= head) {
+		return columns;
+	}
+
+	buffer.resize(options.seek_bytes);
+	unsigned long long random = options.seed | 1;
+	std::size_t const range = static_cast<std::size_t>(length) - head;
+	for(std::size_t i = 0; i < options.seeks; ++i) {
+		std::size_t const offset = head + static_cast<std::size_t>(next_random(random) % range);
+		in.clear();
+		in.seekg(start + static_cast<std::streamoff>(offset));
+		in.read(buffer.data(), buffer.size());
+		std::size_t const size = static_cast<std::size_t>(in.gcount());
+		sample_schema(columns, false, buffer.data(), size, false, offset + size == static_cast<std::size_t>(length));
+	}
+
+	return columns;
+}
+
 //-----------------------------------------------------------------------------
 // in_place_parser
 //-----------------------------------------------------------------------------
+inline
 csv::in_place_parser::in_place_parser()
 : m_appender(0)
 , m_end(0)
 , m_state(begin)
-, m_pos(0) {
+, m_pos(0)
+, m_field_count(field_count::any())
+, m_encoding(any_bytes)
+, m_position() {
 }
 
+inline
 csv::in_place_parser::in_place_parser(char* start, std::size_t length)
 : m_appender(start)
 , m_end(start + length)
 , m_state(begin)
-, m_pos(start) {
+, m_pos(start)
+, m_field_count(field_count::any())
+, m_encoding(any_bytes)
+, m_position() {
+}
+
+inline
+csv::in_place_parser::in_place_parser(char* start, std::size_t length, field_count const& count, encoding enc)
+: m_appender(start)
+, m_end(start + length)
+, m_state(begin)
+, m_pos(start)
+, m_field_count(count)
+, m_encoding(enc)
+, m_position() {
+	m_row.reserve(count.expected());
 }
 
+inline
 char const* csv::in_place_parser::position() const {
 	return m_pos;
 }
 
 template <typename Callback>
 bool csv::in_place_parser::parse(Callback& cb, std::size_t max_parse) {
+	no_statistics stats;
+	return parse(cb, stats, max_parse);
+}
+
+template <typename Callback, typename Stats>
+bool csv::in_place_parser::parse(Callback& cb, Stats& stats, std::size_t max_parse) {
+	typedef typename std::remove_reference<typename in_place_callback<Callback>::type>::type row_type;
+	typedef typename std::remove_reference<typename counted_callback<row_type, Stats>::type>::type counted_type;
+	typename in_place_callback<Callback>::type rcb = in_place_callback<Callback>::make(cb, m_row);
+	typedef stream_callback<Callback, counted_type> stream_type;
+	typename counted_callback<row_type, Stats>::type scb = counted_callback<row_type, Stats>::make(rcb, stats);
+	typename stream_type::type ocb = stream_type::make(scb, m_position);
+	char* const first = m_pos;
+	detail::scope_distance<char*> counter(first, &m_pos, &m_position.offset);
 	std::size_t const length = m_end - m_pos;
-	bool const result = m_end ? parse_impl(m_appender, cb, m_state, m_pos, m_pos + std::min(max_parse, length), &m_pos)
-	                          : parse_impl(m_appender, cb, m_state, m_pos, detail::cstr_end_iterator(), &m_pos);
-	return result;
+	SAXY_PROBE2(csv_buffer, m_pos, m_end ? std::min(max_parse, length) : 0);
+	bool const result = m_end ? parse_encoded(m_encoding, m_utf8, m_appender, ocb, m_field_count, stats, m_state, m_pos, m_pos + std::min(max_parse, length), &m_pos)
+	                          : parse_encoded(m_encoding, m_utf8, m_appender, ocb, m_field_count, stats, m_state, m_pos, detail::cstr_end_iterator(), &m_pos);
+	return stream_type::report(cb, ocb, first, m_pos, result);
+}
+
+template <typename Callback>
+bool csv::in_place_parser::finish(Callback& cb) {
+	no_statistics stats;
+	return finish(cb, stats);
+}
+
+template <typename Callback, typename Stats>
+bool csv::in_place_parser::finish(Callback& cb, Stats& stats) {
+	typedef typename std::remove_reference<typename in_place_callback<Callback>::type>::type row_type;
+	typedef typename std::remove_reference<typename counted_callback<row_type, Stats>::type>::type counted_type;
+	typedef stream_callback<Callback, counted_type> stream_type;
+	typename in_place_callback<Callback>::type rcb = in_place_callback<Callback>::make(cb, m_row);
+	typename counted_callback<row_type, Stats>::type scb = counted_callback<row_type, Stats>::make(rcb, stats);
+	typename stream_type::type ocb = stream_type::make(scb, m_position);
+	bool const result = finish_encoded(m_encoding, m_utf8, m_appender, ocb, m_field_count, m_state);
+	return stream_type::report_finish(cb, ocb, result);
+}
+
+//-----------------------------------------------------------------------------
+// transcoding_parser
+//-----------------------------------------------------------------------------
+inline
+csv::transcoding_parser::transcoding_parser(transcoder::encoding enc)
+: m_transcoder(enc)
+, m_scanned(0)
+, m_boundary(0)
+, m_in_quotes(false)
+, m_finishing(false) {
+}
+
+inline
+transcoder::encoding csv::transcoding_parser::source_encoding() const {
+	return m_transcoder.source_encoding();
+}
+
+template <typename Callback>
+bool csv::transcoding_parser::parse(Callback& cb, char const* data, std::size_t length) {
+	m_transcoder.convert(data, length, m_pending);
+
+	// Records left over after a callback stopped the parsing come first,
+	// and the new ones wait until the next call
+	if(has_unparsed()) {
+		return m_parser.parse(cb);
+	}
+
+	find_boundary();
+	if(!m_boundary) {
+		return true;
+	}
+
+	// Parse the complete records where they are and only copy the partial
+	// record after them to the start of the other buffer
+	m_records.swap(m_pending);
+	m_pending.assign(m_records.begin() + m_boundary, m_records.end());
+	m_parser = in_place_parser(m_records.data(), m_boundary);
+	m_scanned -= m_boundary;
+	m_boundary = 0;
+	return m_parser.parse(cb);
+}
+
+template <typename Callback>
+bool csv::transcoding_parser::finish(Callback& cb) {
+	if(!m_finishing) {
+		m_transcoder.finish(m_pending);
+		for(;;) {
+			if(!parse(cb, 0, 0)) {
+				return false;
+			}
+
+			if(has_unparsed()) {
+				return true;
+			}
+
+			find_boundary();
+			if(!m_boundary) {
+				break;
+			}
+		}
+
+		// Whatever is left is the last record, which has no line break
+		if(m_pending.empty() && m_parser.end()) {
+			return true;
+		}
+
+		m_finishing = true;
+		m_records.swap(m_pending);
+		m_pending.clear();
+		m_parser = in_place_parser(m_records.data(), m_records.size());
+	}
+
+	if(m_parser.remaining_bytes() > 0) {
+		if(!m_parser.parse(cb)) {
+			return false;
+		}
+
+		if(m_parser.remaining_bytes() > 0) {
+			return true;
+		}
+	}
+
+	return m_parser.finish(cb);
+}
+
+inline
+bool csv::transcoding_parser::has_unparsed() const {
+	// A callback can stop the parsing between records, with more of them
+	// to come, or after the last byte of a record before its end_row
+	return m_parser.remaining_bytes() > 0 || (m_parser.m_state != begin && m_parser.m_state != start_of_row);
+}
+
+inline
+void csv::transcoding_parser::find_boundary() {
+	while(next_record(m_pending.data(), m_pending.size(), m_scanned, m_in_quotes)) {
+		m_boundary = m_scanned;
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -709,22 +3578,65 @@ bool csv::in_place_parser::parse(Callback& cb, std::size_t max_parse) {
 //-----------------------------------------------------------------------------
 template <template <typename> class Allocator>
 csv::parser<Allocator>::parser()
-: m_state(begin) {
+: m_state(begin)
+, m_field_count(field_count::any())
+, m_encoding(any_bytes)
+, m_chunk_size(0)
+, m_max_capacity(-1)
+, m_chunked(false)
+, m_position() {
 }
 
 template <template <typename> class Allocator>
 csv::parser<Allocator>::parser(std::size_t initial_capacity)
-: m_state(begin) {
+: m_state(begin)
+, m_field_count(field_count::any())
+, m_encoding(any_bytes)
+, m_chunk_size(0)
+, m_max_capacity(-1)
+, m_chunked(false)
+, m_position() {
 	m_field.reserve(initial_capacity);
 }
 
 template <template <typename> class Allocator>
 csv::parser<Allocator>::parser(std::size_t initial_capacity, const Allocator<char>& alloc)
 : m_field(alloc)
-, m_state(begin) {
+, m_state(begin)
+, m_field_count(field_count::any())
+, m_encoding(any_bytes)
+, m_chunk_size(0)
+, m_max_capacity(-1)
+, m_chunked(false)
+, m_position() {
 	m_field.reserve(initial_capacity);
 }
 
+template <template <typename> class Allocator>
+void csv::parser<Allocator>::set_field_count(field_count const& count) {
+	m_field_count = count;
+}
+
+template <template <typename> class Allocator>
+std::size_t csv::parser<Allocator>::expected_fields() const {
+	return m_field_count.expected();
+}
+
+template <template <typename> class Allocator>
+void csv::parser<Allocator>::set_encoding(encoding enc) {
+	m_encoding = enc;
+}
+
+template <template <typename> class Allocator>
+void csv::parser<Allocator>::set_chunk_size(std::size_t size) {
+	m_chunk_size = size;
+}
+
+template <template <typename> class Allocator>
+void csv::parser<Allocator>::set_max_capacity(std::size_t capacity) {
+	m_max_capacity = capacity;
+}
+
 template <template <typename> class Allocator>
 std::size_t csv::parser<Allocator>::hash() const {
 	std::size_t h = m_state;
@@ -742,31 +3654,171 @@ std::size_t csv::parser<Allocator>::hash() const {
 template <template <typename> class Allocator>
 template <typename Callback>
 bool csv::parser<Allocator>::finish(Callback& cb) {
+	no_statistics stats;
+	return finish(cb, stats);
+}
+
+template <template <typename> class Allocator>
+template <typename Callback, typename Stats>
+bool csv::parser<Allocator>::finish(Callback& cb, Stats& stats) {
+	typedef typename std::remove_reference<typename chunk_callback<Callback>::type>::type chunk_type;
+	typedef typename std::remove_reference<typename counted_callback<chunk_type, Stats>::type>::type counted_type;
+	typedef stream_callback<Callback, counted_type> stream_type;
 	detail::append_to_vector<std::vector<char, Allocator<char> > > x(m_field);
-	return finish_impl(x, cb, m_state);
+	typename chunk_callback<Callback>::type ccb = chunk_callback<Callback>::make(cb, m_chunked);
+	typename counted_callback<chunk_type, Stats>::type scb = counted_callback<chunk_type, Stats>::make(ccb, stats);
+	typename stream_type::type ocb = stream_type::make(scb, m_position);
+	bool const result = finish_encoded(m_encoding, m_utf8, x, ocb, m_field_count, m_state);
+	release_memory();
+	return report_finish<stream_type>(cb, ocb, result);
 }
 
 template <template <typename> class Allocator>
 template <typename Callback>
 bool csv::parser<Allocator>::parse(Callback& cb, char const* str, char const** out) {
+	no_statistics stats;
+	return parse(cb, stats, str, out);
+}
+
+template <template <typename> class Allocator>
+template <typename Callback, typename Stats>
+typename std::enable_if<!std::is_pointer<Stats>::value, bool>::type csv::parser<Allocator>::parse(Callback& cb, Stats& stats, char const* str, char const** out) {
+	// Chunks are cut at fixed offsets, which needs the end of the string
+	if(has_field_chunk<Callback>::value && m_chunk_size != 0) {
+		return parse(cb, stats, str, str + std::strlen(str), out);
+	}
+
+	typedef typename std::remove_reference<typename chunk_callback<Callback>::type>::type chunk_type;
+	typedef typename std::remove_reference<typename counted_callback<chunk_type, Stats>::type>::type counted_type;
 	detail::append_to_vector<std::vector<char, Allocator<char> > > x(m_field);
+	typename chunk_callback<Callback>::type ccb = chunk_callback<Callback>::make(cb, m_chunked);
+	typedef stream_callback<Callback, counted_type> stream_type;
+	typename counted_callback<chunk_type, Stats>::type scb = counted_callback<chunk_type, Stats>::make(ccb, stats);
+	typename stream_type::type ocb = stream_type::make(scb, m_position);
 
 	detail::cstr_end_iterator end;
-	bool const result = parse_impl(x, cb, m_state, str, end, out);
-	return result;
+	char const* stop = str;
+	char const** const last = out ? out : &stop;
+	detail::scope_distance<char const*> counter(str, last, offset_count<Callback>());
+	bool const result = parse_encoded(m_encoding, m_utf8, x, ocb, m_field_count, stats, m_state, str, end, last);
+	release_memory();
+	return report<stream_type>(cb, ocb, str, *last, result);
 }
 
 template <template <typename> class Allocator>
 template <typename Callback, typename ForwardIt>
 bool csv::parser<Allocator>::parse(Callback& cb, ForwardIt it, ForwardIt end, ForwardIt* out) {
+	no_statistics stats;
+	return parse(cb, stats, it, end, out);
+}
+
+template <template <typename> class Allocator>
+template <typename Callback, typename Stats, typename ForwardIt>
+bool csv::parser<Allocator>::parse(Callback& cb, Stats& stats, ForwardIt it, ForwardIt end, ForwardIt* out) {
+	bool const result = parse_range(cb, stats, it, end, out, typename has_field_chunk<Callback>::type());
+	release_memory();
+	return result;
+}
+
+template <template <typename> class Allocator>
+template <typename Callback, typename Stats, typename ForwardIt>
+bool csv::parser<Allocator>::parse_range(Callback& cb, Stats& stats, ForwardIt it, ForwardIt end, ForwardIt* out, std::false_type) {
+	typedef typename std::remove_reference<typename counted_callback<Callback, Stats>::type>::type counted_type;
+	typedef stream_callback<Callback, counted_type> stream_type;
 	detail::append_to_vector<std::vector<char, Allocator<char> > > x(m_field);
-	return parse_impl(x, cb, m_state, it, end, out);
+	typename counted_callback<Callback, Stats>::type scb = counted_callback<Callback, Stats>::make(cb, stats);
+	typename stream_type::type ocb = stream_type::make(scb, m_position);
+	ForwardIt stop = it;
+	ForwardIt* const last = out ? out : &stop;
+	detail::scope_distance<ForwardIt> counter(it, last, offset_count<Callback>());
+	bool const result = parse_encoded(m_encoding, m_utf8, x, ocb, m_field_count, stats, m_state, it, end, last);
+	return report<stream_type>(cb, ocb, it, *last, result);
+}
+
+template <template <typename> class Allocator>
+template <typename Callback, typename Stats, typename ForwardIt>
+bool csv::parser<Allocator>::parse_range(Callback& cb, Stats& stats, ForwardIt it, ForwardIt end, ForwardIt* out, std::true_type) {
+	typedef typename std::remove_reference<typename counted_callback<field_chunk_callback<Callback>, Stats>::type>::type counted_type;
+	typedef stream_callback<Callback, counted_type> stream_type;
+	detail::append_to_vector<std::vector<char, Allocator<char> > > x(m_field);
+	field_chunk_callback<Callback> ccb(cb, m_chunked);
+	typename counted_callback<field_chunk_callback<Callback>, Stats>::type scb = counted_callback<field_chunk_callback<Callback>, Stats>::make(ccb, stats);
+	detail::scope_assign<ForwardIt> assign_guard(it, out);
+	do {
+		ForwardIt const step_start = it;
+		ForwardIt const step_end = m_chunk_size != 0 ? detail::advance_at_most(it, end, m_chunk_size) : end;
+		typename stream_type::type ocb = stream_type::make(scb, m_position);
+		detail::scope_distance<ForwardIt> counter(step_start, &it, offset_count<Callback>());
+		if(!report<stream_type>(cb, ocb, step_start, it, parse_encoded(m_encoding, m_utf8, x, ocb, m_field_count, stats, m_state, it, step_end, &it))) {
+			return false;
+		}
+
+		if(ccb.stopped()) {
+			return true;
+		}
+
+		if(m_chunk_size != 0) {
+			SAXY_RUN_CALLBACK(flush_chunks(cb));
+		}
+	} while(it != end);
+
+	return true;
+}
+
+template <template <typename> class Allocator>
+template <typename Stream, typename Callback, typename ForwardIt>
+bool csv::parser<Allocator>::report(Callback& cb, typename Stream::type& scb, ForwardIt first, ForwardIt stop, bool result) {
+	if(Stream::holds_error(scb)) {
+		m_chunked = false;
+	}
+
+	return Stream::report(cb, scb, first, stop, result);
+}
+
+template <template <typename> class Allocator>
+template <typename Stream, typename Callback>
+bool csv::parser<Allocator>::report_finish(Callback& cb, typename Stream::type& scb, bool result) {
+	if(Stream::holds_error(scb)) {
+		m_chunked = false;
+	}
+
+	return Stream::report_finish(cb, scb, result);
+}
+
+template <template <typename> class Allocator>
+template <typename Callback>
+command csv::parser<Allocator>::flush_chunks(Callback& cb) {
+	// The field buffer is empty between fields and otherwise ends with a
+	// terminator that is not part of the field
+	std::size_t const size = m_field.empty() ? 0 : m_field.size() - 1;
+	std::size_t done = 0;
+	command c = keep_going;
+	while(size - done >= m_chunk_size && !detail::stop_parsing(c)) {
+		m_chunked = true;
+		c = cb.field_chunk(string_cview(m_field.data() + done, m_chunk_size), false);
+		done += m_chunk_size;
+	}
+
+	m_field.erase(m_field.begin(), m_field.begin() + done);
+	return c;
+}
+
+template <template <typename> class Allocator>
+void csv::parser<Allocator>::release_memory() {
+	if(m_field.capacity() > m_max_capacity && m_field.size() <= m_max_capacity) {
+		std::vector<char, Allocator<char> >(m_field.begin(), m_field.end(), m_field.get_allocator()).swap(m_field);
+	}
 }
 
 template <template <typename> class Allocator>
 template <template <typename> class RAllocator>
 bool csv::parser<Allocator>::operator==(parser<RAllocator> const& rhs) {
 	return m_state == rhs.m_state &&
+	       m_field_count == rhs.m_field_count &&
+	       m_encoding == rhs.m_encoding &&
+	       m_utf8 == rhs.m_utf8 &&
+	       m_chunk_size == rhs.m_chunk_size &&
+	       m_chunked == rhs.m_chunked &&
 	       m_field.size() == rhs.m_field.size() &&
 	       !std::memcmp(m_field.data(), rhs.m_field.data(), m_field.size());
 }
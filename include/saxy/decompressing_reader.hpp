@@ -0,0 +1,315 @@
+/*************************************************************************//**
+ * \file   decompressing_reader.hpp
+ * \author Elliot Goodrich
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#ifndef INCLUDE_GUARD_9257BB0E_C6FE_4821_AF66_1750CC4C9397
+#define INCLUDE_GUARD_9257BB0E_C6FE_4821_AF66_1750CC4C9397
+
+#include "common.hpp"
+#include "string_view.hpp"
+
+#ifdef SAXY_CPP11
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+namespace saxy {
+
+/// A class that reads a stream that may be compressed and decompresses it on
+/// a helper thread into a ring of buffers, so that a parser can work on one
+/// buffer while the following ones are being filled. gzip streams, including
+/// several gzip members one after another, are decompressed and anything else
+/// apart from other compression formats is passed through unchanged.
+class decompressing_reader {
+	std::istream* m_in;
+	std::vector<std::vector<char> > m_buffers;
+	std::vector<std::size_t> m_sizes;
+	std::vector<char> m_input;
+	std::size_t m_read;
+	std::size_t m_ready;
+	std::size_t m_free;
+	bool m_holding;
+	bool m_done;
+	bool m_cancel;
+	std::string m_error;
+	std::mutex m_mutex;
+	std::condition_variable m_filled;
+	std::condition_variable m_emptied;
+	std::thread m_thread;
+
+public:
+	/// Start reading from \a in, which must outlive this object, into
+	/// \a buffers buffers of \a buffer_size bytes each.
+	///
+	/// @pre: \a buffers is at least 2 and \a buffer_size is not 0.
+	explicit decompressing_reader(std::istream& in, std::size_t buffer_size = 1 << 16, std::size_t buffers = 4);
+
+	/// Stop the helper thread, discarding anything not yet read.
+	~decompressing_reader();
+
+	decompressing_reader(decompressing_reader const&) = delete;
+	decompressing_reader& operator=(decompressing_reader const&) = delete;
+
+	/// Return the next decompressed buffer, waiting for it if needed, or an
+	/// empty string at the end of the input or after an error. The buffer is
+	/// only handed back to the helper thread on the next call to \a next.
+	string_cview next();
+
+	/// Return a description of why the input could not be decompressed, or
+	/// an empty string if it could.
+	std::string error();
+
+private:
+	void run();
+
+	bool fill_input(z_stream& stream);
+
+	bool acquire();
+
+	bool publish(std::size_t slot, std::size_t size);
+
+	void fail(char const* message);
+};
+
+/// Parse everything read by \a reader with \a parser, which keeps its state
+/// from one buffer to the next, and then finish. This returns false if
+/// the parsing was aborted or the input could not be decompressed, and true
+/// as soon as a callback method stops the parsing.
+template <typename Parser, typename Callback>
+bool parse(Parser& parser, Callback& cb, decompressing_reader& reader) {
+	return detail::parse_buffers(parser, cb, reader);
+}
+
+inline
+decompressing_reader::decompressing_reader(std::istream& in, std::size_t buffer_size, std::size_t buffers)
+: m_in(&in)
+, m_buffers(buffers, std::vector<char>(buffer_size))
+, m_sizes(buffers)
+, m_input(std::max<std::size_t>(buffer_size, 4))
+, m_read(0)
+, m_ready(0)
+, m_free(buffers)
+, m_holding(false)
+, m_done(false)
+, m_cancel(false) {
+	assert(buffers >= 2);
+	assert(buffer_size);
+	m_thread = std::thread(&decompressing_reader::run, this);
+}
+
+inline
+decompressing_reader::~decompressing_reader() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cancel = true;
+	}
+
+	m_emptied.notify_one();
+	m_thread.join();
+}
+
+inline
+string_cview decompressing_reader::next() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if(m_holding) {
+		m_holding = false;
+		m_read = (m_read + 1) % m_buffers.size();
+		++m_free;
+		m_emptied.notify_one();
+	}
+
+	m_filled.wait(lock, [this] { return m_ready || m_done; });
+	if(!m_ready) {
+		return string_cview();
+	}
+
+	--m_ready;
+	m_holding = true;
+	return string_cview(m_buffers[m_read].data(), m_sizes[m_read]);
+}
+
+inline
+std::string decompressing_reader::error() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_error;
+}
+
+inline
+void decompressing_reader::run() {
+	z_stream stream = z_stream();
+	fill_input(stream);
+
+	// Only look for magic numbers, as a zlib header could just as well be
+	// the first two characters of some text
+	unsigned char const* head = stream.next_in;
+	bool const compressed = stream.avail_in >= 2 && head[0] == 0x1F && head[1] == 0x8B;
+	if(stream.avail_in >= 4 && head[0] == 0x28 && head[1] == 0xB5 && head[2] == 0x2F && head[3] == 0xFD) {
+		fail("zstd is not supported");
+		return;
+	} else if(stream.avail_in >= 4 && head[0] == 0x04 && head[1] == 0x22 && head[2] == 0x4D && head[3] == 0x18) {
+		fail("lz4 is not supported");
+		return;
+	} else if(compressed && inflateInit2(&stream, 15 + 16) != Z_OK) {
+		fail("could not initialise zlib");
+		return;
+	}
+
+	// The input may only end straight after a complete gzip member
+	bool member_ended = false;
+	std::size_t slot = 0;
+	while(acquire()) {
+		std::vector<char>& buffer = m_buffers[slot];
+		std::size_t size = 0;
+		bool end = false;
+		if(!compressed) {
+			// Pass the input through as it is, topping up the buffer from the
+			// stream after the bytes already read
+			std::size_t const first = std::min<std::size_t>(stream.avail_in, buffer.size());
+			std::copy(stream.next_in, stream.next_in + first, buffer.begin());
+			stream.next_in += first;
+			stream.avail_in -= static_cast<uInt>(first);
+			m_in->read(buffer.data() + first, buffer.size() - first);
+			size = first + static_cast<std::size_t>(m_in->gcount());
+			end = size < buffer.size();
+		} else {
+			stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+			stream.avail_out = static_cast<uInt>(buffer.size());
+			while(stream.avail_out) {
+				if(!stream.avail_in && !fill_input(stream)) {
+					end = true;
+					break;
+				}
+
+				int const result = inflate(&stream, Z_NO_FLUSH);
+				if(result == Z_STREAM_END) {
+					// Another gzip member may follow this one
+					member_ended = true;
+					if(!stream.avail_in && !fill_input(stream)) {
+						end = true;
+						break;
+					}
+
+					inflateReset(&stream);
+					member_ended = false;
+				} else if(result != Z_OK && result != Z_BUF_ERROR) {
+					fail(stream.msg ? stream.msg : "corrupt compressed data");
+					inflateEnd(&stream);
+					return;
+				}
+			}
+
+			size = buffer.size() - stream.avail_out;
+		}
+
+		if(!publish(slot, size)) {
+			break;
+		} else if(end) {
+			// Everything decompressed so far has been handed over before
+			// reporting that the rest of it is missing
+			if(compressed && !member_ended) {
+				fail("unexpected end of compressed stream");
+			}
+
+			break;
+		}
+
+		slot = (slot + 1) % m_buffers.size();
+	}
+
+	if(compressed) {
+		inflateEnd(&stream);
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_done = true;
+	m_filled.notify_one();
+}
+
+inline
+bool decompressing_reader::fill_input(z_stream& stream) {
+	m_in->read(m_input.data(), m_input.size());
+	stream.next_in = reinterpret_cast<Bytef*>(m_input.data());
+	stream.avail_in = static_cast<uInt>(m_in->gcount());
+	if(!stream.avail_in && m_in->bad()) {
+		fail("could not read the input");
+	}
+
+	return stream.avail_in;
+}
+
+inline
+bool decompressing_reader::acquire() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_emptied.wait(lock, [this] { return m_free || m_cancel; });
+	if(m_cancel) {
+		return false;
+	}
+
+	--m_free;
+	return true;
+}
+
+inline
+bool decompressing_reader::publish(std::size_t slot, std::size_t size) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(!size) {
+		++m_free;
+		return !m_cancel;
+	}
+
+	m_sizes[slot] = size;
+	++m_ready;
+	m_filled.notify_one();
+	return !m_cancel;
+}
+
+inline
+void decompressing_reader::fail(char const* message) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(m_error.empty()) {
+		m_error = message;
+	}
+
+	m_done = true;
+	m_filled.notify_one();
+}
+
+}
+
+#endif
+
+#endif
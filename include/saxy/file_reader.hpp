@@ -0,0 +1,470 @@
+/*************************************************************************//**
+ * \file   file_reader.hpp
+ * \author Elliot Goodrich
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#ifndef INCLUDE_GUARD_D6854912_CA96_4C8F_AFE9_DC1F4F8C086F
+#define INCLUDE_GUARD_D6854912_CA96_4C8F_AFE9_DC1F4F8C086F
+
+#include "common.hpp"
+#include "string_view.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined __linux__ && !defined SAXY_NO_IO_URING
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <sys/uio.h>
+  #include <linux/io_uring.h>
+  #ifdef __NR_io_uring_setup
+    #define SAXY_IO_URING 1
+  #endif
+#endif
+
+namespace saxy {
+
+/// A class that reads a file into a ring of aligned buffers, keeping a read
+/// in flight for every buffer that the caller is not using so that the disk
+/// and the parser are busy at the same time. On Linux the reads go through
+/// io_uring with the buffers registered up front, so their pages are not
+/// pinned again for every read. Where io_uring is not available, or
+/// \a asynchronous is false, each buffer is filled with pread when it is
+/// needed.
+class file_reader {
+	int m_fd;
+	std::size_t m_file_size;
+	std::size_t m_buffer_size;
+	std::vector<char*> m_buffers;
+	std::vector<std::size_t> m_offsets;
+	std::vector<long> m_results;
+	std::size_t m_next_offset;
+	std::size_t m_current;
+	bool m_holding;
+	std::string m_error;
+
+#ifdef SAXY_IO_URING
+	int m_ring;
+	bool m_registered;
+	std::vector<iovec> m_iovecs;
+	void* m_sq_map;
+	std::size_t m_sq_map_size;
+	void* m_cq_map;
+	std::size_t m_cq_map_size;
+	io_uring_sqe* m_sqes;
+	std::size_t m_sqes_size;
+	unsigned* m_sq_tail;
+	unsigned* m_sq_mask;
+	unsigned* m_sq_array;
+	unsigned* m_cq_head;
+	unsigned* m_cq_tail;
+	unsigned* m_cq_mask;
+	io_uring_cqe* m_cqes;
+	std::size_t m_in_flight;
+#endif
+
+	enum {
+		alignment = 4096,
+		pending = LONG_MIN,
+		unused = LONG_MIN + 1,
+	};
+
+public:
+	/// Open the file \a path and start reading it into \a buffers buffers of
+	/// \a buffer_size bytes each. Any failure is reported by \a error.
+	///
+	/// @pre: \a buffers and \a buffer_size are not 0.
+	explicit file_reader(char const* path, std::size_t buffer_size = 1 << 20, std::size_t buffers = 4, bool asynchronous = true);
+
+	/// Wait for the reads in flight and release everything.
+	~file_reader();
+
+	file_reader(file_reader const&) = delete;
+	file_reader& operator=(file_reader const&) = delete;
+
+	/// Return the next part of the file, waiting for it if needed, or an
+	/// empty string at the end of the file or after an error. The buffer is
+	/// read into again after the next call to \a next.
+	string_cview next();
+
+	/// Return a description of why the file could not be read, or an empty
+	/// string if it could.
+	std::string const& error() const;
+
+	/// Return whether the reads are made with io_uring.
+	bool asynchronous() const;
+
+private:
+	void submit(std::size_t slot);
+
+	void wait(std::size_t slot);
+
+	void fail(char const* what, int error);
+
+#ifdef SAXY_IO_URING
+	bool setup_ring();
+
+	void close_ring();
+
+	bool reap(unsigned min_complete);
+#endif
+};
+
+/// Parse the whole file read by \a reader with \a parser, which keeps its
+/// state from one buffer to the next, and then finish. This returns false if
+/// the parsing was aborted or the file could not be read, and true as soon
+/// as a callback method stops the parsing.
+template <typename Parser, typename Callback>
+bool parse(Parser& parser, Callback& cb, file_reader& reader) {
+	return detail::parse_buffers(parser, cb, reader);
+}
+
+inline
+file_reader::file_reader(char const* path, std::size_t buffer_size, std::size_t buffers, bool asynchronous)
+: m_fd(-1)
+, m_file_size(0)
+, m_buffer_size(buffer_size)
+, m_buffers(buffers)
+, m_offsets(buffers)
+, m_results(buffers, static_cast<long>(unused))
+, m_next_offset(0)
+, m_current(0)
+, m_holding(false)
+#ifdef SAXY_IO_URING
+, m_ring(-1)
+, m_registered(false)
+, m_in_flight(0)
+#endif
+{
+	assert(buffers);
+	assert(buffer_size);
+	for(std::size_t i = 0; i < buffers; ++i) {
+		// Round up to whole pages so the buffers can be used for direct I/O
+		void* buffer = 0;
+		if(posix_memalign(&buffer, alignment, (buffer_size + alignment - 1) / alignment * alignment)) {
+			fail("could not allocate buffers", ENOMEM);
+			return;
+		}
+
+		m_buffers[i] = static_cast<char*>(buffer);
+	}
+
+	m_fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if(m_fd < 0 || fstat(m_fd, &info)) {
+		fail("could not open the file", errno);
+		return;
+	}
+
+	m_file_size = static_cast<std::size_t>(info.st_size);
+#ifdef SAXY_IO_URING
+	if(asynchronous && !setup_ring()) {
+		close_ring();
+	}
+#else
+	(void)asynchronous;
+#endif
+
+	for(std::size_t i = 0; i < buffers; ++i) {
+		submit(i);
+	}
+}
+
+inline
+file_reader::~file_reader() {
+#ifdef SAXY_IO_URING
+	// The kernel may still be writing into the buffers
+	while(m_in_flight && reap(1)) {
+	}
+
+	close_ring();
+#endif
+
+	if(m_fd >= 0) {
+		close(m_fd);
+	}
+
+	for(std::size_t i = 0; i < m_buffers.size(); ++i) {
+		free(m_buffers[i]);
+	}
+}
+
+inline
+string_cview file_reader::next() {
+	if(!m_error.empty()) {
+		return string_cview();
+	}
+
+	if(m_holding) {
+		m_holding = false;
+		submit(m_current);
+		m_current = (m_current + 1) % m_buffers.size();
+	}
+
+	if(m_results[m_current] == unused) {
+		return string_cview();
+	}
+
+	wait(m_current);
+	long const result = m_results[m_current];
+	if(result <= 0) {
+		if(m_error.empty()) {
+			fail("could not read the file", result ? static_cast<int>(-result) : EIO);
+		}
+
+		return string_cview();
+	}
+
+	m_holding = true;
+	return string_cview(m_buffers[m_current], static_cast<std::size_t>(result));
+}
+
+inline
+std::string const& file_reader::error() const {
+	return m_error;
+}
+
+inline
+bool file_reader::asynchronous() const {
+#ifdef SAXY_IO_URING
+	return m_ring >= 0;
+#else
+	return false;
+#endif
+}
+
+inline
+void file_reader::submit(std::size_t slot) {
+	if(m_next_offset >= m_file_size || !m_error.empty()) {
+		m_results[slot] = unused;
+		return;
+	}
+
+	m_offsets[slot] = m_next_offset;
+	m_results[slot] = pending;
+	m_next_offset += std::min(m_buffer_size, m_file_size - m_next_offset);
+
+#ifdef SAXY_IO_URING
+	if(m_ring < 0) {
+		return;
+	}
+
+	unsigned const tail = *m_sq_tail;
+	unsigned const index = tail & *m_sq_mask;
+	io_uring_sqe& sqe = m_sqes[index];
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = m_registered ? IORING_OP_READ_FIXED : IORING_OP_READV;
+	sqe.fd = m_fd;
+	sqe.off = m_offsets[slot];
+	if(m_registered) {
+		sqe.addr = reinterpret_cast<unsigned long>(m_buffers[slot]);
+		sqe.len = static_cast<unsigned>(std::min(m_buffer_size, m_file_size - m_offsets[slot]));
+		sqe.buf_index = static_cast<unsigned short>(slot);
+	} else {
+		m_iovecs[slot].iov_len = std::min(m_buffer_size, m_file_size - m_offsets[slot]);
+		sqe.addr = reinterpret_cast<unsigned long>(&m_iovecs[slot]);
+		sqe.len = 1;
+	}
+
+	sqe.user_data = slot;
+	m_sq_array[index] = index;
+	__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if(syscall(__NR_io_uring_enter, m_ring, 1, 0, 0, 0, 0) < 0) {
+		fail("could not submit a read", errno);
+		return;
+	}
+
+	++m_in_flight;
+#endif
+}
+
+inline
+void file_reader::wait(std::size_t slot) {
+#ifdef SAXY_IO_URING
+	while(m_ring >= 0 && m_results[slot] == pending) {
+		if(!reap(1)) {
+			return;
+		}
+	}
+#endif
+
+	long const result = m_results[slot];
+	if(result < 0 && result != pending) {
+		return;
+	}
+
+	// Read synchronously, and finish off short reads, until the buffer is
+	// full or the file ends
+	std::size_t const wanted = std::min(m_buffer_size, m_file_size - m_offsets[slot]);
+	std::size_t done = result == pending ? 0 : static_cast<std::size_t>(result);
+	while(done < wanted) {
+		ssize_t const read = pread(m_fd, m_buffers[slot] + done, wanted - done, static_cast<off_t>(m_offsets[slot] + done));
+		if(read < 0 && errno == EINTR) {
+			continue;
+		} else if(read < 0) {
+			m_results[slot] = -errno;
+			return;
+		} else if(!read) {
+			break;
+		}
+
+		done += static_cast<std::size_t>(read);
+	}
+
+	m_results[slot] = static_cast<long>(done);
+}
+
+inline
+void file_reader::fail(char const* what, int error) {
+	m_error = what;
+	m_error += ": ";
+	m_error += std::strerror(error);
+}
+
+#ifdef SAXY_IO_URING
+inline
+bool file_reader::setup_ring() {
+	m_sq_map = MAP_FAILED;
+	m_cq_map = MAP_FAILED;
+	m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	m_ring = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(m_buffers.size()), &params));
+	if(m_ring < 0) {
+		return false;
+	}
+
+	// Map the submission and completion rings, which newer kernels let us
+	// map together
+	m_sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool const single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single) {
+		m_sq_map_size = m_cq_map_size = std::max(m_sq_map_size, m_cq_map_size);
+	}
+
+	m_sq_map = mmap(0, m_sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQ_RING);
+	if(m_sq_map == MAP_FAILED) {
+		return false;
+	}
+
+	if(single) {
+		m_cq_map = m_sq_map;
+	} else {
+		m_cq_map = mmap(0, m_cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_CQ_RING);
+		if(m_cq_map == MAP_FAILED) {
+			return false;
+		}
+	}
+
+	m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe*>(mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring, IORING_OFF_SQES));
+	if(m_sqes == MAP_FAILED) {
+		return false;
+	}
+
+	char* const sq = static_cast<char*>(m_sq_map);
+	char* const cq = static_cast<char*>(m_cq_map);
+	m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	m_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	m_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	// Registering the buffers pins their pages once instead of on every
+	// read, but it counts against the locked memory limit so it may fail
+	m_iovecs.resize(m_buffers.size());
+	for(std::size_t i = 0; i < m_buffers.size(); ++i) {
+		m_iovecs[i].iov_base = m_buffers[i];
+		m_iovecs[i].iov_len = m_buffer_size;
+	}
+
+	m_registered = !syscall(__NR_io_uring_register, m_ring, IORING_REGISTER_BUFFERS, m_iovecs.data(), static_cast<unsigned>(m_iovecs.size()));
+	return true;
+}
+
+inline
+void file_reader::close_ring() {
+	if(m_ring < 0) {
+		return;
+	}
+
+	if(m_sqes != MAP_FAILED) {
+		munmap(m_sqes, m_sqes_size);
+	}
+
+	if(m_cq_map != MAP_FAILED && m_cq_map != m_sq_map) {
+		munmap(m_cq_map, m_cq_map_size);
+	}
+
+	if(m_sq_map != MAP_FAILED) {
+		munmap(m_sq_map, m_sq_map_size);
+	}
+
+	close(m_ring);
+	m_ring = -1;
+	m_in_flight = 0;
+}
+
+inline
+bool file_reader::reap(unsigned min_complete) {
+	unsigned head = *m_cq_head;
+	while(head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+		if(syscall(__NR_io_uring_enter, m_ring, 0, min_complete, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR) {
+			fail("could not wait for a read", errno);
+			return false;
+		}
+	}
+
+	for(; head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE); ++head) {
+		io_uring_cqe const& cqe = m_cqes[head & *m_cq_mask];
+		m_results[cqe.user_data] = cqe.res;
+		--m_in_flight;
+	}
+
+	__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+	return true;
+}
+#endif
+
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*************************************************************************//**
+ * \file   numa_scheduler.hpp
+ * \author Elliot Goodrich
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#ifndef INCLUDE_GUARD_D6484E6C_68CE_40E9_80FC_95F5A658F0E3
+#define INCLUDE_GUARD_D6484E6C_68CE_40E9_80FC_95F5A658F0E3
+
+#include "csv.hpp"
+
+#ifdef SAXY_CPP11
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+  #include <pthread.h>
+  #include <sched.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+  #include <linux/mempolicy.h>
+#endif
+
+namespace saxy {
+
+/// A class describing the NUMA nodes of a machine and the CPUs on each one.
+class numa_topology {
+	std::vector<std::vector<int> > m_cpus;
+	std::vector<int> m_ids;
+	bool m_simulated;
+
+	numa_topology();
+
+public:
+	/// Return the topology of this machine, or a single node with every CPU
+	/// if it cannot be found out.
+	static numa_topology detect();
+
+	/// Return a topology of \a nodes nodes with \a cpus_per_node CPUs each
+	/// that is only used to decide which node parses what. Threads are not
+	/// pinned and pages are not moved for a simulated topology, so that it
+	/// can be tested on any machine.
+	static numa_topology simulated(std::size_t nodes, std::size_t cpus_per_node);
+
+	/// Return the number of nodes with CPUs.
+	std::size_t nodes() const;
+
+	/// Return the CPUs on the \a node'th node.
+	std::vector<int> const& cpus(std::size_t node) const;
+
+	/// Return the operating system's number for the \a node'th node.
+	int id(std::size_t node) const;
+
+	/// Return whether this topology was created by \a simulated.
+	bool is_simulated() const;
+
+private:
+	static std::vector<int> parse_list(std::string const& path);
+};
+
+/// A class that parses a buffer of CSV in place in parallel. The buffer is
+/// split into one part per worker at record boundaries, and each worker is
+/// pinned to the CPUs of its node and moves the pages of its part to that
+/// node before parsing it, so no worker reads memory on another socket.
+class numa_scheduler {
+public:
+	/// A part of the input and who parses it.
+	struct chunk {
+		std::size_t offset; ///< Offset of the first character
+		std::size_t length; ///< Number of characters
+		std::size_t worker; ///< Index of the worker
+		std::size_t node;   ///< Index of the worker's node
+	};
+
+private:
+	numa_topology m_topology;
+	std::vector<std::size_t> m_worker_nodes;
+
+public:
+	/// Create a scheduler with \a workers_per_node workers on each node of
+	/// \a topology, or one for each CPU if \a workers_per_node is 0.
+	explicit numa_scheduler(numa_topology const& topology = numa_topology::detect(), std::size_t workers_per_node = 0);
+
+	/// Return the number of workers.
+	std::size_t workers() const;
+
+	/// Return how the \a length characters starting at \a data are divided
+	/// between the workers, with at most one chunk per worker. If there are
+	/// fewer chunks than workers, they are spread evenly over the workers,
+	/// and so over the nodes.
+	std::vector<chunk> plan(char const* data, std::size_t length) const;
+
+	/// Parse the \a length characters starting at \a data in place with one
+	/// thread per chunk of \a plan. Each thread default constructs a
+	/// 'Callback' after being pinned, so that anything it allocates is on
+	/// its own node, and then moves it to \a results, which holds one
+	/// callback per chunk in order. This returns true if every chunk was
+	/// parsed, and rethrows the first exception a worker threw.
+	template <typename Callback>
+	bool parse(char* data, std::size_t length, std::vector<Callback>& results) const;
+
+private:
+	void pin(std::size_t node) const;
+
+	void bind(char* data, std::size_t length, std::size_t node) const;
+};
+
+//-----------------------------------------------------------------------------
+// numa_topology
+//-----------------------------------------------------------------------------
+inline
+numa_topology::numa_topology()
+: m_simulated(false) {
+}
+
+inline
+numa_topology numa_topology::detect() {
+	numa_topology topology;
+#ifdef __linux__
+	std::vector<int> const online = parse_list("/sys/devices/system/node/online");
+	for(std::size_t i = 0; i < online.size(); ++i) {
+		std::ostringstream path;
+		path << "/sys/devices/system/node/node" << online[i] << "/cpulist";
+		std::vector<int> cpus = parse_list(path.str());
+		if(!cpus.empty()) {
+			topology.m_cpus.push_back(std::move(cpus));
+			topology.m_ids.push_back(online[i]);
+		}
+	}
+#endif
+
+	if(topology.m_cpus.empty()) {
+		unsigned const count = std::max(std::thread::hardware_concurrency(), 1u);
+		topology.m_cpus.resize(1);
+		for(unsigned i = 0; i < count; ++i) {
+			topology.m_cpus[0].push_back(static_cast<int>(i));
+		}
+
+		topology.m_ids.push_back(0);
+	}
+
+	return topology;
+}
+
+inline
+numa_topology numa_topology::simulated(std::size_t nodes, std::size_t cpus_per_node) {
+	numa_topology topology;
+	topology.m_simulated = true;
+	topology.m_cpus.resize(nodes);
+	for(std::size_t i = 0; i < nodes; ++i) {
+		for(std::size_t j = 0; j < cpus_per_node; ++j) {
+			topology.m_cpus[i].push_back(static_cast<int>(i * cpus_per_node + j));
+		}
+
+		topology.m_ids.push_back(static_cast<int>(i));
+	}
+
+	return topology;
+}
+
+inline
+std::size_t numa_topology::nodes() const {
+	return m_cpus.size();
+}
+
+inline
+std::vector<int> const& numa_topology::cpus(std::size_t node) const {
+	return m_cpus[node];
+}
+
+inline
+int numa_topology::id(std::size_t node) const {
+	return m_ids[node];
+}
+
+inline
+bool numa_topology::is_simulated() const {
+	return m_simulated;
+}
+
+inline
+std::vector<int> numa_topology::parse_list(std::string const& path) {
+	// Lists look like "0-3,8-11"
+	std::vector<int> result;
+	std::ifstream in(path.c_str());
+	int first = 0;
+	while(in >> first) {
+		int last = first;
+		if(in.peek() == '-') {
+			in.get();
+			in >> last;
+		}
+
+		for(int i = first; i <= last; ++i) {
+			result.push_back(i);
+		}
+
+		if(in.peek() == ',') {
+			in.get();
+		}
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+// numa_scheduler
+//-----------------------------------------------------------------------------
+inline
+numa_scheduler::numa_scheduler(numa_topology const& topology, std::size_t workers_per_node)
+: m_topology(topology) {
+	for(std::size_t node = 0; node < m_topology.nodes(); ++node) {
+		std::size_t const count = workers_per_node ? workers_per_node : m_topology.cpus(node).size();
+		m_worker_nodes.insert(m_worker_nodes.end(), count, node);
+	}
+}
+
+inline
+std::size_t numa_scheduler::workers() const {
+	return m_worker_nodes.size();
+}
+
+inline
+std::vector<numa_scheduler::chunk> numa_scheduler::plan(char const* data, std::size_t length) const {
+	std::vector<std::size_t> const offsets = csv::split_records(data, length, workers());
+	std::vector<chunk> chunks(offsets.size());
+	for(std::size_t i = 0; i < offsets.size(); ++i) {
+		chunks[i].offset = offsets[i];
+		chunks[i].length = (i + 1 < offsets.size() ? offsets[i + 1] : length) - offsets[i];
+		chunks[i].worker = i * workers() / offsets.size();
+		chunks[i].node = m_worker_nodes[chunks[i].worker];
+	}
+
+	return chunks;
+}
+
+template <typename Callback>
+bool numa_scheduler::parse(char* data, std::size_t length, std::vector<Callback>& results) const {
+	std::vector<chunk> const chunks = plan(data, length);
+	results.clear();
+	results.resize(chunks.size());
+	std::vector<char> parsed(chunks.size());
+	std::vector<std::exception_ptr> errors(chunks.size());
+
+	std::vector<std::thread> threads;
+	threads.reserve(chunks.size());
+	for(std::size_t i = 0; i < chunks.size(); ++i) {
+		threads.push_back(std::thread([&, i] {
+			try {
+				chunk const& c = chunks[i];
+				pin(c.node);
+				bind(data + c.offset, c.length, c.node);
+				Callback cb;
+				parsed[i] = csv::parse(cb, data + c.offset, c.length);
+				results[i] = std::move(cb);
+			} catch(...) {
+				errors[i] = std::current_exception();
+			}
+		}));
+	}
+
+	for(std::size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+
+	for(std::size_t i = 0; i < errors.size(); ++i) {
+		if(errors[i]) {
+			std::rethrow_exception(errors[i]);
+		}
+	}
+
+	return std::find(parsed.begin(), parsed.end(), 0) == parsed.end();
+}
+
+inline
+void numa_scheduler::pin(std::size_t node) const {
+#ifdef __linux__
+	if(m_topology.is_simulated()) {
+		return;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	std::vector<int> const& cpus = m_topology.cpus(node);
+	for(std::size_t i = 0; i < cpus.size(); ++i) {
+		CPU_SET(cpus[i], &set);
+	}
+
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)node;
+#endif
+}
+
+inline
+void numa_scheduler::bind(char* data, std::size_t length, std::size_t node) const {
+#ifdef __linux__
+	if(m_topology.is_simulated() || m_topology.nodes() < 2) {
+		return;
+	}
+
+	// Only whole pages can be moved, and a page shared with the next chunk
+	// stays where it is
+	std::size_t const page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	std::size_t const first = (reinterpret_cast<std::size_t>(data) + page - 1) / page * page;
+	std::size_t const last = (reinterpret_cast<std::size_t>(data) + length) / page * page;
+	if(first >= last) {
+		return;
+	}
+
+	std::size_t const bits = sizeof(unsigned long) * 8;
+	std::size_t const id = static_cast<std::size_t>(m_topology.id(node));
+	std::vector<unsigned long> mask(id / bits + 1);
+	mask[id / bits] = 1ul << (id % bits);
+	syscall(__NR_mbind, first, last - first, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1, MPOL_MF_MOVE);
+#else
+	(void)data;
+	(void)length;
+	(void)node;
+#endif
+}
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+/*************************************************************************//**
+ * \file   padded_buffer.hpp
+ * \author Elliot Goodrich
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#ifndef INCLUDE_GUARD_A184EA86_28A2_47B9_89B3_00379608D3ED
+#define INCLUDE_GUARD_A184EA86_28A2_47B9_89B3_00379608D3ED
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace saxy {
+
+/// A class holding a string followed by at least \a padding readable bytes.
+/// Parsing a padded_buffer lets the SIMD loops always load full blocks and
+/// ignore the bytes past the end, instead of finishing short fields and
+/// records one byte at a time.
+class padded_buffer {
+	std::vector<char> m_data;
+	std::size_t m_size;
+
+public:
+	/// The number of bytes after the end of the string that can be read.
+	static std::size_t const padding = 64;
+
+	/// Create an empty padded_buffer.
+	padded_buffer();
+
+	/// Create a padded_buffer holding \a size zero bytes.
+	explicit padded_buffer(std::size_t size);
+
+	/// Create a padded_buffer holding a copy of the \a size bytes starting at
+	/// \a data.
+	padded_buffer(char const* data, std::size_t size);
+
+	/// Replace the contents with a copy of the \a size bytes starting at
+	/// \a data.
+	void assign(char const* data, std::size_t size);
+
+	/// Change the size of the string to \a size, keeping the first bytes.
+	void resize(std::size_t size);
+
+	char* data() {
+		return m_data.data();
+	}
+
+	char const* data() const {
+		return m_data.data();
+	}
+
+	std::size_t size() const {
+		return m_size;
+	}
+
+	bool empty() const {
+		return m_size == 0;
+	}
+};
+
+namespace detail {
+
+/// The end of a padded_buffer, which tells the parser that it can read past
+/// it.
+struct padded_end {
+	char const* m_end;
+
+	explicit padded_end(char const* end)
+	: m_end(end) {
+	}
+};
+
+inline
+bool operator==(padded_end end, char const* it) {
+	return it == end.m_end;
+}
+
+inline
+bool operator==(char const* it, padded_end end) {
+	return it == end.m_end;
+}
+
+inline
+bool operator!=(padded_end end, char const* it) {
+	return it != end.m_end;
+}
+
+inline
+bool operator!=(char const* it, padded_end end) {
+	return it != end.m_end;
+}
+
+inline
+std::ptrdiff_t operator-(padded_end end, char const* it) {
+	return end.m_end - it;
+}
+
+struct padded_simd {};
+
+template <>
+struct use_simd<char*, padded_end> {
+#ifdef SAXY_SSE2
+	typedef padded_simd type;
+#else
+	typedef simd type;
+#endif
+};
+
+template <>
+struct use_simd<char const*, padded_end> {
+#ifdef SAXY_SSE2
+	typedef padded_simd type;
+#else
+	typedef simd type;
+#endif
+};
+
+}
+
+//-----------------------------------------------------------------------------
+// padded_buffer
+//-----------------------------------------------------------------------------
+inline
+padded_buffer::padded_buffer()
+: m_data(padding)
+, m_size(0) {
+}
+
+inline
+padded_buffer::padded_buffer(std::size_t size)
+: m_data(size + padding)
+, m_size(size) {
+}
+
+inline
+padded_buffer::padded_buffer(char const* data, std::size_t size)
+: m_data(size + padding)
+, m_size(size) {
+	std::copy(data, data + size, m_data.begin());
+}
+
+inline
+void padded_buffer::assign(char const* data, std::size_t size) {
+	m_data.assign(data, data + size);
+	m_data.resize(size + padding);
+	m_size = size;
+}
+
+inline
+void padded_buffer::resize(std::size_t size) {
+	m_data.resize(size + padding);
+	std::fill(m_data.begin() + std::min(size, m_size), m_data.end(), '\0');
+	m_size = size;
+}
+
+}
+
+#endif
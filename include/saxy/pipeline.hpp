@@ -0,0 +1,1129 @@
+/*************************************************************************//**
+ * \file   pipeline.hpp
+ * \author Elliot Goodrich
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#ifndef INCLUDE_GUARD_A4BB1997_1F07_4555_868F_9BE4B621D9C3
+#define INCLUDE_GUARD_A4BB1997_1F07_4555_868F_9BE4B621D9C3
+
+#include "csv.hpp"
+
+#ifdef SAXY_CPP11
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace saxy {
+
+//=============================================================================
+// mpmc_queue
+//=============================================================================
+/// A bounded lock-free queue that any number of threads can push to and pop
+/// from at the same time. Each slot has a sequence number that says whether
+/// it is ready to be written or read for the current lap of the ring.
+template <typename T>
+class mpmc_queue {
+	struct slot {
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<slot[]> m_slots;
+	std::size_t m_mask;
+	std::atomic<std::size_t> m_push;
+	char m_padding[64 - sizeof(std::atomic<std::size_t>)]; // keep the ends on separate cache lines
+	std::atomic<std::size_t> m_pop;
+
+public:
+	/// Create a queue that holds at least \a capacity values.
+	explicit mpmc_queue(std::size_t capacity);
+
+	mpmc_queue(mpmc_queue const&) = delete;
+	mpmc_queue& operator=(mpmc_queue const&) = delete;
+
+	/// Move \a value to the back of the queue and return true, or return
+	/// false if the queue is full.
+	bool try_push(T& value);
+
+	/// Move the value at the front of the queue to \a value and return true,
+	/// or return false if the queue is empty.
+	bool try_pop(T& value);
+};
+
+//=============================================================================
+// spsc_queue
+//=============================================================================
+/// A bounded lock-free queue for exactly one thread pushing and one thread
+/// popping, which needs no compare and swap.
+template <typename T>
+class spsc_queue {
+	std::unique_ptr<T[]> m_values;
+	std::size_t m_mask;
+	std::atomic<std::size_t> m_push;
+	char m_padding[64 - sizeof(std::atomic<std::size_t>)]; // keep the ends on separate cache lines
+	std::atomic<std::size_t> m_pop;
+
+public:
+	/// Create a queue that holds at least \a capacity values.
+	explicit spsc_queue(std::size_t capacity);
+
+	spsc_queue(spsc_queue const&) = delete;
+	spsc_queue& operator=(spsc_queue const&) = delete;
+
+	/// Move \a value to the back of the queue and return true, or return
+	/// false if the queue is full.
+	bool try_push(T& value);
+
+	/// Move the value at the front of the queue to \a value and return true,
+	/// or return false if the queue is empty.
+	bool try_pop(T& value);
+};
+
+//=============================================================================
+// event_count
+//=============================================================================
+namespace detail {
+
+/// A class that lets threads sleep until another thread says something has
+/// changed. A waiter takes a ticket with 'prepare', looks for work and then
+/// passes the ticket to 'wait', which returns at once if 'notify' was
+/// called after the ticket was taken, so no notification is missed.
+class event_count {
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	std::atomic<std::size_t> m_epoch;
+
+public:
+	event_count();
+
+	event_count(event_count const&) = delete;
+	event_count& operator=(event_count const&) = delete;
+
+	/// Return a ticket for 'wait'.
+	std::size_t prepare() const;
+
+	/// Spin for a short while and then block until 'notify' has been called
+	/// since \a ticket was taken.
+	void wait(std::size_t ticket);
+
+	/// Wake every thread waiting.
+	void notify();
+};
+
+}
+
+//=============================================================================
+// chunk_pool
+//=============================================================================
+class chunk_pool;
+
+namespace detail {
+
+struct chunk {
+	std::vector<char> data;
+	std::atomic<std::size_t> references;
+	chunk_pool* pool;
+};
+
+}
+
+/// A reference counted handle to a chunk of memory from a \a chunk_pool.
+/// The chunk goes back to the pool when the last handle to it is destroyed,
+/// which may happen on any thread.
+class chunk_handle {
+	detail::chunk* m_chunk;
+
+	explicit chunk_handle(detail::chunk* c);
+
+	friend class chunk_pool;
+
+public:
+	/// Create a handle to no chunk.
+	chunk_handle();
+
+	chunk_handle(chunk_handle const& rhs);
+
+	chunk_handle(chunk_handle&& rhs);
+
+	chunk_handle& operator=(chunk_handle rhs);
+
+	~chunk_handle();
+
+	/// Return the start of the chunk.
+	char* data() const;
+
+	/// Return the size of the chunk.
+	std::size_t capacity() const;
+
+	/// Double the size of the chunk, which moves it.
+	///
+	/// @pre: This is the only handle to the chunk.
+	void grow();
+
+	/// Return the number of handles to the chunk.
+	std::size_t use_count() const;
+
+	/// Return whether this is a handle to a chunk.
+	explicit operator bool() const;
+};
+
+/// A class that owns a fixed number of chunks of memory for a reader to read
+/// into and a free list of the ones that nobody is using.
+class chunk_pool {
+	std::vector<std::unique_ptr<detail::chunk> > m_chunks;
+	mpmc_queue<detail::chunk*> m_free;
+	detail::event_count m_released;
+
+	friend class chunk_handle;
+
+public:
+	/// Create \a chunks chunks of \a chunk_size bytes each.
+	chunk_pool(std::size_t chunks, std::size_t chunk_size);
+
+	chunk_pool(chunk_pool const&) = delete;
+	chunk_pool& operator=(chunk_pool const&) = delete;
+
+	/// Return the number of chunks.
+	std::size_t chunks() const;
+
+	/// Take a free chunk and return true, or return false if there is none.
+	bool try_acquire(chunk_handle& handle);
+
+	/// Take a free chunk, waiting for one to be released if needed.
+	chunk_handle acquire();
+
+private:
+	void release(detail::chunk* c);
+};
+
+//=============================================================================
+// view_batch
+//=============================================================================
+/// A class holding the fields of consecutive records as views into a chunk,
+/// which is kept alive for as long as the batch is.
+class view_batch {
+	chunk_handle m_chunk;
+	std::vector<string_cview> m_fields;
+	std::vector<std::size_t> m_row_ends;
+	std::size_t m_first_row;
+
+public:
+	view_batch();
+
+	/// Create an empty batch of records in \a chunk starting with the
+	/// \a first_row'th record of the document.
+	view_batch(chunk_handle const& chunk, std::size_t first_row);
+
+	/// Return the index in the document of the first record.
+	std::size_t first_row() const;
+
+	/// Return the number of records.
+	std::size_t rows() const;
+
+	/// Return the number of fields in the \a row'th record.
+	std::size_t fields(std::size_t row) const;
+
+	/// Return the \a column'th field of the \a row'th record.
+	string_cview field(std::size_t row, std::size_t column) const;
+
+	/// Return the chunk that the fields point into.
+	chunk_handle const& chunk() const;
+
+	/// Add a record with the \a count fields starting at \a fields.
+	void add_row(string_view const* fields, std::size_t count);
+};
+
+/// Read CSV from \a in into chunks from \a pool, parse each chunk in place
+/// and call \a publish with batches of at most \a batch_rows records that
+/// point into the chunk. Only a record cut off at the end of a chunk is
+/// copied, to the start of the next one, and a chunk is doubled in size if
+/// a record does not fit in it. Reading waits for a free chunk, so the
+/// pool's size bounds how far ahead of the consumers the parser can get.
+/// This returns the first parsing error, or 'csv::none'.
+///
+/// @pre: \a pool has at least 2 chunks.
+template <typename Publish>
+csv::error_code parse_into_batches(std::istream& in, chunk_pool& pool, std::size_t batch_rows, Publish publish);
+
+//=============================================================================
+// row_batch
+//=============================================================================
+/// A class holding a copy of consecutive records from a CSV document.
+class row_batch {
+	std::vector<char> m_chars;
+	std::vector<std::size_t> m_field_ends;
+	std::vector<std::size_t> m_row_ends;
+	std::size_t m_first_row;
+
+public:
+	row_batch();
+
+	/// Return the index in the document of the first record.
+	std::size_t first_row() const;
+
+	/// Return the number of records.
+	std::size_t rows() const;
+
+	/// Return the number of fields in the \a row'th record.
+	std::size_t fields(std::size_t row) const;
+
+	/// Return the \a column'th field of the \a row'th record.
+	string_cview field(std::size_t row, std::size_t column) const;
+
+	/// Remove every record, keeping the memory, and make the next record
+	/// added the \a first_row'th of the document.
+	void clear(std::size_t first_row);
+
+	/// Add \a str as the next field of the current record.
+	void add_field(string_cview str);
+
+	/// End the current record.
+	void end_row();
+};
+
+//=============================================================================
+// pipeline
+//=============================================================================
+/// How \a run_pipeline divides up the work.
+struct pipeline_options {
+	std::size_t workers;    ///< Conversion threads, or 0 for one per spare CPU
+	std::size_t batch_rows; ///< Records in each batch
+	std::size_t batches;    ///< Batches in flight, or 0 for four per worker
+
+	pipeline_options()
+	: workers(0)
+	, batch_rows(1024)
+	, batches(0) {
+	}
+};
+
+/// Parse the \a length characters of CSV starting at \a data on this thread
+/// into batches of records, call \a convert on each batch on a pool of
+/// worker threads and then call \a consume with each converted batch in
+/// the order of the document on another thread. Only a fixed number of
+/// batches are in flight, and a batch is only reused once its result has
+/// been consumed, so the parser waits whenever the later stages fall
+/// behind. Each worker has its own queue and takes batches from the others'
+/// queues when it runs out.
+///
+/// 'convert' is called concurrently as 'convert(row_batch const&)' and its
+/// result must be default constructible and movable. This returns the
+/// first parsing error, or 'csv::none', and rethrows the first exception
+/// thrown by 'convert' or 'consume' after every thread has stopped.
+template <typename Convert, typename Consume>
+csv::error_code run_pipeline(char const* data, std::size_t length, Convert convert, Consume consume, pipeline_options const& options = pipeline_options());
+
+namespace detail {
+
+template <typename Convert, typename Consume>
+class pipeline {
+	typedef typename std::decay<decltype(std::declval<Convert&>()(std::declval<row_batch const&>()))>::type result_type;
+
+	struct converted {
+		row_batch* batch;
+		result_type result;
+	};
+
+	Convert& m_convert;
+	Consume& m_consume;
+	std::size_t m_batch_rows;
+	std::vector<row_batch> m_batches;
+	mpmc_queue<row_batch*> m_free;
+	std::vector<std::unique_ptr<mpmc_queue<row_batch*> > > m_queues;
+	mpmc_queue<converted> m_converted;
+	std::atomic<bool> m_done;
+	std::atomic<bool> m_failed;
+	std::size_t m_produced;
+	std::exception_ptr m_exception;
+	std::mutex m_mutex;
+	event_count m_freed;     // a batch has been consumed, or a thread failed
+	event_count m_queued;    // a batch is ready to convert, or parsing ended
+	event_count m_finished;  // a batch has been converted, or parsing ended
+
+	// The tokeniser's state
+	row_batch* m_batch;
+	std::size_t m_rows;
+	std::size_t m_next_queue;
+	csv::error_code m_error;
+
+public:
+	pipeline(Convert& convert, Consume& consume, pipeline_options const& options, std::size_t workers);
+
+	csv::error_code run(char const* data, std::size_t length);
+
+	command start_row();
+
+	command field(string_cview str);
+
+	command end_row();
+
+	always_abort error(csv::error_code code);
+
+private:
+	bool publish();
+
+	void work(std::size_t index);
+
+	void collect();
+
+	void fail();
+};
+
+template <typename Publish>
+class batch_builder {
+	Publish& m_publish;
+	std::size_t m_batch_rows;
+	std::size_t m_rows;
+	view_batch m_batch;
+	csv::error_code m_error;
+
+public:
+	batch_builder(Publish& publish, std::size_t batch_rows);
+
+	std::size_t rows() const;
+
+	csv::error_code error() const;
+
+	void start(chunk_handle const& chunk);
+
+	void flush();
+
+	always_keep_going row(string_view const* fields, std::size_t count);
+
+	always_abort error(csv::error_code code);
+};
+
+}
+
+//-----------------------------------------------------------------------------
+// mpmc_queue
+//-----------------------------------------------------------------------------
+template <typename T>
+mpmc_queue<T>::mpmc_queue(std::size_t capacity)
+: m_mask(1)
+, m_push(0)
+, m_pop(0) {
+	while(m_mask < capacity) {
+		m_mask <<= 1;
+	}
+
+	m_slots.reset(new slot[m_mask]);
+	for(std::size_t i = 0; i < m_mask; ++i) {
+		m_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	--m_mask;
+}
+
+template <typename T>
+bool mpmc_queue<T>::try_push(T& value) {
+	std::size_t position = m_push.load(std::memory_order_relaxed);
+	for(;;) {
+		slot& s = m_slots[position & m_mask];
+		std::size_t const sequence = s.sequence.load(std::memory_order_acquire);
+		std::ptrdiff_t const difference = static_cast<std::ptrdiff_t>(sequence - position);
+		if(!difference) {
+			if(m_push.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				s.value = std::move(value);
+				s.sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+		} else if(difference < 0) {
+			return false;
+		} else {
+			position = m_push.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+template <typename T>
+bool mpmc_queue<T>::try_pop(T& value) {
+	std::size_t position = m_pop.load(std::memory_order_relaxed);
+	for(;;) {
+		slot& s = m_slots[position & m_mask];
+		std::size_t const sequence = s.sequence.load(std::memory_order_acquire);
+		std::ptrdiff_t const difference = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+		if(!difference) {
+			if(m_pop.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				value = std::move(s.value);
+				s.sequence.store(position + m_mask + 1, std::memory_order_release);
+				return true;
+			}
+		} else if(difference < 0) {
+			return false;
+		} else {
+			position = m_pop.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// event_count
+//-----------------------------------------------------------------------------
+namespace detail {
+
+inline
+event_count::event_count()
+: m_epoch(0) {
+}
+
+inline
+std::size_t event_count::prepare() const {
+	return m_epoch.load(std::memory_order_acquire);
+}
+
+inline
+void event_count::wait(std::size_t ticket) {
+	// Waits are usually short when the stages keep up with each other, so
+	// give the other threads a few chances before going to sleep
+	for(int i = 0; i < 16; ++i) {
+		if(m_epoch.load(std::memory_order_acquire) != ticket) {
+			return;
+		}
+
+		std::this_thread::yield();
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_changed.wait(lock, [&] { return m_epoch.load(std::memory_order_acquire) != ticket; });
+}
+
+inline
+void event_count::notify() {
+	{
+		// Changing the epoch under the lock means that a waiter cannot miss
+		// it between checking and going to sleep
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_epoch.fetch_add(1, std::memory_order_release);
+	}
+
+	m_changed.notify_all();
+}
+
+}
+
+//-----------------------------------------------------------------------------
+// spsc_queue
+//-----------------------------------------------------------------------------
+template <typename T>
+spsc_queue<T>::spsc_queue(std::size_t capacity)
+: m_mask(1)
+, m_push(0)
+, m_pop(0) {
+	while(m_mask < capacity) {
+		m_mask <<= 1;
+	}
+
+	m_values.reset(new T[m_mask]);
+	--m_mask;
+}
+
+template <typename T>
+bool spsc_queue<T>::try_push(T& value) {
+	std::size_t const position = m_push.load(std::memory_order_relaxed);
+	if(position - m_pop.load(std::memory_order_acquire) > m_mask) {
+		return false;
+	}
+
+	m_values[position & m_mask] = std::move(value);
+	m_push.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+template <typename T>
+bool spsc_queue<T>::try_pop(T& value) {
+	std::size_t const position = m_pop.load(std::memory_order_relaxed);
+	if(position == m_push.load(std::memory_order_acquire)) {
+		return false;
+	}
+
+	value = std::move(m_values[position & m_mask]);
+	m_pop.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// chunk_handle
+//-----------------------------------------------------------------------------
+inline
+chunk_handle::chunk_handle()
+: m_chunk(0) {
+}
+
+inline
+chunk_handle::chunk_handle(detail::chunk* c)
+: m_chunk(c) {
+	m_chunk->references.store(1, std::memory_order_relaxed);
+}
+
+inline
+chunk_handle::chunk_handle(chunk_handle const& rhs)
+: m_chunk(rhs.m_chunk) {
+	if(m_chunk) {
+		m_chunk->references.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+inline
+chunk_handle::chunk_handle(chunk_handle&& rhs)
+: m_chunk(rhs.m_chunk) {
+	rhs.m_chunk = 0;
+}
+
+inline
+chunk_handle& chunk_handle::operator=(chunk_handle rhs) {
+	std::swap(m_chunk, rhs.m_chunk);
+	return *this;
+}
+
+inline
+chunk_handle::~chunk_handle() {
+	// The last handle has to see every other thread's reads of the chunk
+	// finish before it can be handed out again
+	if(m_chunk && m_chunk->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		m_chunk->pool->release(m_chunk);
+	}
+}
+
+inline
+char* chunk_handle::data() const {
+	return m_chunk->data.data();
+}
+
+inline
+std::size_t chunk_handle::capacity() const {
+	return m_chunk->data.size();
+}
+
+inline
+void chunk_handle::grow() {
+	assert(use_count() == 1);
+	m_chunk->data.resize(2 * m_chunk->data.size());
+}
+
+inline
+std::size_t chunk_handle::use_count() const {
+	return m_chunk ? m_chunk->references.load(std::memory_order_relaxed) : 0;
+}
+
+inline
+chunk_handle::operator bool() const {
+	return m_chunk != 0;
+}
+
+//-----------------------------------------------------------------------------
+// chunk_pool
+//-----------------------------------------------------------------------------
+inline
+chunk_pool::chunk_pool(std::size_t chunks, std::size_t chunk_size)
+: m_chunks(chunks)
+, m_free(chunks) {
+	for(std::size_t i = 0; i < chunks; ++i) {
+		m_chunks[i].reset(new detail::chunk);
+		m_chunks[i]->data.resize(std::max<std::size_t>(chunk_size, 1));
+		m_chunks[i]->references.store(0, std::memory_order_relaxed);
+		m_chunks[i]->pool = this;
+		detail::chunk* c = m_chunks[i].get();
+		m_free.try_push(c);
+	}
+}
+
+inline
+std::size_t chunk_pool::chunks() const {
+	return m_chunks.size();
+}
+
+inline
+bool chunk_pool::try_acquire(chunk_handle& handle) {
+	detail::chunk* c = 0;
+	if(!m_free.try_pop(c)) {
+		return false;
+	}
+
+	handle = chunk_handle(c);
+	return true;
+}
+
+inline
+chunk_handle chunk_pool::acquire() {
+	chunk_handle handle;
+	for(;;) {
+		std::size_t const ticket = m_released.prepare();
+		if(try_acquire(handle)) {
+			return handle;
+		}
+
+		m_released.wait(ticket);
+	}
+}
+
+inline
+void chunk_pool::release(detail::chunk* c) {
+	// Every chunk fits in the free list, so this cannot fail
+	m_free.try_push(c);
+	m_released.notify();
+}
+
+//-----------------------------------------------------------------------------
+// view_batch
+//-----------------------------------------------------------------------------
+inline
+view_batch::view_batch()
+: m_first_row(0) {
+}
+
+inline
+view_batch::view_batch(chunk_handle const& chunk, std::size_t first_row)
+: m_chunk(chunk)
+, m_first_row(first_row) {
+}
+
+inline
+std::size_t view_batch::first_row() const {
+	return m_first_row;
+}
+
+inline
+std::size_t view_batch::rows() const {
+	return m_row_ends.size();
+}
+
+inline
+std::size_t view_batch::fields(std::size_t row) const {
+	return m_row_ends[row] - (row ? m_row_ends[row - 1] : 0);
+}
+
+inline
+string_cview view_batch::field(std::size_t row, std::size_t column) const {
+	return m_fields[(row ? m_row_ends[row - 1] : 0) + column];
+}
+
+inline
+chunk_handle const& view_batch::chunk() const {
+	return m_chunk;
+}
+
+inline
+void view_batch::add_row(string_view const* fields, std::size_t count) {
+	m_fields.insert(m_fields.end(), fields, fields + count);
+	m_row_ends.push_back(m_fields.size());
+}
+
+//-----------------------------------------------------------------------------
+// parse_into_batches
+//-----------------------------------------------------------------------------
+template <typename Publish>
+csv::error_code parse_into_batches(std::istream& in, chunk_pool& pool, std::size_t batch_rows, Publish publish) {
+	assert(pool.chunks() >= 2);
+	detail::batch_builder<Publish> builder(publish, std::max<std::size_t>(batch_rows, 1));
+	chunk_handle chunk = pool.acquire();
+	std::size_t size = 0;
+	for(;;) {
+		if(size == chunk.capacity()) {
+			chunk.grow();
+		}
+
+		in.read(chunk.data() + size, chunk.capacity() - size);
+		size += static_cast<std::size_t>(in.gcount());
+		bool const end = !in;
+		std::size_t const records = end ? size : csv::complete_records(chunk.data(), size);
+		if(!records && !end) {
+			continue;
+		}
+
+		// An empty document still needs finishing to report its error
+		if(records || !builder.rows()) {
+			builder.start(chunk);
+			csv::in_place_parser parser(chunk.data(), records);
+			bool const result = parser.parse(builder) && (!end || parser.finish(builder));
+			builder.flush();
+			if(!result) {
+				return builder.error();
+			}
+		}
+
+		if(end) {
+			return csv::none;
+		}
+
+		// Carry the partial record over to the next chunk
+		chunk_handle next = pool.acquire();
+		while(next.capacity() < size - records) {
+			next.grow();
+		}
+
+		std::copy(chunk.data() + records, chunk.data() + size, next.data());
+		size -= records;
+		chunk = std::move(next);
+	}
+}
+
+//-----------------------------------------------------------------------------
+// row_batch
+//-----------------------------------------------------------------------------
+inline
+row_batch::row_batch()
+: m_first_row(0) {
+}
+
+inline
+std::size_t row_batch::first_row() const {
+	return m_first_row;
+}
+
+inline
+std::size_t row_batch::rows() const {
+	return m_row_ends.size();
+}
+
+inline
+std::size_t row_batch::fields(std::size_t row) const {
+	return m_row_ends[row] - (row ? m_row_ends[row - 1] : 0);
+}
+
+inline
+string_cview row_batch::field(std::size_t row, std::size_t column) const {
+	std::size_t const index = (row ? m_row_ends[row - 1] : 0) + column;
+	std::size_t const begin = index ? m_field_ends[index - 1] : 0;
+	return string_cview(m_chars.data() + begin, m_field_ends[index] - begin);
+}
+
+inline
+void row_batch::clear(std::size_t first_row) {
+	m_chars.clear();
+	m_field_ends.clear();
+	m_row_ends.clear();
+	m_first_row = first_row;
+}
+
+inline
+void row_batch::add_field(string_cview str) {
+	m_chars.insert(m_chars.end(), str.begin(), str.end());
+	m_field_ends.push_back(m_chars.size());
+}
+
+inline
+void row_batch::end_row() {
+	m_row_ends.push_back(m_field_ends.size());
+}
+
+//-----------------------------------------------------------------------------
+// pipeline
+//-----------------------------------------------------------------------------
+template <typename Convert, typename Consume>
+csv::error_code run_pipeline(char const* data, std::size_t length, Convert convert, Consume consume, pipeline_options const& options) {
+	std::size_t const workers = options.workers ? options.workers : std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	detail::pipeline<Convert, Consume> p(convert, consume, options, workers);
+	return p.run(data, length);
+}
+
+namespace detail {
+
+template <typename Convert, typename Consume>
+pipeline<Convert, Consume>::pipeline(Convert& convert, Consume& consume, pipeline_options const& options, std::size_t workers)
+: m_convert(convert)
+, m_consume(consume)
+, m_batch_rows(std::max<std::size_t>(options.batch_rows, 1))
+, m_batches(options.batches ? options.batches : 4 * workers)
+, m_free(m_batches.size())
+, m_queues(workers)
+, m_converted(m_batches.size())
+, m_done(false)
+, m_failed(false)
+, m_produced(0)
+, m_batch(0)
+, m_rows(0)
+, m_next_queue(0)
+, m_error(csv::none) {
+	for(std::size_t i = 0; i < m_batches.size(); ++i) {
+		row_batch* batch = &m_batches[i];
+		m_free.try_push(batch);
+	}
+
+	// Every queue can hold every batch, so pushing to one never fails
+	for(std::size_t i = 0; i < workers; ++i) {
+		m_queues[i].reset(new mpmc_queue<row_batch*>(m_batches.size()));
+	}
+}
+
+template <typename Convert, typename Consume>
+csv::error_code pipeline<Convert, Consume>::run(char const* data, std::size_t length) {
+	std::vector<std::thread> threads;
+	threads.reserve(m_queues.size() + 1);
+	threads.push_back(std::thread(&pipeline::collect, this));
+	for(std::size_t i = 0; i < m_queues.size(); ++i) {
+		threads.push_back(std::thread(&pipeline::work, this, i));
+	}
+
+	try {
+		csv::parser<> parser;
+		if(publish() && parser.parse(*this, data, data + length) && !m_failed) {
+			parser.finish(*this);
+		}
+
+		if(m_batch && m_batch->rows() && !m_failed) {
+			m_queues[m_next_queue]->try_push(m_batch);
+			++m_produced;
+		}
+	} catch(...) {
+		fail();
+	}
+
+	m_done.store(true, std::memory_order_release);
+	m_queued.notify();
+	m_finished.notify();
+	for(std::size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+
+	if(m_exception) {
+		std::rethrow_exception(m_exception);
+	}
+
+	return m_error;
+}
+
+template <typename Convert, typename Consume>
+command pipeline<Convert, Consume>::start_row() {
+	return keep_going;
+}
+
+template <typename Convert, typename Consume>
+command pipeline<Convert, Consume>::field(string_cview str) {
+	m_batch->add_field(str);
+	return keep_going;
+}
+
+template <typename Convert, typename Consume>
+command pipeline<Convert, Consume>::end_row() {
+	m_batch->end_row();
+	++m_rows;
+	if(m_batch->rows() == m_batch_rows && !publish()) {
+		return stop;
+	}
+
+	return keep_going;
+}
+
+template <typename Convert, typename Consume>
+always_abort pipeline<Convert, Consume>::error(csv::error_code code) {
+	m_error = code;
+	return abort;
+}
+
+template <typename Convert, typename Consume>
+bool pipeline<Convert, Consume>::publish() {
+	// Hand over the current batch and then wait for a free one, which is
+	// what holds the parser back when the other stages are busy
+	if(m_batch) {
+		SAXY_PROBE2(csv_batch, m_batch->first_row(), m_batch->rows());
+		m_queues[m_next_queue]->try_push(m_batch);
+		m_next_queue = (m_next_queue + 1) % m_queues.size();
+		++m_produced;
+		m_queued.notify();
+	}
+
+	for(;;) {
+		std::size_t const ticket = m_freed.prepare();
+		if(m_free.try_pop(m_batch)) {
+			break;
+		}
+
+		if(m_failed.load(std::memory_order_relaxed)) {
+			m_batch = 0;
+			return false;
+		}
+
+		m_freed.wait(ticket);
+	}
+
+	m_batch->clear(m_rows);
+	return true;
+}
+
+template <typename Convert, typename Consume>
+void pipeline<Convert, Consume>::work(std::size_t index) {
+	try {
+		for(;;) {
+			// Read the flag before looking so that an empty look after the
+			// parser has finished means there is nothing left
+			std::size_t const ticket = m_queued.prepare();
+			bool const done = m_done.load(std::memory_order_acquire);
+			if(m_failed.load(std::memory_order_relaxed)) {
+				return;
+			}
+
+			converted c;
+			c.batch = 0;
+			for(std::size_t i = 0; i < m_queues.size() && !c.batch; ++i) {
+				m_queues[(index + i) % m_queues.size()]->try_pop(c.batch);
+			}
+
+			if(!c.batch) {
+				if(done) {
+					return;
+				}
+
+				m_queued.wait(ticket);
+				continue;
+			}
+
+			c.result = m_convert(static_cast<row_batch const&>(*c.batch));
+			m_converted.try_push(c);
+			m_finished.notify();
+		}
+	} catch(...) {
+		fail();
+	}
+}
+
+template <typename Convert, typename Consume>
+void pipeline<Convert, Consume>::collect() {
+	try {
+		// Batches finish out of order, so hold on to the ones that are
+		// early, of which there can only be as many as there are batches
+		std::map<std::size_t, converted> early;
+		std::size_t next_row = 0;
+		std::size_t consumed = 0;
+		for(;;) {
+			std::size_t const ticket = m_finished.prepare();
+			bool const done = m_done.load(std::memory_order_acquire);
+			if(m_failed.load(std::memory_order_relaxed)) {
+				return;
+			}
+
+			converted c;
+			if(m_converted.try_pop(c)) {
+				std::size_t const first_row = c.batch->first_row();
+				early.insert(std::make_pair(first_row, std::move(c)));
+			} else if(early.empty() || early.begin()->first != next_row) {
+				if(done && consumed == m_produced) {
+					return;
+				}
+
+				m_finished.wait(ticket);
+				continue;
+			}
+
+			while(!early.empty() && early.begin()->first == next_row) {
+				converted& ready = early.begin()->second;
+				next_row += ready.batch->rows();
+				m_consume(std::move(ready.result));
+				row_batch* batch = ready.batch;
+				early.erase(early.begin());
+				m_free.try_push(batch);
+				m_freed.notify();
+				++consumed;
+			}
+		}
+	} catch(...) {
+		fail();
+	}
+}
+
+template <typename Convert, typename Consume>
+void pipeline<Convert, Consume>::fail() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(!m_exception) {
+		m_exception = std::current_exception();
+	}
+
+	m_failed.store(true, std::memory_order_relaxed);
+	m_freed.notify();
+	m_queued.notify();
+	m_finished.notify();
+}
+
+template <typename Publish>
+batch_builder<Publish>::batch_builder(Publish& publish, std::size_t batch_rows)
+: m_publish(publish)
+, m_batch_rows(batch_rows)
+, m_rows(0)
+, m_error(csv::none) {
+}
+
+template <typename Publish>
+std::size_t batch_builder<Publish>::rows() const {
+	return m_rows;
+}
+
+template <typename Publish>
+csv::error_code batch_builder<Publish>::error() const {
+	return m_error;
+}
+
+template <typename Publish>
+void batch_builder<Publish>::start(chunk_handle const& chunk) {
+	m_batch = view_batch(chunk, m_rows);
+}
+
+template <typename Publish>
+void batch_builder<Publish>::flush() {
+	if(m_batch.rows()) {
+		chunk_handle const chunk = m_batch.chunk();
+		SAXY_PROBE2(csv_batch, m_batch.first_row(), m_batch.rows());
+		m_publish(std::move(m_batch));
+		m_batch = view_batch(chunk, m_rows);
+	}
+}
+
+template <typename Publish>
+always_keep_going batch_builder<Publish>::row(string_view const* fields, std::size_t count) {
+	m_batch.add_row(fields, count);
+	++m_rows;
+	if(m_batch.rows() == m_batch_rows) {
+		flush();
+	}
+
+	return keep_going;
+}
+
+template <typename Publish>
+always_abort batch_builder<Publish>::error(csv::error_code code) {
+	m_error = code;
+	return abort;
+}
+
+}
+
+}
+
+#endif
+
+#endif
@@ -107,6 +107,18 @@ public:
 	struct rebind {
 		typedef stack_allocator<Other> other;
 	};
+
+	/// Two allocators are equal if they share a buffer, as either can then
+	/// free what the other allocated.
+	template <typename U>
+	bool operator==(stack_allocator<U> const& rhs) const {
+		return m_buffer == rhs.m_buffer;
+	}
+
+	template <typename U>
+	bool operator!=(stack_allocator<U> const& rhs) const {
+		return m_buffer != rhs.m_buffer;
+	}
 };
 
 }
@@ -0,0 +1,339 @@
+/*************************************************************************//**
+ * \file   transcoder.hpp
+ * \author Elliot Goodrich
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ ****************************************************************************/
+
+#ifndef INCLUDE_GUARD_08D12957_17BB_4939_9387_43BB2BDB8496
+#define INCLUDE_GUARD_08D12957_17BB_4939_9387_43BB2BDB8496
+
+#include "common.hpp"
+
+#include <algorithm>
+#include <cstddef>
+
+#ifdef SAXY_SSE2
+#include <mmintrin.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+namespace saxy {
+
+/// A class that converts UTF-16, Latin-1 or UTF-8 text to UTF-8 a chunk at a
+/// time, so that it can be handed to a parser that only understands UTF-8.
+/// A leading byte order mark is always removed, and when the encoding is
+/// 'detect' it decides what the encoding is.
+class transcoder {
+public:
+	/// The encoding of the text given to \a convert.
+	enum encoding {
+		detect,  ///< Use the byte order mark, or UTF-8 if there is none
+		utf8,    ///< UTF-8, copied through unchanged
+		utf16le, ///< Little-endian UTF-16
+		utf16be, ///< Big-endian UTF-16
+		latin1,  ///< ISO 8859-1
+	};
+
+private:
+	encoding m_encoding;
+	bool m_started;
+	unsigned char m_head[3];
+	unsigned m_head_size;
+	unsigned m_odd_byte;
+	bool m_has_odd_byte;
+	unsigned m_high_surrogate;
+
+public:
+	/// Create a transcoder for text in the encoding \a enc.
+	explicit transcoder(encoding enc = detect);
+
+	/// Return the encoding of the text, which stays 'detect' until enough of
+	/// it has been seen to look for a byte order mark.
+	encoding source_encoding() const;
+
+	/// Convert the \a length bytes starting at \a data to UTF-8 and append
+	/// them to \a out, which is a vector-like container of char. Anything
+	/// that is cut off at the end, such as half of a UTF-16 code unit, is
+	/// kept until the next call.
+	template <typename Vector>
+	void convert(char const* data, std::size_t length, Vector& out);
+
+	/// Append to \a out anything still held back after the last call to
+	/// \a convert. Incomplete or unpaired UTF-16 is replaced with U+FFFD.
+	template <typename Vector>
+	void finish(Vector& out);
+
+private:
+	template <typename Vector>
+	void start(Vector& out);
+
+	template <typename Vector>
+	void convert_latin1(unsigned char const* it, unsigned char const* end, Vector& out);
+
+	template <typename Vector>
+	void convert_utf16(unsigned char const* it, unsigned char const* end, Vector& out);
+
+	template <typename Vector>
+	void code_unit(unsigned unit, Vector& out);
+
+	template <typename Vector>
+	static void code_point(unsigned cp, Vector& out);
+
+	template <typename Vector>
+	static void reserve(Vector& out, std::size_t extra);
+};
+
+inline
+transcoder::transcoder(encoding enc)
+: m_encoding(enc)
+, m_started(false)
+, m_head_size(0)
+, m_odd_byte(0)
+, m_has_odd_byte(false)
+, m_high_surrogate(0) {
+}
+
+inline
+transcoder::encoding transcoder::source_encoding() const {
+	return m_encoding;
+}
+
+template <typename Vector>
+void transcoder::convert(char const* data, std::size_t length, Vector& out) {
+	if(!m_started) {
+		// Hold back the first three bytes until we know whether they are a
+		// byte order mark
+		while(m_head_size < 3 && length) {
+			m_head[m_head_size++] = static_cast<unsigned char>(*data++);
+			--length;
+		}
+
+		if(m_head_size < 3) {
+			return;
+		}
+
+		start(out);
+	}
+
+	unsigned char const* it = reinterpret_cast<unsigned char const*>(data);
+	switch(m_encoding) {
+	case latin1:
+		convert_latin1(it, it + length, out);
+		break;
+	case utf16le:
+	case utf16be:
+		convert_utf16(it, it + length, out);
+		break;
+	default:
+		out.insert(out.end(), data, data + length);
+		break;
+	}
+}
+
+template <typename Vector>
+void transcoder::finish(Vector& out) {
+	if(!m_started) {
+		start(out);
+	}
+
+	if(m_has_odd_byte || m_high_surrogate) {
+		code_point(0xFFFD, out);
+		m_has_odd_byte = false;
+		m_high_surrogate = 0;
+	}
+}
+
+template <typename Vector>
+void transcoder::start(Vector& out) {
+	unsigned char const* h = m_head;
+	unsigned bom = 0;
+	if(m_head_size >= 3 && h[0] == 0xEF && h[1] == 0xBB && h[2] == 0xBF && (m_encoding == detect || m_encoding == utf8)) {
+		m_encoding = utf8;
+		bom = 3;
+	} else if(m_head_size >= 2 && h[0] == 0xFF && h[1] == 0xFE && (m_encoding == detect || m_encoding == utf16le)) {
+		m_encoding = utf16le;
+		bom = 2;
+	} else if(m_head_size >= 2 && h[0] == 0xFE && h[1] == 0xFF && (m_encoding == detect || m_encoding == utf16be)) {
+		m_encoding = utf16be;
+		bom = 2;
+	} else if(m_encoding == detect) {
+		m_encoding = utf8;
+	}
+
+	m_started = true;
+	convert(reinterpret_cast<char const*>(h + bom), m_head_size - bom, out);
+}
+
+template <typename Vector>
+void transcoder::convert_latin1(unsigned char const* it, unsigned char const* end, Vector& out) {
+	reserve(out, 2 * (end - it));
+
+	// Runs of ASCII are copied 16 bytes at a time, or 8 without SSE2, and
+	// everything else takes the two byte UTF-8 form
+#ifdef SAXY_SSE2
+	std::ptrdiff_t const width = 16;
+#else
+	std::ptrdiff_t const width = 8;
+#endif
+	while(end - it >= width) {
+#ifdef SAXY_SSE2
+		bool const ascii = !_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(it)));
+#else
+		bool const ascii = !(detail::load_word(reinterpret_cast<char const*>(it)) & 0x8080808080808080ULL);
+#endif
+		if(ascii) {
+			out.insert(out.end(), it, it + width);
+			it += width;
+			continue;
+		}
+
+		for(unsigned char const* const block_end = it + width; it != block_end; ++it) {
+			code_point(*it, out);
+		}
+	}
+
+	for(; it != end; ++it) {
+		code_point(*it, out);
+	}
+}
+
+template <typename Vector>
+void transcoder::convert_utf16(unsigned char const* it, unsigned char const* end, Vector& out) {
+	bool const big_endian = m_encoding == utf16be;
+	reserve(out, 3 * ((end - it) / 2 + 1));
+
+	if(m_has_odd_byte && it != end) {
+		unsigned const second = *it++;
+		code_unit(big_endian ? (m_odd_byte << 8) | second : (second << 8) | m_odd_byte, out);
+		m_has_odd_byte = false;
+	}
+
+	// Eight code units at a time, or four without SSE2, which are narrowed
+	// straight to bytes if they are all ASCII
+#ifdef SAXY_SSE2
+	__m128i const non_ascii = _mm_set1_epi16(static_cast<short>(0xFF80));
+	__m128i const zero = _mm_setzero_si128();
+	while(end - it >= 16) {
+		__m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(it));
+		if(big_endian) {
+			block = _mm_or_si128(_mm_slli_epi16(block, 8), _mm_srli_epi16(block, 8));
+		}
+
+		__m128i const ascii = _mm_cmpeq_epi16(_mm_and_si128(block, non_ascii), zero);
+		if(_mm_movemask_epi8(ascii) == 0xFFFF && !m_high_surrogate) {
+			char narrow[16];
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(narrow), _mm_packus_epi16(block, block));
+			out.insert(out.end(), narrow, narrow + 8);
+			it += 16;
+			continue;
+		}
+
+		for(unsigned char const* const block_end = it + 16; it != block_end; it += 2) {
+			code_unit(big_endian ? (it[0] << 8) | it[1] : (it[1] << 8) | it[0], out);
+		}
+	}
+#else
+	// The byte that must be 0 in each unit depends on the byte order
+	std::uint64_t const non_ascii = big_endian ? 0x80FF80FF80FF80FFULL : 0xFF80FF80FF80FF80ULL;
+	int const low = big_endian ? 1 : 0;
+	while(end - it >= 8) {
+		if(!(detail::load_word(reinterpret_cast<char const*>(it)) & non_ascii) && !m_high_surrogate) {
+			char const narrow[4] = {static_cast<char>(it[low]), static_cast<char>(it[2 + low]),
+			                        static_cast<char>(it[4 + low]), static_cast<char>(it[6 + low])};
+			out.insert(out.end(), narrow, narrow + 4);
+			it += 8;
+			continue;
+		}
+
+		for(unsigned char const* const block_end = it + 8; it != block_end; it += 2) {
+			code_unit(big_endian ? (it[0] << 8) | it[1] : (it[1] << 8) | it[0], out);
+		}
+	}
+#endif
+
+	for(; end - it >= 2; it += 2) {
+		code_unit(big_endian ? (it[0] << 8) | it[1] : (it[1] << 8) | it[0], out);
+	}
+
+	if(it != end) {
+		m_odd_byte = *it;
+		m_has_odd_byte = true;
+	}
+}
+
+template <typename Vector>
+void transcoder::code_unit(unsigned unit, Vector& out) {
+	if(m_high_surrogate) {
+		if(unit >= 0xDC00 && unit <= 0xDFFF) {
+			code_point(0x10000 + ((m_high_surrogate - 0xD800) << 10) + (unit - 0xDC00), out);
+			m_high_surrogate = 0;
+			return;
+		}
+
+		code_point(0xFFFD, out);
+		m_high_surrogate = 0;
+	}
+
+	if(unit >= 0xD800 && unit <= 0xDBFF) {
+		m_high_surrogate = unit;
+	} else if(unit >= 0xDC00 && unit <= 0xDFFF) {
+		code_point(0xFFFD, out);
+	} else {
+		code_point(unit, out);
+	}
+}
+
+template <typename Vector>
+void transcoder::reserve(Vector& out, std::size_t extra) {
+	// Grow geometrically so that many small chunks don't reallocate each time
+	if(out.capacity() - out.size() < extra) {
+		out.reserve(std::max(out.size() + extra, 2 * out.capacity()));
+	}
+}
+
+template <typename Vector>
+void transcoder::code_point(unsigned cp, Vector& out) {
+	if(cp < 0x80) {
+		out.push_back(static_cast<char>(cp));
+	} else if(cp < 0x800) {
+		out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+		out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+	} else if(cp < 0x10000) {
+		out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+		out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+	} else {
+		out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+		out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+	}
+}
+
+}
+
+#endif
@@ -16,3 +16,21 @@ TEST_CASE("Count leading zeros", "[count_leading_zeros]") {
 	check(32768, 15);
 	check(49152, 14);
 }
+
+TEST_CASE("Count bits", "[count_bits]") {
+	CHECK(saxy::detail::count_bits(0) == 0);
+	CHECK(saxy::detail::count_bits(1) == 1);
+	CHECK(saxy::detail::count_bits(0xFFFF) == 16);
+	CHECK(saxy::detail::count_bits(0x8001) == 2);
+}
+
+TEST_CASE("Match every byte", "[match_bytes]") {
+	// Every byte equal to the character is marked, even after another match
+	// or next to a byte one away from it
+	std::uint64_t const word = saxy::detail::load_word("\"\"#!\"a\"\x80");
+	CHECK(saxy::detail::match_bytes(word, '"') == 0x0080008000008080ULL);
+	CHECK(saxy::detail::top_bits(saxy::detail::match_bytes(word, '"')) == 0x53);
+	CHECK(saxy::detail::match_bytes(word, '\x80') == 0x8000000000000000ULL);
+	CHECK(saxy::detail::match_bytes(word, ',') == 0);
+	CHECK(saxy::detail::match_bytes(0, '\0') == 0x8080808080808080ULL);
+}
@@ -2,6 +2,8 @@
 
 #include "saxy/csv.hpp"
 #include "saxy/iterator.hpp"
+#include "saxy/numa_scheduler.hpp"
+#include "saxy/pipeline.hpp"
 #include "saxy/second_throw_allocator.hpp"
 #include "saxy/stack_allocator.hpp"
 
@@ -10,10 +12,24 @@
 #ifdef SAXY_CPP11
 #include <functional>
 #endif
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#if defined __unix__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 struct csv_test_parser {
 	enum what_to_do {
 		exception,
@@ -105,6 +121,27 @@ void check_conversion(int line, std::string const& csv, std::string const& xml)
 		CHECK(converter.error_count == 0);
 	}
 
+	// Check that the DFA engine agrees
+	{
+		INFO("Testing static conversion with the DFA engine");
+		INFO("Line: " << line);
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_test_parser converter;
+		CHECK(saxy::csv::parse(converter, saxy::csv::dfa_engine, copy.data(), copy.size()));
+		CHECK(converter.xml == xml);
+		CHECK(converter.error_count == 0);
+	}
+
+	{
+		INFO("Testing static conversion and finish with the DFA engine");
+		INFO("Line: " << line);
+		std::vector<char> copy(csv.begin(), csv.end() - 2);
+		csv_test_parser converter;
+		CHECK(saxy::csv::parse(converter, saxy::csv::dfa_engine, copy.data(), copy.size()));
+		CHECK(converter.xml == xml);
+		CHECK(converter.error_count == 0);
+	}
+
 	// Check that partial conversion works
 	for(std::string::size_type i = 0; i < csv.size(); ++i) {
 		csv_test_parser converter;
@@ -281,6 +318,89 @@ TEST_CASE("Check conversion", "[csv]") {
 	check_conversion(__LINE__, "\"\"\"A\"\"\",B\r\n",            "{[\"A\"][B]}");
 	check_conversion(__LINE__, "\"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"\r\n",     "{[ABCDEFGHIJKLMNOPQRSTUVWXYZ]}");
 	check_conversion(__LINE__, "\"ABCDEFGHIJK\"\"LMNOPQRSTUVWXYZ\"\r\n", "{[ABCDEFGHIJK\"LMNOPQRSTUVWXYZ]}");
+	check_conversion(__LINE__, "\"A\"\"B\"\"C\"\"D\"\"EFGHIJKLMNOPQRSTUVWXYZ\",1\r\n", "{[A\"B\"C\"D\"EFGHIJKLMNOPQRSTUVWXYZ][1]}");
+	check_conversion(__LINE__, "\"ABCDEFGHIJKLMNO\"\"PQRSTUVWXYZ\"\r\n", "{[ABCDEFGHIJKLMNO\"PQRSTUVWXYZ]}");
+	check_conversion(__LINE__, "\"ABCDEFGHIJKLMN\"\"OPQRSTUVWXYZ\"\r\n",  "{[ABCDEFGHIJKLMN\"OPQRSTUVWXYZ]}");
+	check_conversion(__LINE__, "\"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"\"\"\r\nabcdefghijklmnopqrstuvwxyz\r\n", "{[ABCDEFGHIJKLMNOPQRSTUVWXYZ\"]}{[abcdefghijklmnopqrstuvwxyz]}");
+	check_conversion(__LINE__, "\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\r\n", "{[\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"]}");
+	check_conversion(__LINE__, "\"A\"\"B\"\"C\"\"D\"\"E\"\"F\"\"G\"\"H\"\"I\",1\r\n",     "{[A\"B\"C\"D\"E\"F\"G\"H\"I][1]}");
+	check_conversion(__LINE__, "\"AB\"\"CD\",EFGHIJKLMNOPQRSTUVWXYZ\r\n", "{[AB\"CD][EFGHIJKLMNOPQRSTUVWXYZ]}");
+	check_conversion(__LINE__, "\"ABCDEFGHIJKLMN\"\"\"\"OP\"\"\",QRSTUVWXYZ\r\n", "{[ABCDEFGHIJKLMN\"\"OP\"][QRSTUVWXYZ]}");
+	check_conversion(__LINE__, "\"ABCDEFGHIJKLM\"\"\",\"\"\"\"\"NOPQRSTUVWXYZ\"\r\n", "{[ABCDEFGHIJKLM\"][\"\"NOPQRSTUVWXYZ]}");
+}
+
+struct csv_row_parser {
+	std::string xml;
+	int row_calls;
+	int stop_at;
+
+	explicit csv_row_parser(int stop = -1)
+	: row_calls(0)
+	, stop_at(stop) {
+	}
+
+	saxy::command row(saxy::string_view const* fields, std::size_t n) {
+		xml += '{';
+		for(std::size_t i = 0; i < n; ++i) {
+			xml += '[';
+			xml.append(fields[i].data(), fields[i].size());
+			xml += ']';
+		}
+		xml += '}';
+
+		if(row_calls++ == stop_at) {
+			return saxy::stop;
+		}
+
+		return saxy::keep_going;
+	}
+
+	saxy::always_abort error(saxy::csv::error_code) {
+		return saxy::abort;
+	}
+};
+
+void check_row_conversion(int line, std::string const& csv, std::string const& xml) {
+	{
+		INFO("Testing static row conversion");
+		INFO("Line: " << line);
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_row_parser converter;
+		CHECK(saxy::csv::parse(converter, copy.data(), copy.size()));
+		CHECK(converter.xml == xml);
+	}
+
+	for(std::string::size_type i = 0; i < csv.size(); ++i) {
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_row_parser converter;
+		saxy::csv::in_place_parser parser(copy.data(), copy.size());
+		INFO("Testing row statefulness for in place");
+		INFO("Line: " << line << ", i = " << i);
+		CHECK(parser.parse(converter, i));
+		CHECK(parser.parse(converter));
+		CHECK(converter.xml == xml);
+	}
+
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_row_parser converter(0);
+		saxy::csv::in_place_parser parser(copy.data(), copy.size());
+		INFO("Testing row stopping");
+		INFO("Line: " << line);
+		CHECK(parser.parse(converter));
+		CHECK(parser.parse(converter));
+		CHECK(converter.xml == xml);
+	}
+}
+
+TEST_CASE("Check row conversion", "[csv]") {
+	check_row_conversion(__LINE__, "A\r\n",                        "{[A]}");
+	check_row_conversion(__LINE__, ",\r\n",                        "{[][]}");
+	check_row_conversion(__LINE__, "AB,CD,EF\r\n",                 "{[AB][CD][EF]}");
+	check_row_conversion(__LINE__, "A,B\r\nC,D\r\n",               "{[A][B]}{[C][D]}");
+	check_row_conversion(__LINE__, "A\r\nB,C,D\r\nE\r\n",          "{[A]}{[B][C][D]}{[E]}");
+	check_row_conversion(__LINE__, "\"\"\"A\"\"\",B\r\n",          "{[\"A\"][B]}");
+	check_row_conversion(__LINE__, "\"A,B\",\"C\r\nD\"\r\n",         "{[A,B][C\r\nD]}");
 }
 
 TEST_CASE("iterators", "[csv]") {
@@ -436,6 +556,40 @@ TEST_CASE("CSV document finishes correctly", "[csv]") {
 }
 #endif
 
+TEST_CASE("CSV quoted fields are copied without a terminator", "[csv]") {
+	// 'start' runs again after the opening quote, and each field must still
+	// be copied from its first byte
+	std::string const csv = "\"a\",b,\"\",\"c\"\"d\"\r\n";
+	csv_test_parser converter;
+	saxy::csv::parser<> parser;
+	CHECK(parser.parse(converter, csv.begin(), csv.end()));
+	CHECK(converter.xml == "{[a][b][][c\"d]}");
+}
+
+TEST_CASE("CSV lone carriage returns are field text", "[csv]") {
+	// A CR not followed by LF is part of an unquoted field, but the byte
+	// after it is read as usual, so a comma still ends the field
+	check_conversion(__LINE__, "A\r,B\r\n",                      "{[A\r][B]}");
+	check_conversion(__LINE__, "\r,\r\n",                        "{[\r][]}");
+	check_conversion(__LINE__, "A\rB\r\n",                       "{[A\rB]}");
+	check_conversion(__LINE__, "A\r\rB,C\r\n",                  "{[A\r\rB][C]}");
+
+	// ... and a double quote is still misplaced
+	{
+		const std::string csv = "A\r\"B\r\n";
+		csv_test_parser converter;
+		saxy::csv::parser<> parser;
+		CHECK(!parser.parse(converter, csv.begin(), csv.end()));
+		CHECK(converter.error_count == 1);
+		CHECK(converter.csv_error == saxy::csv::misplaced_double_quotes);
+	}
+}
+
+TEST_CASE("CSV empty fields after a comma are empty in place", "[csv]") {
+	check_conversion(__LINE__, "A,\r\n",                         "{[A][]}");
+	check_conversion(__LINE__, "A,B,\r\nC,,\r\n",              "{[A][B][]}{[C][][]}");
+}
+
 TEST_CASE("CSV errors are detected", "[csv]") {
 	{
 		const std::string csv = "misplaced \"quotes\"\r\n";
@@ -483,3 +637,1849 @@ TEST_CASE("CSV errors are detected", "[csv]") {
 		CHECK(converter.csv_error == saxy::csv::no_fields_in_record);
 	}
 }
+
+struct csv_recovering_parser : csv_test_parser {
+	csv_recovering_parser() {
+	}
+
+	csv_recovering_parser(what_to_do what, int i)
+	: csv_test_parser(what, i) {
+	}
+
+	saxy::command bad_record(saxy::csv::error_code e, std::size_t offset) {
+		xml += '<' + std::to_string(e) + '@' + std::to_string(offset) + '>';
+		return return_helper();
+	}
+};
+
+TEST_CASE("CSV records with errors can be skipped", "[csv]") {
+	// A misplaced quote, text after closing quotes with a quoted CRLF in the
+	// rest of the record and an unfinished CRLF
+	std::string const csv = "a,b\r\n"
+	                        "c\"d,e\r\n"
+	                        "\"f\"g,\"h\r\n\"\r\n"
+	                        "\"i\"\rj\r\n"
+	                        "k,l\r\n";
+	std::string const xml = "{[a][b]}{<1@6>{<2@15>{<3@28>{[k][l]}";
+
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_recovering_parser converter;
+		CHECK(saxy::csv::parse(converter, copy.data(), copy.size()));
+		CHECK(converter.xml == xml);
+		CHECK(converter.error_count == 0);
+	}
+
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_recovering_parser converter;
+		CHECK(saxy::csv::parse(converter, saxy::csv::dfa_engine, copy.data(), copy.size()));
+		CHECK(converter.xml == xml);
+	}
+
+	{
+		csv_recovering_parser converter;
+		saxy::csv::parser<> parser;
+		CHECK(parser.parse(converter, csv.begin(), csv.end()));
+		CHECK(parser.finish(converter));
+		CHECK(converter.xml == xml);
+	}
+
+	// Offsets are from the start of all the input, wherever it is split
+	for(std::size_t i = 0; i < csv.size(); ++i) {
+		INFO("i = " << i);
+		csv_recovering_parser converter;
+		saxy::csv::parser<> parser;
+		std::string::const_iterator const middle = csv.begin() + i;
+		CHECK(parser.parse(converter, csv.begin(), middle));
+		CHECK(parser.parse(converter, middle, csv.end()));
+		CHECK(parser.finish(converter));
+		CHECK(converter.xml == xml);
+
+		std::list<char> const list(csv.begin(), csv.end());
+		std::list<char>::const_iterator list_middle = list.begin();
+		std::advance(list_middle, i);
+		csv_recovering_parser list_converter;
+		saxy::csv::parser<> list_parser;
+		list_parser.set_chunk_size(3);
+		CHECK(list_parser.parse(list_converter, list.begin(), list_middle));
+		CHECK(list_parser.parse(list_converter, list_middle, list.end()));
+		CHECK(list_parser.finish(list_converter));
+		CHECK(list_converter.xml == xml);
+
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_recovering_parser in_place_converter;
+		saxy::csv::in_place_parser in_place(copy.data(), copy.size());
+		CHECK(in_place.parse(in_place_converter, i));
+		CHECK(in_place.parse(in_place_converter));
+		CHECK(in_place.finish(in_place_converter));
+		CHECK(in_place_converter.xml == xml);
+	}
+
+	// Parsing can stop in 'bad_record' and carry on skipping the record
+	{
+		csv_recovering_parser converter(csv_test_parser::stop, 5);
+		saxy::csv::parser<> parser;
+		std::string::const_iterator out;
+		CHECK(parser.parse(converter, csv.begin(), csv.end(), &out));
+		CHECK(out - csv.begin() == 7);
+		CHECK(converter.xml == "{[a][b]}{<1@6>");
+		CHECK(parser.parse(converter, out, csv.end()));
+		CHECK(converter.xml == xml);
+	}
+
+	// The fields of a skipped record are not counted
+	{
+		std::string const counted = "a,b\r\nc,\"d\"x\r\ne,f\r\n";
+		std::vector<char> copy(counted.begin(), counted.end());
+		csv_recovering_parser converter;
+		CHECK(saxy::csv::parse(converter, copy.data(), copy.size(), saxy::csv::field_count::consistent()));
+		CHECK(converter.xml == "{[a][b]}{[c]<2@10>{[e][f]}");
+		CHECK(converter.error_count == 0);
+	}
+
+	// Whole records are passed to 'row', and none for a skipped record
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		struct {
+			std::string rows;
+
+			saxy::always_keep_going row(saxy::string_view const* fields, std::size_t count) {
+				rows += std::to_string(count) + fields[0].to_string();
+				return saxy::keep_going;
+			}
+
+			saxy::always_keep_going bad_record(saxy::csv::error_code, std::size_t) {
+				rows += '!';
+				return saxy::keep_going;
+			}
+
+			saxy::always_abort error(saxy::csv::error_code) {
+				return saxy::abort;
+			}
+		} rows;
+		CHECK(saxy::csv::parse(rows, copy.data(), copy.size()));
+		CHECK(rows.rows == "2a!!!2k");
+	}
+}
+
+struct csv_locating_parser : csv_test_parser {
+	saxy::csv::error_position position;
+
+	saxy::always_abort error(saxy::csv::error_code e, saxy::csv::error_position const& p) {
+		++error_count;
+		csv_error = e;
+		position = p;
+		return saxy::abort;
+	}
+};
+
+void check_located(csv_locating_parser const& converter, saxy::csv::error_code e,
+                   std::size_t row, std::size_t field, std::size_t column, std::size_t offset) {
+	CHECK(converter.error_count == 1);
+	CHECK(converter.csv_error == e);
+	CHECK(converter.position.row == row);
+	CHECK(converter.position.field == field);
+	CHECK(converter.position.column == column);
+	CHECK(converter.position.offset == offset);
+}
+
+void check_position(std::string const& csv, saxy::csv::field_count count, saxy::csv::encoding enc, saxy::csv::error_code e,
+                    std::size_t row, std::size_t field, std::size_t column, std::size_t offset) {
+	INFO("csv = " << csv);
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_locating_parser converter;
+		CHECK(!saxy::csv::parse(converter, copy.data(), copy.size(), count, 0, enc));
+		check_located(converter, e, row, field, column, offset);
+	}
+
+	// The offset is the same one that validation finds
+	if(e != saxy::csv::wrong_field_count) {
+		CHECK(saxy::csv::validate(csv.data(), csv.size(), enc).error_offset == offset);
+	}
+
+	// The stateful parsers give the same position however the input is
+	// split between calls
+	for(std::size_t i = 0; i <= csv.size(); ++i) {
+		INFO("split = " << i);
+		{
+			saxy::csv::parser<> parser;
+			parser.set_field_count(count);
+			parser.set_encoding(enc);
+			csv_locating_parser converter;
+			CHECK(!(parser.parse(converter, csv.data(), csv.data() + i)
+			     && parser.parse(converter, csv.data() + i, csv.data() + csv.size())
+			     && parser.finish(converter)));
+			check_located(converter, e, row, field, column, offset);
+		}
+
+		{
+			std::list<char> const list(csv.begin(), csv.end());
+			std::list<char>::const_iterator middle = list.begin();
+			std::advance(middle, i);
+			saxy::csv::parser<> parser;
+			parser.set_field_count(count);
+			parser.set_encoding(enc);
+			csv_locating_parser converter;
+			CHECK(!(parser.parse(converter, list.begin(), middle)
+			     && parser.parse(converter, middle, list.end())
+			     && parser.finish(converter)));
+			check_located(converter, e, row, field, column, offset);
+		}
+
+		{
+			std::vector<char> copy(csv.begin(), csv.end());
+			saxy::csv::in_place_parser parser(copy.data(), copy.size(), count, enc);
+			csv_locating_parser converter;
+			CHECK(!(parser.parse(converter, i)
+			     && parser.parse(converter)
+			     && parser.finish(converter)));
+			check_located(converter, e, row, field, column, offset);
+		}
+	}
+
+	if(enc != saxy::csv::any_bytes || e == saxy::csv::wrong_field_count) {
+		return;
+	}
+
+	// Every other entry point takes neither a field count nor an encoding
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_locating_parser converter;
+		CHECK(!saxy::csv::parse(converter, saxy::csv::dfa_engine, copy.data(), copy.size()));
+		check_located(converter, e, row, field, column, offset);
+	}
+
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		copy.push_back('\0');
+		csv_locating_parser converter;
+		CHECK(!saxy::csv::parse(converter, copy.data()));
+		check_located(converter, e, row, field, column, offset);
+	}
+
+	{
+		saxy::padded_buffer buffer(csv.data(), csv.size());
+		csv_locating_parser converter;
+		CHECK(!saxy::csv::parse(converter, buffer));
+		check_located(converter, e, row, field, column, offset);
+	}
+
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		saxy::csv::statistics stats;
+		csv_locating_parser converter;
+		CHECK(!saxy::csv::parse(converter, stats, copy.data(), copy.size()));
+		check_located(converter, e, row, field, column, offset);
+	}
+
+	{
+		saxy::padded_buffer buffer(csv.data(), csv.size());
+		saxy::csv::statistics stats;
+		csv_locating_parser converter;
+		CHECK(!saxy::csv::parse(converter, stats, buffer));
+		check_located(converter, e, row, field, column, offset);
+	}
+}
+
+TEST_CASE("CSV errors can be given their position", "[csv]") {
+	saxy::csv::field_count const any = saxy::csv::field_count::any();
+	check_position("a,b\r\nc,\"d\"x,e\r\n", any, saxy::csv::any_bytes, saxy::csv::text_after_closing_quotes, 1, 1, 5, 10);
+	check_position("a,b\r\nc,d\"\r\n", any, saxy::csv::any_bytes, saxy::csv::misplaced_double_quotes, 1, 1, 3, 8);
+	check_position("a\r\n\r\n", any, saxy::csv::any_bytes, saxy::csv::no_fields_in_record, 1, 0, 1, 4);
+	check_position("\"\r\n\r\n\"\r\n\"a\"\rb", any, saxy::csv::any_bytes, saxy::csv::unfinished_crlf, 1, 0, 4, 12);
+	check_position("\"x\r\ny\",z\"\r\n", any, saxy::csv::any_bytes, saxy::csv::misplaced_double_quotes, 0, 1, 8, 8);
+	check_position("a\r\n\"b,\r\nc", any, saxy::csv::any_bytes, saxy::csv::unclosed_quote, 1, 0, 6, 9);
+	check_position("a,b\r\nc,\xff\r\n", any, saxy::csv::utf8, saxy::csv::invalid_utf8, 1, 1, 2, 7);
+	check_position("a,b\r\nc,d,e\r\n", saxy::csv::field_count::consistent(), saxy::csv::any_bytes, saxy::csv::wrong_field_count, 1, 1, 3, 8);
+
+	// Records passed whole to 'row' are still counted
+	{
+		std::string const csv = "a,b\r\nc,d\r\ne\"\r\n";
+		std::vector<char> copy(csv.begin(), csv.end());
+		struct {
+			std::size_t rows;
+			saxy::csv::error_position position;
+
+			saxy::always_keep_going row(saxy::string_view const*, std::size_t) {
+				++rows;
+				return saxy::keep_going;
+			}
+
+			saxy::always_abort error(saxy::csv::error_code, saxy::csv::error_position const& p) {
+				position = p;
+				return saxy::abort;
+			}
+		} rows = {};
+		char* out = 0;
+		CHECK(!saxy::csv::parse(rows, copy.data(), copy.size(), &out));
+		CHECK(out - copy.data() == 12);
+		CHECK(rows.rows == 2);
+		CHECK(rows.position.row == 2);
+		CHECK(rows.position.field == 0);
+		CHECK(rows.position.column == 1);
+		CHECK(rows.position.offset == 11);
+	}
+
+	// Skipped records are counted as rows, and both kinds of offset count
+	// from the start of the whole input
+	{
+		std::string const csv = "a\"\r\nb,c\r\n\"d\r\n";
+		struct recovering : csv_locating_parser {
+			std::vector<std::size_t> offsets;
+
+			saxy::always_keep_going bad_record(saxy::csv::error_code, std::size_t offset) {
+				offsets.push_back(offset);
+				return saxy::keep_going;
+			}
+		};
+
+		for(std::size_t i = 0; i <= csv.size(); ++i) {
+			INFO("split = " << i);
+			saxy::csv::parser<> parser;
+			recovering converter;
+			CHECK(!(parser.parse(converter, csv.begin(), csv.begin() + i)
+			     && parser.parse(converter, csv.begin() + i, csv.end())
+			     && parser.finish(converter)));
+			CHECK(converter.offsets == std::vector<std::size_t>(1, 1));
+			check_located(converter, saxy::csv::unclosed_quote, 2, 0, 4, 13);
+		}
+	}
+}
+
+struct csv_chunking_parser : csv_test_parser {
+	csv_chunking_parser() {
+	}
+
+	csv_chunking_parser(what_to_do what, int i)
+	: csv_test_parser(what, i) {
+	}
+
+	saxy::command field_chunk(saxy::string_cview str, bool last) {
+		xml += '(';
+		xml.append(str.data(), str.size());
+		xml += last ? ")]" : ")";
+		return return_helper();
+	}
+};
+
+struct csv_chunk_counter {
+	std::size_t fields;
+	std::size_t chunks;
+
+	saxy::always_keep_going start_row() {
+		return saxy::keep_going;
+	}
+
+	saxy::always_keep_going field(saxy::string_cview) {
+		++fields;
+		return saxy::keep_going;
+	}
+
+	saxy::always_keep_going field_chunk(saxy::string_cview, bool) {
+		++chunks;
+		return saxy::keep_going;
+	}
+
+	saxy::always_keep_going end_row() {
+		return saxy::keep_going;
+	}
+
+	saxy::always_abort error(saxy::csv::error_code) {
+		return saxy::abort;
+	}
+};
+
+std::size_t counted_bytes = 0;
+std::size_t counted_peak = 0;
+
+template <typename T>
+struct counting_allocator : std::allocator<T> {
+	template <typename U>
+	struct rebind {
+		typedef counting_allocator<U> other;
+	};
+
+	counting_allocator() {
+	}
+
+	template <typename U>
+	counting_allocator(counting_allocator<U> const&) {
+	}
+
+	T* allocate(std::size_t n) {
+		counted_bytes += n * sizeof(T);
+		counted_peak = std::max(counted_peak, counted_bytes);
+		return std::allocator<T>::allocate(n);
+	}
+
+	void deallocate(T* p, std::size_t n) {
+		counted_bytes -= n * sizeof(T);
+		std::allocator<T>::deallocate(p, n);
+	}
+};
+
+/// Turn the output of a csv_chunking_parser into that of a csv_test_parser.
+std::string join_chunks(std::string const& xml) {
+	std::string joined;
+	for(std::size_t i = 0; i < xml.size(); ++i) {
+		if(xml[i] == '(') {
+			if(i == 0 || xml[i - 1] != ')') {
+				joined += '[';
+			}
+		} else if(xml[i] != ')') {
+			joined += xml[i];
+		}
+	}
+
+	return joined;
+}
+
+TEST_CASE("CSV fields can be passed on in chunks", "[csv]") {
+	std::string const csv = "x,\"abc\"\"defghi\"\r\nj,abcdefgh\r\n";
+	std::string const xml = "{[x](abc\")(defg)(hi)]}{[j](abcd)(efgh)()]}";
+
+	{
+		csv_chunking_parser converter;
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		CHECK(parser.parse(converter, csv.begin(), csv.end()));
+		CHECK(parser.finish(converter));
+		CHECK(converter.xml == xml);
+	}
+
+	{
+		csv_chunking_parser converter;
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		CHECK(parser.parse(converter, csv.c_str()));
+		CHECK(parser.finish(converter));
+		CHECK(converter.xml == xml);
+	}
+
+	// Where the input is split changes which fields are chunked, but the
+	// chunks still join up into the same fields
+	for(std::size_t i = 0; i < csv.size(); ++i) {
+		INFO("i = " << i);
+		csv_chunking_parser converter;
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		std::string::const_iterator const middle = csv.begin() + i;
+		CHECK(parser.parse(converter, csv.begin(), middle));
+		CHECK(parser.parse(converter, middle, csv.end()));
+		CHECK(parser.finish(converter));
+		CHECK(join_chunks(converter.xml) == "{[x][abc\"defghi]}{[j][abcdefgh]}");
+	}
+
+	// Forward iterators are stepped through a chunk at a time
+	{
+		std::list<char> const list(csv.begin(), csv.end());
+		csv_chunking_parser converter;
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		CHECK(parser.parse(converter, list.begin(), list.end()));
+		CHECK(parser.finish(converter));
+		CHECK(converter.xml == xml);
+	}
+
+	// Nothing is chunked by default, or for callbacks without 'field_chunk'
+	{
+		csv_chunking_parser converter;
+		saxy::csv::parser<> parser;
+		CHECK(parser.parse(converter, csv.begin(), csv.end()));
+		CHECK(converter.xml == "{[x][abc\"defghi]}{[j][abcdefgh]}");
+
+		csv_test_parser plain;
+		parser.set_chunk_size(4);
+		CHECK(parser.parse(plain, csv.begin(), csv.end()));
+		CHECK(plain.xml == converter.xml);
+	}
+
+	// Callbacks that can only keep going
+	{
+		csv_chunk_counter counter = {};
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		CHECK(parser.parse(counter, csv.begin(), csv.end()));
+		CHECK(counter.fields == 2);
+		CHECK(counter.chunks == 6);
+	}
+
+	// Parsing can stop in 'field_chunk' and carry on
+	{
+		csv_chunking_parser converter(csv_test_parser::stop, 3);
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		std::string::const_iterator out;
+		CHECK(parser.parse(converter, csv.begin(), csv.end(), &out));
+		CHECK(out - csv.begin() == 12);
+		CHECK(converter.xml == "{[x](abc\")(defg)");
+		CHECK(parser.parse(converter, out, csv.end()));
+		CHECK(converter.xml == xml);
+	}
+
+	// A chunked field that ends in an error does not leave the next field
+	// looking chunked
+	{
+		std::string const bad = "\"abcdefgh\"x\r\n";
+		csv_chunking_parser converter;
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		CHECK(!parser.parse(converter, bad.begin(), bad.end()));
+		CHECK(converter.csv_error == saxy::csv::text_after_closing_quotes);
+		CHECK(converter.xml == "{(abcd)");
+
+		std::string const short_bad = "\"ab\"x\r\n";
+		csv_chunking_parser other_converter;
+		saxy::csv::parser<> other;
+		other.set_chunk_size(4);
+		CHECK(!other.parse(other_converter, short_bad.begin(), short_bad.end()));
+		bool const same = parser == other;
+		CHECK(same);
+	}
+
+	// A chunked field that ends in an error whose position is passed on
+	// does not leave the next field looking chunked
+	{
+		struct locating_chunker : csv_chunking_parser {
+			saxy::csv::error_position position;
+
+			saxy::always_abort error(saxy::csv::error_code e, saxy::csv::error_position const& p) {
+				csv_error = e;
+				position = p;
+				return saxy::abort;
+			}
+		};
+
+		std::string const bad = "\"abcdefgh\"x\r\n";
+		locating_chunker converter;
+		saxy::csv::parser<> parser;
+		parser.set_chunk_size(4);
+		CHECK(!parser.parse(converter, bad.begin(), bad.end()));
+		CHECK(converter.csv_error == saxy::csv::text_after_closing_quotes);
+		CHECK(converter.position.offset == 10);
+		CHECK(converter.position.column == 10);
+		CHECK(converter.xml == "{(abcd)");
+
+		std::string const short_bad = "\"ab\"x\r\n";
+		csv_chunking_parser other_converter;
+		saxy::csv::parser<> other;
+		other.set_chunk_size(4);
+		CHECK(!other.parse(other_converter, short_bad.begin(), short_bad.end()));
+		bool const same = parser == other;
+		CHECK(same);
+	}
+}
+
+TEST_CASE("CSV field memory is bounded", "[csv]") {
+	std::string const big = "a,\"" + std::string(100000, 'b') + "\"\r\nc\r\n";
+
+	// Without a limit the memory for the largest field is kept
+	{
+		counted_bytes = 0;
+		csv_test_parser converter;
+		saxy::csv::parser<counting_allocator> parser;
+		CHECK(parser.parse(converter, big.begin(), big.end()));
+		CHECK(counted_bytes > 100000);
+	}
+
+	{
+		counted_bytes = 0;
+		csv_test_parser converter;
+		saxy::csv::parser<counting_allocator> parser;
+		parser.set_max_capacity(64);
+		CHECK(parser.parse(converter, big.begin(), big.end()));
+		CHECK(counted_bytes == 0);
+		CHECK(converter.xml == "{[a][" + std::string(100000, 'b') + "]}{[c]}");
+	}
+
+	// With chunks the field is never held in full
+	{
+		counted_bytes = 0;
+		counted_peak = 0;
+		csv_chunking_parser converter;
+		saxy::csv::parser<counting_allocator> parser;
+		parser.set_chunk_size(1000);
+		CHECK(parser.parse(converter, big.begin(), big.end()));
+		CHECK(counted_peak < 4000);
+		CHECK(join_chunks(converter.xml) == "{[a][" + std::string(100000, 'b') + "]}{[c]}");
+	}
+}
+
+TEST_CASE("CSV engines agree", "[csv]") {
+	// Every string of up to 7 structural bytes, then longer random strings
+	// so that fields and quotes cross 64-byte blocks
+	char const alphabet[] = {'a', ',', '"', '\r', '\n'};
+	std::vector<std::string> inputs;
+	inputs.push_back(std::string());
+	for(std::size_t begin = 0; inputs.back().size() < 7; ) {
+		std::size_t const end = inputs.size();
+		for(std::size_t i = begin; i != end; ++i) {
+			for(char c : alphabet) {
+				inputs.push_back(inputs[i] + c);
+			}
+		}
+
+		begin = end;
+	}
+
+	unsigned seed = 12345;
+	for(int i = 0; i != 2000; ++i) {
+		std::string csv;
+		std::size_t const length = 1 + (seed = seed * 1103515245 + 12345) % 300;
+		while(csv.size() < length) {
+			seed = seed * 1103515245 + 12345;
+			unsigned const r = (seed >> 16) % 32;
+			csv += r < 5 ? alphabet[r] : static_cast<char>('a' + r);
+		}
+
+		inputs.push_back(csv);
+	}
+
+	for(std::string const& csv : inputs) {
+		INFO("Input: " << csv);
+		std::vector<char> expected_copy(csv.begin(), csv.end());
+		std::vector<char> actual_copy(csv.begin(), csv.end());
+		char* expected_out = 0;
+		char* actual_out = 0;
+		csv_test_parser expected;
+		csv_test_parser actual;
+		bool const expected_result = saxy::csv::parse(expected, saxy::csv::state_machine_engine, expected_copy.data(), expected_copy.size(), &expected_out);
+		bool const actual_result = saxy::csv::parse(actual, saxy::csv::dfa_engine, actual_copy.data(), actual_copy.size(), &actual_out);
+		REQUIRE(actual_result == expected_result);
+		REQUIRE(actual.xml == expected.xml);
+		REQUIRE(actual.csv_error == expected.csv_error);
+		REQUIRE(actual_out - actual_copy.data() == expected_out - expected_copy.data());
+
+		// Stopping leaves the output at the same place, although only the
+		// DFA engine returns straight away
+		for(int i = 0; expected_result && i != expected.function_calls; ++i) {
+			std::vector<char> expected_stop_copy(csv.begin(), csv.end());
+			std::vector<char> actual_stop_copy(csv.begin(), csv.end());
+			csv_test_parser expected_stop(csv_test_parser::stop, i);
+			csv_test_parser actual_stop(csv_test_parser::stop, i);
+			saxy::csv::parse(expected_stop, saxy::csv::state_machine_engine, expected_stop_copy.data(), expected_stop_copy.size(), &expected_out);
+			CHECK(saxy::csv::parse(actual_stop, saxy::csv::dfa_engine, actual_stop_copy.data(), actual_stop_copy.size(), &actual_out));
+			REQUIRE(actual_out - actual_stop_copy.data() == expected_out - expected_stop_copy.data());
+			REQUIRE(expected_stop.xml.compare(0, actual_stop.xml.size(), actual_stop.xml) == 0);
+		}
+	}
+}
+
+TEST_CASE("Schema inference", "[csv]") {
+	std::string const csv =
+		"id,price,ratio,day,name,empty\r\n"
+		"1,12.50,1.5e-3,2015-01-31,apple,\r\n"
+		"-2,3,2E10,2015-02-01T09:30:00,\"pear, green\",\r\n"
+		"+3,,-1e+2,,banana,\r\n"
+		"40,0.1,7,01/02/2015,1-2,\r\n";
+
+	std::vector<saxy::csv::column_schema> const schema = saxy::csv::infer_schema(csv.data(), csv.size());
+	REQUIRE(schema.size() == 6);
+
+	CHECK(schema[0].name == "id");
+	CHECK(schema[0].type == saxy::csv::integer_type);
+	CHECK(schema[0].max_width == 2);
+	CHECK(schema[0].null_count == 0);
+	CHECK(schema[0].sample_count == 4);
+
+	CHECK(schema[1].name == "price");
+	CHECK(schema[1].type == saxy::csv::decimal_type);
+	CHECK(schema[1].max_width == 5);
+	CHECK(schema[1].null_count == 1);
+	CHECK(schema[1].null_rate() == 0.25);
+
+	CHECK(schema[2].type == saxy::csv::float_type);
+	CHECK(schema[3].type == saxy::csv::date_type);
+	CHECK(schema[3].max_width == 19);
+	CHECK(schema[4].type == saxy::csv::string_type);
+	CHECK(schema[4].max_width == 11);
+	CHECK(schema[5].type == saxy::csv::unknown_type);
+	CHECK(schema[5].null_rate() == 1.0);
+}
+
+TEST_CASE("Schema inference checks where signs and separators are", "[csv]") {
+	struct {
+		int line;
+		char const* value;
+		saxy::csv::column_type type;
+	} const values[] = {
+		{ __LINE__, "-7", saxy::csv::integer_type },
+		{ __LINE__, ".5", saxy::csv::decimal_type },
+		{ __LINE__, "5.", saxy::csv::decimal_type },
+		{ __LINE__, "1e5", saxy::csv::float_type },
+		{ __LINE__, "-1.5E-3", saxy::csv::float_type },
+		{ __LINE__, "1/2/2015", saxy::csv::date_type },
+		{ __LINE__, "2015-1-2 09:30", saxy::csv::date_type },
+		{ __LINE__, "2015-01-02T09:30:00.25", saxy::csv::date_type },
+		{ __LINE__, "1e", saxy::csv::string_type },
+		{ __LINE__, "5-e3", saxy::csv::string_type },
+		{ __LINE__, "1-1e", saxy::csv::string_type },
+		{ __LINE__, "e5", saxy::csv::string_type },
+		{ __LINE__, "1e5.0", saxy::csv::string_type },
+		{ __LINE__, "1+2", saxy::csv::string_type },
+		{ __LINE__, "1.2.3", saxy::csv::string_type },
+		{ __LINE__, "-", saxy::csv::string_type },
+		{ __LINE__, ".", saxy::csv::string_type },
+		{ __LINE__, "555-12-34", saxy::csv::string_type },
+		{ __LINE__, "2015-01/02", saxy::csv::string_type },
+		{ __LINE__, "01-02-2015", saxy::csv::string_type },
+		{ __LINE__, "2015-01-02T9:30", saxy::csv::string_type },
+		{ __LINE__, "2015-01-02T09:30:00.", saxy::csv::string_type },
+		{ __LINE__, "2015-01-02 ", saxy::csv::string_type },
+	};
+
+	for(std::size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+		INFO("Line: " << values[i].line);
+		std::string const csv = std::string("v\r\n") + values[i].value + "\r\n";
+		std::vector<saxy::csv::column_schema> const schema = saxy::csv::infer_schema(csv.data(), csv.size());
+		REQUIRE(schema.size() == 1);
+		CHECK(schema[0].type == values[i].type);
+	}
+}
+
+TEST_CASE("Schema inference samples random offsets", "[csv]") {
+	std::string csv = "a,b\r\n";
+	for(int i = 0; i < 2000; ++i) {
+		if(i % 10 == 9) {
+			csv += std::to_string(i) + ".5,\r\n";
+		} else {
+			csv += std::to_string(i) + ",x" + std::to_string(i) + "\r\n";
+		}
+	}
+
+	saxy::csv::schema_options options;
+	options.head_bytes = 64;
+	options.seek_bytes = 64;
+	options.seeks = 100;
+
+	std::vector<saxy::csv::column_schema> const schema = saxy::csv::infer_schema(csv.data(), csv.size(), options);
+	REQUIRE(schema.size() == 2);
+	CHECK(schema[0].type == saxy::csv::decimal_type);
+	CHECK(schema[1].type == saxy::csv::string_type);
+	CHECK(schema[1].null_count > 0);
+	CHECK(schema[0].sample_count > 100);
+
+	std::istringstream in(csv);
+	std::vector<saxy::csv::column_schema> const stream_schema = saxy::csv::infer_schema(in, options);
+	REQUIRE(stream_schema.size() == 2);
+	CHECK(stream_schema[0].type == saxy::csv::decimal_type);
+	CHECK(stream_schema[0].sample_count == schema[0].sample_count);
+	CHECK(stream_schema[1].null_count == schema[1].null_count);
+
+	std::istringstream prefixed("skipped\r\n" + csv);
+	prefixed.seekg(9);
+	std::vector<saxy::csv::column_schema> const prefixed_schema = saxy::csv::infer_schema(prefixed, options);
+	REQUIRE(prefixed_schema.size() == 2);
+	CHECK(prefixed_schema[0].name == "a");
+	CHECK(prefixed_schema[0].sample_count == schema[0].sample_count);
+	CHECK(prefixed_schema[1].null_count == schema[1].null_count);
+}
+
+TEST_CASE("Schema inference skips windows that do not parse", "[csv]") {
+	std::string csv = "a,b\r\n";
+	for(int i = 0; i < 200; ++i) {
+		csv += "1,\"x\r\n2.5,y\r\n4,w\"\"\"\r\n";
+	}
+
+	saxy::csv::schema_options options;
+	options.head_bytes = 5;
+	options.seek_bytes = 64;
+	options.seeks = 100;
+
+	std::vector<saxy::csv::column_schema> const schema = saxy::csv::infer_schema(csv.data(), csv.size(), options);
+	REQUIRE(schema.size() == 2);
+	CHECK(schema[0].type == saxy::csv::integer_type);
+	CHECK(schema[1].type == saxy::csv::string_type);
+	CHECK(schema[0].sample_count > 0);
+}
+
+TEST_CASE("CSV validation", "[csv]") {
+	{
+		std::string const csv = "a,b,c\r\n\"d\"\"\",e\r\nf,\"g\r\nh\",i,j";
+		saxy::csv::validation const result = saxy::csv::validate(csv.data(), csv.size());
+		CHECK(result.error == saxy::csv::none);
+		CHECK(result.rows == 3);
+		CHECK(result.fields == 9);
+		CHECK(result.min_fields == 2);
+		CHECK(result.max_fields == 4);
+	}
+
+	struct {
+		int line;
+		char const* str;
+		saxy::csv::error_code error;
+		std::size_t offset;
+		std::size_t rows;
+	} const errors[] = {
+		{ __LINE__, "a,b\r\nmisplaced \"quotes\"\r\n", saxy::csv::misplaced_double_quotes, 15, 1 },
+		{ __LINE__, "\"field\" bad text", saxy::csv::text_after_closing_quotes, 7, 0 },
+		{ __LINE__, "a,\"b\"\rc,d", saxy::csv::unfinished_crlf, 6, 0 },
+		{ __LINE__, "a\r\n\"b", saxy::csv::unclosed_quote, 5, 1 },
+		{ __LINE__, "", saxy::csv::no_fields_in_record, 0, 0 },
+		{ __LINE__, "a\r\n\r\n", saxy::csv::no_fields_in_record, 4, 1 },
+	};
+
+	for(std::size_t i = 0; i < sizeof(errors) / sizeof(errors[0]); ++i) {
+		INFO("Line: " << errors[i].line);
+		saxy::csv::validation const result = saxy::csv::validate(errors[i].str, std::strlen(errors[i].str));
+		CHECK(result.error == errors[i].error);
+		CHECK(result.error_offset == errors[i].offset);
+		CHECK(result.rows == errors[i].rows);
+	}
+}
+
+TEST_CASE("CSV field counts are enforced", "[csv]") {
+	struct {
+		int line;
+		char const* str;
+		std::size_t fields;
+		char const* xml;
+		bool valid;
+	} const cases[] = {
+		{ __LINE__, "a,b\r\nc,d\r\n",    0, "{[a][b]}{[c][d]}", true },
+		{ __LINE__, "a,b\r\nc,d",        0, "{[a][b]}{[c][d]}", true },
+		{ __LINE__, "a,b\r\nc\r\n",      0, "{[a][b]}{",        false },
+		{ __LINE__, "a,b\r\nc",          0, "{[a][b]}{",        false },
+		{ __LINE__, "a,b\r\nc,d,e\r\n",  0, "{[a][b]}{[c]",     false },
+		{ __LINE__, "a,b,c\r\n",         3, "{[a][b][c]}",      true },
+		{ __LINE__, "a,b\r\n",           3, "{[a]",             false },
+		{ __LINE__, "\"a\",\"b\"\r\nc\r\n", 2, "{[a][b]}{",     false },
+	};
+
+	for(std::size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		std::string const csv = cases[i].str;
+		saxy::csv::field_count const count = cases[i].fields ? saxy::csv::field_count::exactly(cases[i].fields)
+		                                                     : saxy::csv::field_count::consistent();
+		{
+			INFO("Testing static parse, line: " << cases[i].line);
+			std::vector<char> copy(csv.begin(), csv.end());
+			csv_test_parser converter;
+			char* out = 0;
+			CHECK(saxy::csv::parse(converter, copy.data(), copy.size(), count, &out) == cases[i].valid);
+			CHECK((!cases[i].valid || out == copy.data() + copy.size()));
+			CHECK(converter.xml == cases[i].xml);
+			CHECK(converter.csv_error == (cases[i].valid ? saxy::csv::none : saxy::csv::wrong_field_count));
+		}
+
+		// in_place_parser has no finish() so the last record is only checked
+		// if it ends with CRLF
+		bool const needs_finish = csv.compare(csv.size() - 2, 2, "\r\n") != 0;
+		for(std::string::size_type j = 0; j < csv.size(); ++j) {
+			INFO("Testing in place parser, line: " << cases[i].line << ", j = " << j);
+			std::vector<char> copy(csv.begin(), csv.end());
+			csv_test_parser converter;
+			saxy::csv::in_place_parser parser(copy.data(), copy.size(), count);
+			CHECK((parser.parse(converter, j) && parser.parse(converter)) == (cases[i].valid || needs_finish));
+		}
+
+		for(std::string::size_type j = 0; j < csv.size(); ++j) {
+			INFO("Testing parser, line: " << cases[i].line << ", j = " << j);
+			csv_test_parser converter;
+			saxy::csv::parser<> parser;
+			parser.set_field_count(count);
+			std::string::const_iterator const middle = csv.begin() + j;
+			CHECK((parser.parse(converter, csv.begin(), middle) && parser.parse(converter, middle, csv.end())
+			       && parser.finish(converter)) == cases[i].valid);
+			CHECK(converter.csv_error == (cases[i].valid ? saxy::csv::none : saxy::csv::wrong_field_count));
+			if(cases[i].valid) {
+				CHECK(parser.expected_fields() == (cases[i].fields ? cases[i].fields : 2u));
+			}
+		}
+	}
+}
+
+struct csv_column_parser {
+	std::string xml;
+
+	saxy::command start_row() {
+		xml += '{';
+		return saxy::keep_going;
+	}
+
+	saxy::command field(std::size_t column, saxy::string_cview str) {
+		xml += '[';
+		xml += static_cast<char>('0' + column);
+		xml += ':';
+		xml.append(str.data(), str.size());
+		xml += ']';
+		return saxy::keep_going;
+	}
+
+	saxy::command end_row() {
+		xml += '}';
+		return saxy::keep_going;
+	}
+
+	saxy::always_abort error(saxy::csv::error_code) {
+		return saxy::abort;
+	}
+};
+
+TEST_CASE("CSV header lookup", "[csv]") {
+	std::vector<std::string> names;
+	for(int i = 0; i < 200; ++i) {
+		names.push_back("column" + std::to_string(i));
+	}
+	names.push_back("column7");
+
+	saxy::csv::header const header(names.begin(), names.end());
+	CHECK(header.size() == 201);
+	for(std::size_t i = 0; i < 200; ++i) {
+		CHECK(header.find(names[i]) == i);
+		CHECK(header[i] == names[i]);
+	}
+
+	CHECK(header.find("column7") == 7);
+	CHECK(header.find("column200") == saxy::csv::header::npos);
+	CHECK(header.find("") == saxy::csv::header::npos);
+	CHECK(saxy::csv::header().find("a") == saxy::csv::header::npos);
+}
+
+TEST_CASE("CSV header callbacks", "[csv]") {
+	std::string const csv = "id,name,price\r\n1,apple,2\r\n2,pear,3\r\n";
+
+	{
+		csv_column_parser converter;
+		saxy::csv::header_callback<csv_column_parser> cb(converter);
+		saxy::csv::parser<> parser;
+		CHECK(parser.parse(cb, csv.begin(), csv.end()));
+		CHECK(converter.xml == "{[0:1][1:apple][2:2]}{[0:2][1:pear][2:3]}");
+		REQUIRE(cb.get_header().size() == 3);
+		CHECK(cb.get_header().find("price") == 2);
+	}
+
+	for(std::string::size_type i = 0; i < csv.size(); ++i) {
+		INFO("i = " << i);
+		char const* wanted[] = { "price", "missing", "id" };
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_column_parser converter;
+		saxy::csv::header_callback<csv_column_parser> cb(converter, wanted, wanted + 3);
+		saxy::csv::in_place_parser parser(copy.data(), copy.size());
+		CHECK(parser.parse(cb, i));
+		CHECK(parser.parse(cb));
+		CHECK(converter.xml == "{[2:1][0:2]}{[2:2][0:3]}");
+	}
+}
+
+TEST_CASE("CSV UTF-8 validation", "[csv]") {
+	struct {
+		int line;
+		char const* str;
+		std::size_t offset;
+	} const cases[] = {
+		{ __LINE__, "caf\xC3\xA9,\xE2\x82\xAC\r\n", 0 },
+		{ __LINE__, "\"\xF0\x9F\x98\x80\",\"a\"\"\xC3\xA9\"\r\n", 0 },
+		{ __LINE__, "0123456789abcdef\xE2\x82\xAC" "0123456789abcdef,0123456789\xC3\xA9" "abcdef\r\n", 0 },
+		{ __LINE__, "\"0123456789abcdef\xE2\x82\xAC" "0123456789abcdef\"\r\n", 0 },
+		{ __LINE__, "\"0123456789\xC3\xA9\"\"abcdef0123456789\"\r\n", 0 },
+		{ __LINE__, "a,\x80\r\n", 2 },
+		{ __LINE__, "a,\xC0\xAF\r\n", 2 },
+		{ __LINE__, "a,\xED\xA0\x80\r\n", 3 },
+		{ __LINE__, "a,\xF4\x90\x80\x80\r\n", 3 },
+		{ __LINE__, "a,\xF5\r\n", 2 },
+		{ __LINE__, "a,\xC3,b\r\n", 3 },
+		{ __LINE__, "\"\xE2\x82\"\r\n", 3 },
+		{ __LINE__, "\"0123456789\xE2\x82\"\"abcdef0123456789\"\r\n", 13 },
+		{ __LINE__, "0123456789abcdef0123456789\xE2\x82" "abcdef0123456789\r\n", 28 },
+		{ __LINE__, "a,\xC3", 3 },
+	};
+
+	for(std::size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		INFO("Line: " << cases[i].line);
+		std::string const csv = cases[i].str;
+		saxy::csv::error_code const expected = cases[i].offset ? saxy::csv::invalid_utf8 : saxy::csv::none;
+
+		saxy::csv::validation const result = saxy::csv::validate(csv.data(), csv.size(), saxy::csv::utf8);
+		CHECK(result.error == expected);
+		CHECK(result.error_offset == cases[i].offset);
+		CHECK(saxy::csv::validate(csv.data(), csv.size()).error == saxy::csv::none);
+
+		{
+			std::vector<char> copy(csv.begin(), csv.end());
+			csv_test_parser converter;
+			CHECK(saxy::csv::parse(converter, copy.data(), copy.size(), saxy::csv::field_count::any(), 0, saxy::csv::utf8) == !cases[i].offset);
+			CHECK(converter.csv_error == expected);
+		}
+
+		for(std::string::size_type j = 0; j < csv.size(); ++j) {
+			INFO("j = " << j);
+			csv_test_parser converter;
+			saxy::csv::parser<> parser;
+			parser.set_encoding(saxy::csv::utf8);
+			std::string::const_iterator const middle = csv.begin() + j;
+			std::string::const_iterator save = csv.begin();
+			bool const result = parser.parse(converter, csv.begin(), middle, &save)
+			                 && parser.parse(converter, middle, csv.end(), &save)
+			                 && parser.finish(converter);
+			CHECK(result == !cases[i].offset);
+			CHECK(converter.csv_error == expected);
+			if(!result && save != csv.end()) {
+				CHECK(static_cast<std::size_t>(save - csv.begin() - 1) == cases[i].offset);
+			}
+		}
+	}
+}
+
+TEST_CASE("CSV transcoding parser", "[csv]") {
+	std::string const utf8 = "a,\"b\r\n\xC3\xA9\"\"\"\r\n0123456789abcdef0123456789,\xE2\x82\xAC\r\n";
+	std::string const xml = "{[a][b\r\n\xC3\xA9\"]}{[0123456789abcdef0123456789][\xE2\x82\xAC]}";
+	std::string utf16("\xFF\xFE", 2);
+	for(std::size_t i = 0; i < utf8.size(); ++i) {
+		unsigned char const c = utf8[i];
+		if(c == 0xC3) {
+			utf16 += std::string("\xE9\0", 2);
+			++i;
+		} else if(c == 0xE2) {
+			utf16 += std::string("\xAC\x20", 2);
+			i += 2;
+		} else {
+			utf16 += utf8[i];
+			utf16 += '\0';
+		}
+	}
+
+	for(std::size_t i = 0; i <= utf16.size(); ++i) {
+		INFO("Split: " << i);
+		csv_test_parser converter;
+		saxy::csv::transcoding_parser parser;
+		CHECK(parser.parse(converter, utf16.data(), i));
+		CHECK(parser.parse(converter, utf16.data() + i, utf16.size() - i));
+		CHECK(parser.finish(converter));
+		CHECK(converter.xml == xml);
+		CHECK(parser.source_encoding() == saxy::transcoder::utf16le);
+	}
+
+	// A last record without a line break and stopping part way through
+	std::string const latin1 = "a,b\r\nc,\xE9";
+	for(int i = 0; i < 6; ++i) {
+		INFO("Stop at: " << i);
+		csv_test_parser converter(csv_test_parser::stop, i);
+		saxy::csv::transcoding_parser parser(saxy::transcoder::latin1);
+		CHECK(parser.parse(converter, latin1.data(), latin1.size()));
+		CHECK(parser.finish(converter));
+		if(i >= 4) {
+			// Stopping in the last record stops 'finish' too
+			CHECK(parser.finish(converter));
+		}
+		CHECK(converter.xml == "{[a][b]}{[c][\xC3\xA9]}");
+	}
+
+	// Records after the one that stopped are still parsed, wherever the
+	// input is split
+	std::string const records = "a\r\nb,\xE9\r\nc\r\n";
+	for(int i = 0; i < 10; ++i) {
+		for(std::size_t j = 0; j <= records.size(); ++j) {
+			INFO("Stop at: " << i << ", split: " << j);
+			csv_test_parser converter(csv_test_parser::stop, i);
+			saxy::csv::transcoding_parser parser(saxy::transcoder::latin1);
+			CHECK(parser.parse(converter, records.data(), j));
+			CHECK(parser.parse(converter, records.data() + j, records.size() - j));
+			CHECK(parser.finish(converter));
+			if(converter.xml != "{[a]}{[b][\xC3\xA9]}{[c]}") {
+				CHECK(parser.finish(converter));
+			}
+			CHECK(converter.xml == "{[a]}{[b][\xC3\xA9]}{[c]}");
+		}
+	}
+
+	{
+		csv_test_parser converter;
+		saxy::csv::transcoding_parser parser;
+		CHECK(!parser.finish(converter));
+		CHECK(converter.csv_error == saxy::csv::no_fields_in_record);
+	}
+
+	{
+		csv_test_parser converter;
+		saxy::csv::transcoding_parser parser;
+		CHECK(parser.parse(converter, "a\"b\r\n", 5));
+		CHECK(!parser.finish(converter));
+		CHECK(converter.csv_error == saxy::csv::misplaced_double_quotes);
+	}
+}
+
+TEST_CASE("CSV records are split at record boundaries", "[csv]") {
+	std::string csv;
+	std::set<std::size_t> boundaries;
+	for(int i = 0; i < 200; ++i) {
+		std::ostringstream row;
+		row << i << ",\"a\r\n" << std::string(i % 37, 'x') << "\"\"\",\"" << std::string(2 * (i % 5), '"') << "\"\r\n";
+		csv += row.str();
+		boundaries.insert(csv.size());
+	}
+
+	for(std::size_t parts = 0; parts < 20; ++parts) {
+		INFO("Parts: " << parts);
+		std::vector<std::size_t> const offsets = saxy::csv::split_records(csv.data(), csv.size(), parts);
+		REQUIRE(!offsets.empty());
+		CHECK(offsets.size() <= std::max<std::size_t>(parts, 1));
+		CHECK(offsets[0] == 0);
+		for(std::size_t i = 1; i < offsets.size(); ++i) {
+			CHECK(offsets[i - 1] < offsets[i]);
+			CHECK(boundaries.count(offsets[i]) == 1);
+			CHECK(offsets[i] < csv.size());
+		}
+	}
+
+	CHECK(saxy::csv::split_records("a,b", 3, 4) == std::vector<std::size_t>(1, 0));
+	CHECK(saxy::csv::split_records("\"a\r\nb\"\r\nc", 10, 4) == std::vector<std::size_t>({ 0, 8 }));
+}
+
+TEST_CASE("NUMA scheduler", "[csv]") {
+	std::string csv;
+	for(int i = 0; i < 1000; ++i) {
+		std::ostringstream row;
+		row << i << ",\"" << i * 7 << "\r\n\"\"\"\r\n";
+		csv += row.str();
+	}
+
+	std::string expected;
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_test_parser converter;
+		REQUIRE(saxy::csv::parse(converter, copy.data(), copy.size()));
+		expected = converter.xml;
+	}
+
+	saxy::numa_topology const simulated = saxy::numa_topology::simulated(2, 3);
+	CHECK(simulated.nodes() == 2);
+	CHECK(simulated.cpus(1) == std::vector<int>({ 3, 4, 5 }));
+
+	saxy::numa_topology const detected = saxy::numa_topology::detect();
+	CHECK(!detected.is_simulated());
+	CHECK(detected.nodes() >= 1);
+	CHECK(!detected.cpus(0).empty());
+
+	saxy::numa_scheduler const schedulers[] = {
+		saxy::numa_scheduler(simulated),
+		saxy::numa_scheduler(simulated, 1),
+		saxy::numa_scheduler(detected),
+		saxy::numa_scheduler(detected, 2),
+	};
+
+	std::size_t const workers[] = { 6, 2, 0, detected.nodes() * 2 };
+	for(std::size_t i = 0; i < sizeof(schedulers) / sizeof(schedulers[0]); ++i) {
+		INFO("Scheduler: " << i);
+		saxy::numa_scheduler const& scheduler = schedulers[i];
+		if(workers[i]) {
+			CHECK(scheduler.workers() == workers[i]);
+		}
+
+		std::vector<saxy::numa_scheduler::chunk> const chunks = scheduler.plan(csv.data(), csv.size());
+		CHECK(chunks.size() == scheduler.workers());
+		std::size_t offset = 0;
+		for(std::size_t j = 0; j < chunks.size(); ++j) {
+			CHECK(chunks[j].offset == offset);
+			CHECK(chunks[j].worker == j);
+			offset += chunks[j].length;
+		}
+
+		CHECK(offset == csv.size());
+		if(i < 2) {
+			CHECK(chunks.front().node == 0);
+			CHECK(chunks.back().node == 1);
+		}
+
+		std::vector<char> copy(csv.begin(), csv.end());
+		std::vector<csv_test_parser> results;
+		CHECK(scheduler.parse(copy.data(), copy.size(), results));
+		REQUIRE(results.size() == chunks.size());
+		std::string xml;
+		for(std::size_t j = 0; j < results.size(); ++j) {
+			xml += results[j].xml;
+		}
+
+		CHECK(xml == expected);
+	}
+
+	{
+		// Fewer chunks than workers still use every node
+		std::string const small = "a,b\r\nc,d\r\n";
+		std::vector<saxy::numa_scheduler::chunk> const chunks = saxy::numa_scheduler(simulated).plan(small.data(), small.size());
+		REQUIRE(chunks.size() == 2);
+		CHECK(chunks[0].worker == 0);
+		CHECK(chunks[0].node == 0);
+		CHECK(chunks[1].worker == 3);
+		CHECK(chunks[1].node == 1);
+	}
+
+	{
+		std::string bad = csv + "a\"b\r\n";
+		std::vector<csv_test_parser> results;
+		CHECK(!saxy::numa_scheduler(simulated).parse(&bad[0], bad.size(), results));
+		CHECK(results.back().csv_error == saxy::csv::misplaced_double_quotes);
+	}
+}
+
+TEST_CASE("MPMC queue", "[csv]") {
+	saxy::mpmc_queue<int> queue(3);
+	int value = 1;
+	for(int i = 0; i < 4; ++i) {
+		value = i;
+		CHECK(queue.try_push(value));
+	}
+
+	CHECK(!queue.try_push(value));
+	for(int i = 0; i < 4; ++i) {
+		CHECK(queue.try_pop(value));
+		CHECK(value == i);
+	}
+
+	CHECK(!queue.try_pop(value));
+
+	// Every value pushed by several threads is popped exactly once
+	int const per_thread = 10000;
+	std::atomic<long long> sum(0);
+	std::atomic<int> popped(0);
+	std::vector<std::thread> threads;
+	for(int t = 0; t < 3; ++t) {
+		threads.push_back(std::thread([&queue, t] {
+			for(int i = 1; i <= per_thread; ++i) {
+				int v = i * (t + 1);
+				while(!queue.try_push(v)) {
+					std::this_thread::yield();
+				}
+			}
+		}));
+		threads.push_back(std::thread([&queue, &sum, &popped] {
+			while(popped.load() < 3 * per_thread) {
+				int v = 0;
+				if(queue.try_pop(v)) {
+					sum += v;
+					++popped;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		}));
+	}
+
+	for(std::size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+
+	CHECK(sum.load() == 6LL * per_thread * (per_thread + 1) / 2);
+}
+
+namespace {
+
+struct batch_summary {
+	std::size_t first_row;
+	std::size_t rows;
+	std::string text;
+
+	batch_summary()
+	: first_row(0)
+	, rows(0) {
+	}
+};
+
+struct summarise {
+	batch_summary operator()(saxy::row_batch const& batch) const {
+		batch_summary summary;
+		summary.first_row = batch.first_row();
+		summary.rows = batch.rows();
+		for(std::size_t i = 0; i < batch.rows(); ++i) {
+			summary.text += '{';
+			for(std::size_t j = 0; j < batch.fields(i); ++j) {
+				summary.text += '[';
+				summary.text.append(batch.field(i, j).data(), batch.field(i, j).size());
+				summary.text += ']';
+			}
+			summary.text += '}';
+		}
+
+		return summary;
+	}
+};
+
+}
+
+TEST_CASE("CSV pipeline", "[csv]") {
+	std::string csv;
+	for(int i = 0; i < 5000; ++i) {
+		std::ostringstream row;
+		row << i << ",\"" << i % 13 << "\r\n\"\"\"" << (i % 7 ? ",x" : "") << "\r\n";
+		csv += row.str();
+	}
+
+	std::string expected;
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_test_parser converter;
+		REQUIRE(saxy::csv::parse(converter, copy.data(), copy.size()));
+		expected = converter.xml;
+	}
+
+	std::size_t const workers[] = { 1, 2, 4 };
+	std::size_t const batch_rows[] = { 1, 7, 1000, 10000 };
+	std::size_t const batches[] = { 1, 2, 0 };
+	for(std::size_t w = 0; w < 3; ++w) {
+		for(std::size_t r = 0; r < 4; ++r) {
+			for(std::size_t b = 0; b < 3; ++b) {
+				INFO("Workers: " << workers[w] << " rows: " << batch_rows[r] << " batches: " << batches[b]);
+				saxy::pipeline_options options;
+				options.workers = workers[w];
+				options.batch_rows = batch_rows[r];
+				options.batches = batches[b];
+
+				std::string xml;
+				std::size_t next_row = 0;
+				bool ordered = true;
+				auto consume = [&](batch_summary&& summary) {
+					ordered = ordered && summary.first_row == next_row;
+					next_row += summary.rows;
+					xml += summary.text;
+				};
+
+				CHECK(saxy::run_pipeline(csv.data(), csv.size(), summarise(), consume, options) == saxy::csv::none);
+				CHECK(ordered);
+				CHECK(next_row == 5000);
+				CHECK(xml == expected);
+			}
+		}
+	}
+
+	{
+		// Records before an error are still converted
+		std::string const bad = "a,b\r\nc\"d\r\ne\r\n";
+		std::string xml;
+		auto consume = [&](batch_summary&& summary) {
+			xml += summary.text;
+		};
+
+		saxy::pipeline_options options;
+		options.batch_rows = 1;
+		CHECK(saxy::run_pipeline(bad.data(), bad.size(), summarise(), consume, options) == saxy::csv::misplaced_double_quotes);
+		CHECK(xml == "{[a][b]}");
+	}
+
+	{
+		auto convert = [](saxy::row_batch const& batch) {
+			if(batch.first_row() >= 100) {
+				throw std::runtime_error("convert");
+			}
+
+			return batch.rows();
+		};
+
+		auto consume = [](std::size_t) {
+		};
+
+		saxy::pipeline_options options;
+		options.batch_rows = 10;
+		options.workers = 2;
+		CHECK_THROWS_AS(saxy::run_pipeline(csv.data(), csv.size(), convert, consume, options), std::runtime_error);
+	}
+
+	{
+		auto consume = [](batch_summary&&) {
+			throw std::logic_error("consume");
+		};
+
+		CHECK_THROWS_AS(saxy::run_pipeline(csv.data(), csv.size(), summarise(), consume), std::logic_error);
+	}
+}
+
+TEST_CASE("SPSC queue", "[csv]") {
+	saxy::spsc_queue<int> queue(2);
+	int value = 0;
+	CHECK(queue.try_push(value));
+	value = 1;
+	CHECK(queue.try_push(value));
+	CHECK(!queue.try_push(value));
+	CHECK(queue.try_pop(value));
+	CHECK(value == 0);
+	CHECK(queue.try_pop(value));
+	CHECK(value == 1);
+	CHECK(!queue.try_pop(value));
+
+	int const count = 100000;
+	bool ordered = true;
+	std::thread consumer([&queue, &ordered] {
+		for(int i = 0; i < count; ++i) {
+			int v = -1;
+			while(!queue.try_pop(v)) {
+				std::this_thread::yield();
+			}
+
+			ordered = ordered && v == i;
+		}
+	});
+
+	for(int i = 0; i < count; ++i) {
+		int v = i;
+		while(!queue.try_push(v)) {
+			std::this_thread::yield();
+		}
+	}
+
+	consumer.join();
+	CHECK(ordered);
+}
+
+TEST_CASE("Chunk handles", "[csv]") {
+	saxy::chunk_pool pool(2, 8);
+	CHECK(pool.chunks() == 2);
+	{
+		saxy::chunk_handle a = pool.acquire();
+		CHECK(a.capacity() == 8);
+		CHECK(a.use_count() == 1);
+		saxy::chunk_handle b;
+		CHECK(pool.try_acquire(b));
+		CHECK(!pool.try_acquire(b));
+		b = a;
+		CHECK(a.use_count() == 2);
+		saxy::chunk_handle c(std::move(b));
+		CHECK(!b);
+		CHECK(a.use_count() == 2);
+		c = saxy::chunk_handle();
+		CHECK(a.use_count() == 1);
+		saxy::chunk_handle d;
+		CHECK(pool.try_acquire(d));
+	}
+
+	saxy::chunk_handle a;
+	saxy::chunk_handle b;
+	CHECK(pool.try_acquire(a));
+	CHECK(pool.try_acquire(b));
+}
+
+TEST_CASE("CSV batches share chunks without copying", "[csv]") {
+	std::string csv;
+	for(int i = 0; i < 2000; ++i) {
+		std::ostringstream row;
+		row << i << ",\"" << std::string(i % 50, 'x') << "\r\n\"\"\"" << (i % 7 ? ",y" : "") << "\r\n";
+		csv += row.str();
+	}
+
+	std::string expected;
+	{
+		std::vector<char> copy(csv.begin(), csv.end());
+		csv_test_parser converter;
+		REQUIRE(saxy::csv::parse(converter, copy.data(), copy.size()));
+		expected = converter.xml;
+	}
+
+	std::size_t const chunk_sizes[] = { 16, 100, 4096 };
+	for(std::size_t s = 0; s < 3; ++s) {
+		INFO("Chunk size: " << chunk_sizes[s]);
+		saxy::chunk_pool pool(3, chunk_sizes[s]);
+		std::size_t const consumers = 2;
+		std::vector<std::unique_ptr<saxy::spsc_queue<saxy::view_batch> > > queues;
+		std::vector<std::map<std::size_t, std::string> > results(consumers);
+		std::vector<std::size_t> outside(consumers, 0);
+		std::atomic<bool> done(false);
+		for(std::size_t i = 0; i < consumers; ++i) {
+			queues.emplace_back(new saxy::spsc_queue<saxy::view_batch>(4));
+		}
+
+		std::vector<std::thread> threads;
+		for(std::size_t i = 0; i < consumers; ++i) {
+			threads.push_back(std::thread([&, i] {
+				for(;;) {
+					bool const finished = done.load();
+					saxy::view_batch batch;
+					if(!queues[i]->try_pop(batch)) {
+						if(finished) {
+							return;
+						}
+
+						std::this_thread::yield();
+						continue;
+					}
+
+					std::string& xml = results[i][batch.first_row()];
+					for(std::size_t r = 0; r < batch.rows(); ++r) {
+						xml += '{';
+						for(std::size_t f = 0; f < batch.fields(r); ++f) {
+							// Catch is not thread safe, so the check is made
+							// on the main thread after joining
+							saxy::string_cview const field = batch.field(r, f);
+							if(field.data() < batch.chunk().data()
+							|| field.data() + field.size() > batch.chunk().data() + batch.chunk().capacity()) {
+								++outside[i];
+							}
+
+							xml += '[';
+							xml.append(field.data(), field.size());
+							xml += ']';
+						}
+						xml += '}';
+					}
+				}
+			}));
+		}
+
+		std::size_t next = 0;
+		auto publish = [&](saxy::view_batch&& batch) {
+			saxy::spsc_queue<saxy::view_batch>& queue = *queues[next++ % consumers];
+			while(!queue.try_push(batch)) {
+				std::this_thread::yield();
+			}
+		};
+
+		std::istringstream in(csv);
+		CHECK(saxy::parse_into_batches(in, pool, 10, publish) == saxy::csv::none);
+		done = true;
+		for(std::size_t i = 0; i < threads.size(); ++i) {
+			threads[i].join();
+		}
+
+		std::map<std::size_t, std::string> all;
+		for(std::size_t i = 0; i < consumers; ++i) {
+			CHECK(outside[i] == 0);
+			all.insert(results[i].begin(), results[i].end());
+		}
+
+		std::string xml;
+		for(std::map<std::size_t, std::string>::const_iterator it = all.begin(); it != all.end(); ++it) {
+			xml += it->second;
+		}
+
+		CHECK(xml == expected);
+
+		// Every chunk has been released
+		saxy::chunk_handle handles[3];
+		for(std::size_t i = 0; i < 3; ++i) {
+			CHECK(pool.try_acquire(handles[i]));
+		}
+	}
+
+	{
+		saxy::chunk_pool pool(2, 8);
+		std::string xml;
+		auto publish = [&](saxy::view_batch&& batch) {
+			for(std::size_t r = 0; r < batch.rows(); ++r) {
+				xml += batch.field(r, 0).data()[0];
+			}
+		};
+
+		std::istringstream bad("a\r\nb\r\nc\"\r\n");
+		CHECK(saxy::parse_into_batches(bad, pool, 1, publish) == saxy::csv::misplaced_double_quotes);
+		CHECK(xml == "ab");
+
+		std::istringstream empty("");
+		CHECK(saxy::parse_into_batches(empty, pool, 1, publish) == saxy::csv::no_fields_in_record);
+
+		xml.clear();
+		std::istringstream last("a\r\nb");
+		CHECK(saxy::parse_into_batches(last, pool, 1, publish) == saxy::csv::none);
+		CHECK(xml == "ab");
+	}
+}
+
+TEST_CASE("CSV parse statistics", "[csv]") {
+	std::string const csv = "abc,\"x\"\"y\"\r\n" + std::string(40, 'z') + ",1\r\n";
+	std::string const xml = "{[abc][x\"y]}{[" + std::string(40, 'z') + "][1]}";
+	std::vector<char> copy(csv.begin(), csv.end());
+	saxy::csv::statistics stats;
+	csv_test_parser converter;
+	REQUIRE(saxy::csv::parse(converter, stats, copy.data(), copy.size()));
+	CHECK(converter.xml == xml);
+	CHECK(stats.total_bytes() == csv.size());
+	CHECK(stats.unquoted_bytes == 44);
+	CHECK(stats.quoted_bytes == 3);
+	CHECK(stats.structural_bytes == 9);
+#ifdef SAXY_SSE2
+	CHECK(stats.simd_blocks == 2);
+#else
+	CHECK(stats.simd_blocks == 4);
+#endif
+	CHECK(stats.simd_bytes >= 32);
+	CHECK(stats.simd_bytes < stats.total_bytes());
+#ifdef SAXY_SSE2
+	// The last 7 bytes of the long field are too few for a block
+	CHECK(stats.simd_fallbacks == 1);
+#else
+	CHECK(stats.simd_fallbacks == 0);
+#endif
+	CHECK(stats.state_changes > 2 * stats.fields);
+	CHECK(stats.quoted_fields == 1);
+	CHECK(stats.fields == 4);
+	CHECK(stats.rows == 2);
+	CHECK(stats.stops == 0);
+
+	// Counters accumulate, and stops requested by the callback are counted
+	copy.assign(csv.begin(), csv.end());
+	csv_test_parser stopper(csv_test_parser::stop, 1);
+	char* out = 0;
+	CHECK(saxy::csv::parse(stopper, stats, copy.data(), copy.size(), &out));
+	CHECK(out != copy.data() + copy.size());
+	CHECK(stats.stops == 1);
+	CHECK(stats.fields > 4);
+
+	// Records passed through 'row' are counted too
+	copy.assign(csv.begin(), csv.end());
+	saxy::csv::statistics row_stats;
+	std::size_t rows = 0;
+	struct {
+		std::size_t* rows;
+
+		saxy::always_keep_going row(saxy::string_view const*, std::size_t) {
+			++*rows;
+			return saxy::keep_going;
+		}
+
+		saxy::always_abort error(saxy::csv::error_code) {
+			return saxy::abort;
+		}
+	} row_counter = { &rows };
+	CHECK(saxy::csv::parse(row_counter, row_stats, copy.data(), copy.size()));
+	CHECK(rows == 2);
+	CHECK(row_stats.rows == 2);
+	CHECK(row_stats.fields == 4);
+
+	// Every entry point counts the same, except that the scalar code goes
+	// through more states for a doubled quote than the SIMD loops
+	saxy::csv::statistics expected;
+	copy.assign(csv.begin(), csv.end());
+	csv_test_parser counted;
+	CHECK(saxy::csv::parse(counted, expected, copy.data(), copy.size()));
+
+	{
+		saxy::csv::statistics cstr_stats;
+		copy.assign(csv.c_str(), csv.c_str() + csv.size() + 1);
+		csv_test_parser cstr;
+		CHECK(saxy::csv::parse(cstr, cstr_stats, copy.data()));
+		CHECK(cstr.xml == xml);
+		CHECK(cstr_stats.total_bytes() == csv.size());
+		CHECK(cstr_stats.fields == 4);
+		CHECK(cstr_stats.rows == 2);
+		CHECK(cstr_stats.state_changes >= expected.state_changes);
+	}
+
+	{
+		saxy::csv::statistics padded_stats;
+		saxy::padded_buffer buffer(csv.data(), csv.size());
+		csv_test_parser padded;
+		CHECK(saxy::csv::parse(padded, padded_stats, buffer));
+		CHECK(padded.xml == xml);
+		CHECK(padded_stats.total_bytes() == csv.size());
+		CHECK(padded_stats.fields == 4);
+		CHECK(padded_stats.rows == 2);
+		CHECK(padded_stats.state_changes >= expected.state_changes);
+	}
+
+	{
+		saxy::csv::statistics in_place_stats;
+		copy.assign(csv.begin(), csv.end());
+		csv_test_parser in_place;
+		saxy::csv::in_place_parser parser(copy.data(), copy.size());
+		CHECK(parser.parse(in_place, in_place_stats, 10));
+		CHECK(parser.parse(in_place, in_place_stats));
+		CHECK(parser.finish(in_place, in_place_stats));
+		CHECK(in_place.xml == xml);
+		CHECK(in_place_stats.total_bytes() == csv.size());
+		CHECK(in_place_stats.fields == 4);
+		CHECK(in_place_stats.rows == 2);
+		CHECK(in_place_stats.quoted_fields == 1);
+	}
+
+	// A last record without a line break is counted by 'finish'
+	for(std::size_t i = 0; i <= csv.size(); ++i) {
+		INFO("Split: " << i);
+		saxy::csv::statistics copying_stats;
+		csv_test_parser copying;
+		saxy::csv::parser<> parser;
+		std::string const input = csv + "a,b";
+		CHECK(parser.parse(copying, copying_stats, input.begin(), input.begin() + i));
+		CHECK(parser.parse(copying, copying_stats, input.begin() + i, input.end()));
+		CHECK(parser.finish(copying, copying_stats));
+		CHECK(copying_stats.total_bytes() == input.size());
+		CHECK(copying_stats.fields == 6);
+		CHECK(copying_stats.rows == 3);
+		CHECK(copying_stats.quoted_fields == 1);
+		CHECK(copying.xml == xml + "{[a][b]}");
+	}
+}
+
+TEST_CASE("CSV SIMD scanners only stop on structural characters", "[csv]") {
+	// Both fields are 48 bytes long, so every block is skipped in one go
+	std::string const text = "The quick brown fox! (jumps) #over & the lazy do";
+	std::string const quoted = "Flat 4; 12 Main St., Springfield\r\nSee: a&b #9 !!";
+	std::string const csv = text + ",\"" + quoted + "\"\r\n";
+	std::vector<char> copy(csv.begin(), csv.end());
+	saxy::csv::statistics stats;
+	csv_test_parser converter;
+	REQUIRE(saxy::csv::parse(converter, stats, copy.data(), copy.size()));
+	CHECK(converter.xml == "{[" + text + "][" + quoted + "]}");
+
+	// The first byte of the unquoted field is read by the scalar code and
+	// the final partial block of it stops at the comma
+#ifdef SAXY_SSE2
+	CHECK(stats.simd_blocks == 5);
+#else
+	CHECK(stats.simd_blocks == 11);
+#endif
+	CHECK(stats.simd_bytes == 47 + 48);
+	CHECK(stats.unquoted_bytes == 48);
+	CHECK(stats.quoted_bytes == 48);
+}
+
+TEST_CASE("CSV NUL-terminated input", "[csv]") {
+	std::string const csv = "The quick brown fox,\"jumps \"\"over\"\" the\r\nlazy dog\",\"\"\r\n"
+	                        "0123456789abcdefghijklmnopqrstuvwxyz,\"0123456789\"\"abcdef\"\r\n"
+	                        "a,\"\"\"\"\r\n"
+	                        "\"\"\"0123456789abcdefghijklmnopqrstuvwxyz\"";
+	std::string const xml = "{[The quick brown fox][jumps \"over\" the\r\nlazy dog][]}"
+	                        "{[0123456789abcdefghijklmnopqrstuvwxyz][0123456789\"abcdef]}"
+	                        "{[a][\"]}"
+	                        "{[\"0123456789abcdefghijklmnopqrstuvwxyz]}";
+
+	// Start the input at every alignment and end it at every prefix
+	std::vector<char> buffer(csv.size() + 32);
+	for(std::size_t offset = 0; offset < 16; ++offset) {
+		INFO("Offset: " << offset);
+		char* const start = buffer.data() + offset;
+		std::memcpy(start, csv.c_str(), csv.size() + 1);
+		csv_test_parser converter;
+		char* out = 0;
+		CHECK(saxy::csv::parse(converter, start, &out));
+		CHECK(out == start + csv.size());
+		CHECK(converter.xml == xml);
+
+		csv_test_parser copier;
+		saxy::csv::parser<> parser;
+		std::memcpy(start, csv.c_str(), csv.size() + 1);
+		CHECK(parser.parse(copier, start));
+		CHECK(parser.finish(copier));
+		CHECK(copier.xml == xml);
+	}
+
+	for(std::size_t length = 0; length < csv.size(); ++length) {
+		INFO("Length: " << length);
+		std::vector<char> expected(csv.begin(), csv.begin() + length);
+		csv_test_parser by_length;
+		bool const result = saxy::csv::parse(by_length, expected.data(), expected.size());
+
+		std::vector<char> terminated(csv.begin(), csv.begin() + length);
+		terminated.push_back('\0');
+		csv_test_parser by_nul;
+		CHECK(saxy::csv::parse(by_nul, terminated.data()) == result);
+		CHECK(by_nul.xml == by_length.xml);
+		CHECK(by_nul.csv_error == by_length.csv_error);
+	}
+
+#if defined __unix__
+	// A string that ends right before an inaccessible page is never read
+	// past its end
+	long const page = sysconf(_SC_PAGESIZE);
+	void* const pages = mmap(0, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	REQUIRE(pages != MAP_FAILED);
+	REQUIRE(mprotect(static_cast<char*>(pages) + page, page, PROT_NONE) == 0);
+	for(std::size_t tail = 1; tail < 40; ++tail) {
+		std::string const field = tail % 2 ? std::string(tail, 'x') : "\"" + std::string(tail, '"') + "\"";
+		char* const start = static_cast<char*>(pages) + page - field.size() - 1;
+		std::memcpy(start, field.c_str(), field.size() + 1);
+		csv_test_parser converter;
+		CHECK(saxy::csv::parse(converter, start));
+		CHECK(converter.error_count == 0);
+	}
+
+	munmap(pages, 2 * page);
+#endif
+}
+
+TEST_CASE("CSV iterator input", "[csv]") {
+	CHECK((std::is_same<saxy::detail::use_simd<std::string::const_iterator, std::string::const_iterator>::type, saxy::detail::simd>::value));
+	CHECK((std::is_same<saxy::detail::use_simd<std::vector<char>::iterator, std::vector<char>::iterator>::type, saxy::detail::simd>::value));
+	CHECK((std::is_same<saxy::detail::use_simd<std::deque<char>::iterator, std::deque<char>::iterator>::type, saxy::detail::swar>::value));
+	CHECK((std::is_same<saxy::detail::use_simd<std::list<char>::const_iterator, std::list<char>::const_iterator>::type, saxy::detail::swar>::value));
+	CHECK((std::is_same<saxy::detail::use_simd<std::istreambuf_iterator<char>, std::istreambuf_iterator<char> >::type, saxy::detail::no_simd>::value));
+
+	std::string const csv = "The quick brown fox,\"jumps \"\"over\"\" the\r\nlazy dog\",caf\xC3\xA9\r\n"
+	                        "0123456789abcdefghijklmnopqrstuvwxyz,\"0123456789,abcdef\",\"\"\r\n"
+	                        "a,\"\"\"\"\r\n";
+	std::string const xml = "{[The quick brown fox][jumps \"over\" the\r\nlazy dog][caf\xC3\xA9]}"
+	                        "{[0123456789abcdefghijklmnopqrstuvwxyz][0123456789,abcdef][]}"
+	                        "{[a][\"]}";
+
+	std::deque<char> const deque(csv.begin(), csv.end());
+	std::list<char> const list(csv.begin(), csv.end());
+	std::vector<char> const vector(csv.begin(), csv.end());
+	for(std::size_t i = 0; i <= csv.size(); ++i) {
+		INFO("i = " << i);
+		{
+			csv_test_parser converter;
+			saxy::csv::parser<> parser;
+			parser.set_encoding(saxy::csv::utf8);
+			std::deque<char>::const_iterator const middle = deque.begin() + i;
+			CHECK(parser.parse(converter, deque.begin(), middle));
+			CHECK(parser.parse(converter, middle, deque.end()));
+			CHECK(converter.xml == xml);
+		}
+
+		{
+			csv_test_parser converter;
+			saxy::csv::parser<> parser;
+			std::list<char>::const_iterator const middle = std::next(list.begin(), i);
+			CHECK(parser.parse(converter, list.begin(), middle));
+			CHECK(parser.parse(converter, middle, list.end()));
+			CHECK(converter.xml == xml);
+		}
+
+		{
+			csv_test_parser converter;
+			saxy::csv::parser<> parser;
+			std::vector<char>::const_iterator const middle = vector.begin() + i;
+			CHECK(parser.parse(converter, vector.begin(), middle));
+			CHECK(parser.parse(converter, middle, vector.end()));
+			CHECK(converter.xml == xml);
+		}
+	}
+
+	// Invalid UTF-8 found 8 bytes at a time is reported like any other
+	std::string const invalid = "0123456789abcdef\xC3" "0123456789abcdef\r\n";
+	std::deque<char> const bad(invalid.begin(), invalid.end());
+	csv_test_parser converter;
+	saxy::csv::parser<> parser;
+	parser.set_encoding(saxy::csv::utf8);
+	std::deque<char>::const_iterator out = bad.begin();
+	CHECK(!parser.parse(converter, bad.begin(), bad.end(), &out));
+	CHECK(converter.csv_error == saxy::csv::invalid_utf8);
+	CHECK(out - bad.begin() == 18);
+}
+
+TEST_CASE("CSV padded input", "[csv]") {
+	saxy::padded_buffer empty;
+	CHECK(empty.empty());
+	CHECK(empty.size() == 0);
+
+	std::string const csv = "id,name,note\r\n"
+	                        "1,ab,\"x\"\"y\"\r\n"
+	                        "2,The quick brown fox jumps,\"over, the\r\nlazy dog\"\r\n"
+	                        "3,,\"\"\"\"\r\n"
+	                        "4,\"abcdefghijklmnopqrstuvwxyz\",z";
+
+	// Every prefix ends at a different place in a block
+	for(std::size_t length = 0; length <= csv.size(); ++length) {
+		INFO("Length: " << length);
+		std::vector<char> copy(csv.begin(), csv.begin() + length);
+		csv_test_parser expected;
+		char* expected_out = 0;
+		bool const result = saxy::csv::parse(expected, copy.data(), copy.size(), &expected_out);
+
+		saxy::padded_buffer buffer(csv.data(), length);
+		CHECK(buffer.size() == length);
+		csv_test_parser converter;
+		char* out = 0;
+		CHECK(saxy::csv::parse(converter, buffer, &out) == result);
+		CHECK(out - buffer.data() == expected_out - copy.data());
+		CHECK(converter.xml == expected.xml);
+		CHECK(converter.csv_error == expected.csv_error);
+	}
+
+	// Bytes in the padding are never part of a field
+	saxy::padded_buffer buffer;
+	buffer.assign("a,b\r\nc,d", 8);
+	std::fill(buffer.data() + buffer.size(), buffer.data() + buffer.size() + saxy::padded_buffer::padding, 'x');
+	csv_test_parser converter;
+	CHECK(saxy::csv::parse(converter, buffer));
+	CHECK(converter.xml == "{[a][b]}{[c][d]}");
+
+	buffer.resize(3);
+	CHECK(std::string(buffer.data(), buffer.data() + buffer.size() + 1) == std::string("a,b\0", 4));
+}
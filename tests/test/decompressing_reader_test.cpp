@@ -0,0 +1,191 @@
+#include "catch/catch.hpp"
+
+#include "saxy/csv.hpp"
+#include "saxy/decompressing_reader.hpp"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+namespace {
+
+std::string gzip(std::string const& text) {
+	z_stream stream = z_stream();
+	deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	std::vector<char> out(deflateBound(&stream, text.size()));
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+	stream.avail_in = static_cast<uInt>(text.size());
+	stream.next_out = reinterpret_cast<Bytef*>(out.data());
+	stream.avail_out = static_cast<uInt>(out.size());
+	deflate(&stream, Z_FINISH);
+	std::string const result(out.data(), out.size() - stream.avail_out);
+	deflateEnd(&stream);
+	return result;
+}
+
+std::string read_all(std::string const& input, std::size_t buffer_size, std::string& error) {
+	std::istringstream in(input);
+	saxy::decompressing_reader reader(in, buffer_size, 2);
+	std::string result;
+	for(saxy::string_cview buffer = reader.next(); !buffer.empty(); buffer = reader.next()) {
+		result.append(buffer.data(), buffer.size());
+	}
+
+	error = reader.error();
+	return result;
+}
+
+// A parser that collects its input and stops after 'stop_after' bytes
+struct collecting_parser {
+	std::string text;
+	std::size_t stop_after;
+	bool finished;
+
+	explicit collecting_parser(std::size_t stop = -1)
+	: stop_after(stop)
+	, finished(false) {
+	}
+
+	bool parse(int, char const* it, char const* end, char const** out) {
+		for(; it != end && text.size() < stop_after; ++it) {
+			text += *it;
+		}
+
+		*out = it;
+		return true;
+	}
+
+	bool finish(int) {
+		finished = true;
+		return true;
+	}
+};
+
+// A CSV callback that notes where records with errors were skipped
+struct offset_recorder {
+	std::vector<std::size_t> offsets;
+
+	saxy::always_keep_going start_row() {
+		return saxy::keep_going;
+	}
+
+	saxy::always_keep_going field(saxy::string_cview) {
+		return saxy::keep_going;
+	}
+
+	saxy::always_keep_going end_row() {
+		return saxy::keep_going;
+	}
+
+	saxy::always_keep_going bad_record(saxy::csv::error_code, std::size_t offset) {
+		offsets.push_back(offset);
+		return saxy::keep_going;
+	}
+
+	saxy::always_abort error(saxy::csv::error_code) {
+		return saxy::abort;
+	}
+};
+
+}
+
+TEST_CASE("Decompressing reader", "[decompressing_reader]") {
+	std::string text;
+	for(int i = 0; i < 1000; ++i) {
+		std::ostringstream row;
+		row << i << ",\"" << i * i << "\r\n\"\r\n";
+		text += row.str();
+	}
+
+	std::size_t const sizes[] = { 1, 7, 64, 4096 };
+	for(std::size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		INFO("Buffer size: " << sizes[i]);
+		std::string error;
+		CHECK(read_all(text, sizes[i], error) == text);
+		CHECK(error.empty());
+		CHECK(read_all(gzip(text), sizes[i], error) == text);
+		CHECK(error.empty());
+		CHECK(read_all(gzip(text) + gzip("a,b\r\n"), sizes[i], error) == text + "a,b\r\n");
+		CHECK(error.empty());
+		CHECK(read_all("", sizes[i], error).empty());
+		CHECK(error.empty());
+	}
+
+	std::string error;
+	std::string corrupt = gzip(text);
+	corrupt[corrupt.size() / 2] ^= 0x55;
+	read_all(corrupt, 64, error);
+	CHECK(!error.empty());
+
+	// Everything before the end of a truncated archive is still returned
+	std::string const truncated = gzip(text).substr(0, gzip(text).size() - 10);
+	std::string const partial = read_all(truncated, 64, error);
+	CHECK(error == "unexpected end of compressed stream");
+	CHECK(!partial.empty());
+	CHECK(text.compare(0, partial.size(), partial) == 0);
+	read_all(gzip(text) + gzip("a,b\r\n").substr(0, 12), 64, error);
+	CHECK(error == "unexpected end of compressed stream");
+
+	CHECK(read_all(std::string("\x28\xB5\x2F\xFD", 4) + "data", 64, error).empty());
+	CHECK(error == "zstd is not supported");
+
+	{
+		// Stop reading before the helper thread has finished
+		std::istringstream in(gzip(text));
+		saxy::decompressing_reader reader(in, 16, 2);
+		CHECK(reader.next().size() == 16);
+	}
+
+	{
+		std::istringstream in(gzip(text));
+		saxy::decompressing_reader reader(in, 100, 3);
+		collecting_parser parser;
+		int cb = 0;
+		CHECK(saxy::parse(parser, cb, reader));
+		CHECK(parser.text == text);
+		CHECK(parser.finished);
+	}
+
+	{
+		std::istringstream in(gzip(text));
+		saxy::decompressing_reader reader(in, 100, 3);
+		collecting_parser parser(150);
+		int cb = 0;
+		CHECK(saxy::parse(parser, cb, reader));
+		CHECK(parser.text == text.substr(0, 150));
+		CHECK(!parser.finished);
+	}
+
+	// Offsets of skipped records count from the start of the decompressed
+	// input, not from the start of the buffer they were found in
+	{
+		std::string const bad = text + "a\"b\r\n" + text + "\"c\"d\r\n";
+		std::istringstream in(gzip(bad));
+		saxy::decompressing_reader reader(in, 100, 3);
+		saxy::csv::parser<> parser;
+		offset_recorder recorder;
+		CHECK(saxy::parse(parser, recorder, reader));
+		std::vector<std::size_t> const offsets = { text.size() + 1, 2 * text.size() + 8 };
+		CHECK(recorder.offsets == offsets);
+	}
+
+	{
+		std::istringstream in(truncated);
+		saxy::decompressing_reader reader(in, 100, 3);
+		collecting_parser parser;
+		int cb = 0;
+		CHECK(!saxy::parse(parser, cb, reader));
+		CHECK(!parser.finished);
+	}
+
+	{
+		std::istringstream in(corrupt);
+		saxy::decompressing_reader reader(in, 100, 3);
+		collecting_parser parser;
+		int cb = 0;
+		CHECK(!saxy::parse(parser, cb, reader));
+		CHECK(!parser.finished);
+	}
+}
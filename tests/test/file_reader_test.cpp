@@ -0,0 +1,112 @@
+#include "catch/catch.hpp"
+
+#include "saxy/file_reader.hpp"
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace {
+
+// A temporary file that is deleted when it goes out of scope
+struct temporary_file {
+	std::string path;
+
+	explicit temporary_file(std::string const& contents) {
+		char name[] = "/tmp/saxy_file_reader_XXXXXX";
+		int const fd = mkstemp(name);
+		REQUIRE(fd >= 0);
+		REQUIRE(write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size()));
+		close(fd);
+		path = name;
+	}
+
+	~temporary_file() {
+		std::remove(path.c_str());
+	}
+};
+
+std::string read_all(std::string const& path, std::size_t buffer_size, std::size_t buffers, bool asynchronous, std::string& error) {
+	saxy::file_reader reader(path.c_str(), buffer_size, buffers, asynchronous);
+	std::string result;
+	for(saxy::string_cview buffer = reader.next(); !buffer.empty(); buffer = reader.next()) {
+		CHECK(buffer.size() <= buffer_size);
+		result.append(buffer.data(), buffer.size());
+	}
+
+	error = reader.error();
+	return result;
+}
+
+// A parser that collects its input
+struct collecting_parser {
+	std::string text;
+	bool finished;
+
+	collecting_parser()
+	: finished(false) {
+	}
+
+	bool parse(int, char const* it, char const* end, char const** out) {
+		text.append(it, end);
+		*out = end;
+		return true;
+	}
+
+	bool finish(int) {
+		finished = true;
+		return true;
+	}
+};
+
+}
+
+TEST_CASE("File reader", "[file_reader]") {
+	std::string text;
+	for(int i = 0; i < 10000; ++i) {
+		std::ostringstream row;
+		row << i << ",\"" << i * i << "\"\r\n";
+		text += row.str();
+	}
+
+	temporary_file const file(text);
+	temporary_file const empty("");
+	for(int asynchronous = 0; asynchronous < 2; ++asynchronous) {
+		std::size_t const sizes[] = { 1000, 4096, 1 << 16, 1 << 20 };
+		std::size_t const counts[] = { 1, 2, 5 };
+		for(std::size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+			for(std::size_t j = 0; j < sizeof(counts) / sizeof(counts[0]); ++j) {
+				INFO("Asynchronous: " << asynchronous);
+				INFO("Buffer size: " << sizes[i]);
+				INFO("Buffers: " << counts[j]);
+				std::string error;
+				CHECK(read_all(file.path, sizes[i], counts[j], asynchronous != 0, error) == text);
+				CHECK(error.empty());
+				CHECK(read_all(empty.path, sizes[i], counts[j], asynchronous != 0, error).empty());
+				CHECK(error.empty());
+			}
+		}
+
+		std::string error;
+		CHECK(read_all("/nonexistent/saxy.csv", 4096, 2, asynchronous != 0, error).empty());
+		CHECK(!error.empty());
+
+		{
+			// Stop reading with reads still in flight
+			saxy::file_reader reader(file.path.c_str(), 4096, 4, asynchronous != 0);
+			CHECK(reader.next().size() == 4096);
+		}
+
+		{
+			saxy::file_reader reader(file.path.c_str(), 4096, 3, asynchronous != 0);
+			collecting_parser parser;
+			int cb = 0;
+			CHECK(saxy::parse(parser, cb, reader));
+			CHECK(parser.text == text);
+			CHECK(parser.finished);
+		}
+	}
+}
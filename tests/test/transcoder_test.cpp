@@ -0,0 +1,82 @@
+#include "catch/catch.hpp"
+
+#include "saxy/transcoder.hpp"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+std::string transcode(saxy::transcoder::encoding enc, std::string const& input, std::size_t split) {
+	saxy::transcoder t(enc);
+	std::vector<char> out;
+	t.convert(input.data(), split, out);
+	t.convert(input.data() + split, input.size() - split, out);
+	t.finish(out);
+	return std::string(out.begin(), out.end());
+}
+
+void check_transcoding(int line, saxy::transcoder::encoding enc, std::string const& input, std::string const& utf8) {
+	INFO("Line: " << line);
+	for(std::size_t i = 0; i <= input.size(); ++i) {
+		INFO("Split: " << i);
+		CHECK(transcode(enc, input, i) == utf8);
+	}
+}
+
+}
+
+TEST_CASE("Byte order marks are detected", "[transcoder]") {
+	check_transcoding(__LINE__, saxy::transcoder::detect, "", "");
+	check_transcoding(__LINE__, saxy::transcoder::detect, "a", "a");
+	check_transcoding(__LINE__, saxy::transcoder::detect, "ab,c", "ab,c");
+	check_transcoding(__LINE__, saxy::transcoder::detect, "\xEF\xBB\xBF" "a,b", "a,b");
+	check_transcoding(__LINE__, saxy::transcoder::detect, std::string("\xFF\xFE" "a\0,\0", 6), "a,");
+	check_transcoding(__LINE__, saxy::transcoder::detect, std::string("\xFE\xFF\0a\0,", 6), "a,");
+	check_transcoding(__LINE__, saxy::transcoder::detect, "\xFF\xFE", "");
+
+	// An explicit encoding only removes its own byte order mark
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, std::string("\xFF\xFE" "a\0", 4), "a");
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, std::string("a\0b\0", 4), "ab");
+	check_transcoding(__LINE__, saxy::transcoder::latin1, "\xFF\xFE", "\xC3\xBF\xC3\xBE");
+
+	saxy::transcoder t;
+	std::vector<char> out;
+	CHECK(t.source_encoding() == saxy::transcoder::detect);
+	t.convert("\xFE\xFF", 2, out);
+	CHECK(t.source_encoding() == saxy::transcoder::detect);
+	t.convert("\0a", 2, out);
+	CHECK(t.source_encoding() == saxy::transcoder::utf16be);
+}
+
+TEST_CASE("Latin-1 is converted to UTF-8", "[transcoder]") {
+	check_transcoding(__LINE__, saxy::transcoder::latin1, "caf\xE9", "caf\xC3\xA9");
+	check_transcoding(__LINE__, saxy::transcoder::latin1, "0123456789abcdef0123456789abcdef", "0123456789abcdef0123456789abcdef");
+	check_transcoding(__LINE__, saxy::transcoder::latin1, "0123456789abcdef\xA3" "0123456789abcdef\x80",
+	                                                      "0123456789abcdef\xC2\xA3" "0123456789abcdef\xC2\x80");
+}
+
+TEST_CASE("UTF-16 is converted to UTF-8", "[transcoder]") {
+	std::string const ascii = "0123456789abcdef0123456789,\r\n";
+	std::string le;
+	std::string be;
+	for(std::size_t i = 0; i < ascii.size(); ++i) {
+		le += ascii[i];
+		le += '\0';
+		be += '\0';
+		be += ascii[i];
+	}
+
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, le, ascii);
+	check_transcoding(__LINE__, saxy::transcoder::utf16be, be, ascii);
+
+	// U+00E9, U+20AC, U+1F600 and then ASCII to leave the slow path
+	std::string const mixed("\xE9\0\xAC\x20\x3D\xD8\x00\xDE" "0\0" "1\0" "2\0" "3\0" "4\0" "5\0" "6\0" "7\0", 24);
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, mixed, "\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80" "01234567");
+
+	// Unpaired surrogates and a truncated code unit are replaced
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, std::string("\x3D\xD8" "a\0", 4), "\xEF\xBF\xBD" "a");
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, std::string("\x00\xDE" "a\0", 4), "\xEF\xBF\xBD" "a");
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, std::string("a\0\x3D\xD8", 4), "a\xEF\xBF\xBD");
+	check_transcoding(__LINE__, saxy::transcoder::utf16le, std::string("a\0b", 3), "a\xEF\xBF\xBD");
+}